@@ -0,0 +1,199 @@
+#include "chunks.h"
+#include "decompress.h"
+#include "common.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+  char *start;
+  char *end; /* just past the chunk's last aio_eol (or the end of the file) */
+  aio_output *output;
+  
+  int status; /* what the scan function returned */
+  int ready; /* set by the worker once output is complete */
+} aio_chunk;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  char *next; /* start of the data no chunk has claimed yet */
+  char *end; /* end of the mapped file */
+  
+  aio_chunk *chunks; /* ring of chunks in flight */
+  int depth;
+  unsigned long claimed; /* chunks handed to workers so far */
+  unsigned long written; /* chunks passed on to the output so far */
+  int stopping;
+  
+  aio_chunk_fn scan;
+  aio_chunk_beginfn begin;
+  aio_chunk_endfn endfn;
+  void *context;
+} aio_chunks;
+
+/* Private declarations */
+
+static void *aio_chunks_work(void *arg);
+static void aio_chunks_cut(aio_chunks *chunks, aio_chunk *chunk);
+
+/* API */
+
+int aio_chunks_scan(int fd, int threads, aio_chunk_fn scan, aio_chunk_beginfn begin,
+  aio_chunk_endfn end, void *context, aio_output *output) {
+  struct stat st;
+  int res = 0;
+  int i;
+  
+  if(!aio_mmap_enabled || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return AIO_ERROR_CHUNKS_UNSUITABLE;
+  
+  if((off_t) (size_t) st.st_size != st.st_size)
+    return AIO_ERROR_CHUNKS_UNSUITABLE;
+  
+  size_t len = (size_t) st.st_size;
+  char *map = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED)
+    return AIO_ERROR_CHUNKS_UNSUITABLE;
+  
+  if(aio_decompress_enabled && aio_decompress_format(map, len) != AIO_FORMAT_PLAIN) {
+    munmap(map, len);
+    return AIO_ERROR_CHUNKS_UNSUITABLE;
+  }
+  
+  if(threads < 1)
+    threads = 1;
+  
+  aio_chunks chunks;
+  pthread_mutex_init(&chunks.lock, 0);
+  pthread_cond_init(&chunks.cond, 0);
+  chunks.next = map;
+  chunks.end = map + len;
+  chunks.depth = threads * AIO_CHUNKS_PER_THREAD;
+  chunks.chunks = xmalloc(sizeof(aio_chunk) * chunks.depth);
+  chunks.claimed = 0;
+  chunks.written = 0;
+  chunks.stopping = 0;
+  chunks.scan = scan;
+  chunks.begin = begin;
+  chunks.endfn = end;
+  chunks.context = context;
+  
+  for(i = 0; i < chunks.depth; ++i) {
+    chunks.chunks[i].output = aio_output_alloc(AIO_OUTPUT_MEMORY);
+    chunks.chunks[i].ready = 0;
+  }
+  
+  pthread_t *workers = xmalloc(sizeof(pthread_t) * threads);
+  for(i = 0; i < threads; ++i) {
+    if(pthread_create(&workers[i], 0, aio_chunks_work, &chunks) != 0) {
+      fprintf(stderr, "aio_chunks: could not start a thread\n");
+      exit(-2);
+    }
+  }
+  
+  /* The calling thread is the writer: it takes finished chunks in order. */
+  pthread_mutex_lock(&chunks.lock);
+  for(;;) {
+    aio_chunk *chunk = &chunks.chunks[chunks.written % chunks.depth];
+    
+    while(!(chunks.written < chunks.claimed && chunk->ready)) {
+      if(chunks.written == chunks.claimed && chunks.next == chunks.end)
+        break;
+      pthread_cond_wait(&chunks.cond, &chunks.lock);
+    }
+    
+    if(!chunk->ready)
+      break; /* every chunk has been written */
+    
+    pthread_mutex_unlock(&chunks.lock);
+    
+    if((res = chunk->status) == 0)
+      res = aio_output_write(output, chunk->output->data, chunk->output->used);
+    chunk->output->used = 0;
+    
+    pthread_mutex_lock(&chunks.lock);
+    chunk->ready = 0;
+    ++chunks.written;
+    pthread_cond_broadcast(&chunks.cond);
+    
+    if(res != 0)
+      break;
+  }
+  
+  chunks.stopping = 1;
+  pthread_cond_broadcast(&chunks.cond);
+  pthread_mutex_unlock(&chunks.lock);
+  
+  for(i = 0; i < threads; ++i)
+    pthread_join(workers[i], 0);
+  
+  for(i = 0; i < chunks.depth; ++i)
+    aio_output_free(chunks.chunks[i].output);
+  
+  free(workers);
+  free(chunks.chunks);
+  pthread_mutex_destroy(&chunks.lock);
+  pthread_cond_destroy(&chunks.cond);
+  munmap(map, len);
+  
+  return res;
+}
+
+/* Private implementations */
+
+/* Worker thread: claims the next chunk whenever there is room in the ring and scans it. */
+static void *aio_chunks_work(void *arg) {
+  aio_chunks *chunks = (aio_chunks *) arg;
+  void *state = (chunks->begin ? chunks->begin(chunks->context) : chunks->context);
+  aio_buffer *lines = aio_buffer_alloc();
+  
+  pthread_mutex_lock(&chunks->lock);
+  for(;;) {
+    while(!chunks->stopping && chunks->next < chunks->end
+      && chunks->claimed - chunks->written >= (unsigned long) chunks->depth)
+      pthread_cond_wait(&chunks->cond, &chunks->lock);
+    
+    if(chunks->stopping || chunks->next == chunks->end)
+      break;
+    
+    aio_chunk *chunk = &chunks->chunks[chunks->claimed % chunks->depth];
+    aio_chunks_cut(chunks, chunk);
+    ++chunks->claimed;
+    pthread_mutex_unlock(&chunks->lock);
+    
+    aio_buffer_wrap(lines, chunk->start, chunk->end);
+    int status = chunks->scan(lines, chunk->output, state);
+    
+    pthread_mutex_lock(&chunks->lock);
+    chunk->status = status;
+    chunk->ready = 1;
+    pthread_cond_broadcast(&chunks->cond);
+  }
+  pthread_cond_broadcast(&chunks->cond);
+  pthread_mutex_unlock(&chunks->lock);
+  
+  aio_buffer_free(lines);
+  if(chunks->endfn)
+    chunks->endfn(state);
+  
+  return 0;
+}
+
+/* Gives the next AIO_CHUNK_SIZE or so bytes to the chunk, extending them to the end of
+ * the line they stop in. Called with the lock held, since chunks have to be cut in order.
+ */
+static void aio_chunks_cut(aio_chunks *chunks, aio_chunk *chunk) {
+  chunk->start = chunks->next;
+  
+  if((size_t) (chunks->end - chunk->start) <= AIO_CHUNK_SIZE) {
+    chunk->end = chunks->end;
+  } else {
+    char *limit = chunk->start + AIO_CHUNK_SIZE - 1;
+    char *eol = memchr(limit, aio_eol, chunks->end - limit);
+    chunk->end = (eol ? eol + 1 : chunks->end);
+  }
+  
+  chunks->next = chunk->end;
+}
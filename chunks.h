@@ -0,0 +1,43 @@
+/* Scans a large regular file on several threads. The file is mapped as a whole and cut
+ * into chunks of about AIO_CHUNK_SIZE bytes that always end right after an aio_eol, so
+ * no line is ever split between two chunks. Worker threads take chunks in file order and
+ * split them into lines with their own aio_buffer (in AIO_MODE_MEMORY); whatever they
+ * write goes to an in-memory aio_output per chunk. The calling thread passes those on to
+ * the real output strictly in file order, so the result is byte-for-byte the same as
+ * scanning the file from start to end on one thread.
+ */
+
+#include "input.h"
+#include "output.h"
+
+#ifndef AIO_CHUNKS
+#define AIO_CHUNKS
+
+#define AIO_CHUNK_SIZE (1 << 22)
+#define AIO_CHUNKS_PER_THREAD 2 /* chunks in flight per worker while the writer catches up */
+
+#define AIO_ERROR_CHUNKS_UNSUITABLE (-7500)
+
+/* Called once on every worker thread with the context; returns the worker's state. */
+typedef void *(*aio_chunk_beginfn)(void *context);
+
+/* Scans every line of the chunk in lines and writes the result to output.
+ * Returning anything but 0 stops the scan and makes aio_chunks_scan return that value.
+ */
+typedef int (*aio_chunk_fn)(aio_buffer *lines, aio_output *output, void *state);
+
+/* Frees the state returned by the begin function. */
+typedef void (*aio_chunk_endfn)(void *state);
+
+/* Scans fd on threads worker threads as described above. begin and end may be 0, in
+ * which case every worker gets the context itself as its state.
+ *
+ * Returns AIO_ERROR_CHUNKS_UNSUITABLE without touching output if fd is not a non-empty
+ * regular file that can be mapped, or if it is compressed; the caller should fall back to
+ * an aio_buffer. Otherwise returns 0 or the first error from scan or from output.
+ * Output is not flushed.
+ */
+int aio_chunks_scan(int fd, int threads, aio_chunk_fn scan, aio_chunk_beginfn begin,
+  aio_chunk_endfn end, void *context, aio_output *output);
+
+#endif
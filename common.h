@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifndef COMMON
 #define COMMON
@@ -38,4 +40,29 @@ inline static void *xrealloc(void *ptr, size_t size) {
   return ptr;
 }
 
+/*
+ * safe posix_memalign
+ */
+inline static void *xmemalign(size_t alignment, size_t size) {
+  void *ptr = 0;
+  
+  assert(size != 0);
+  if(posix_memalign(&ptr, alignment, size) != 0) {
+    fprintf(stderr, "posix_memalign failed - out of memory, most likely\n");
+    exit(-2);
+  }
+  
+  return ptr;
+}
+
+/*
+ * monotonic clock in nanoseconds
+ */
+inline static uint64_t nanotime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
 #endif
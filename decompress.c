@@ -0,0 +1,618 @@
+#include "decompress.h"
+#include "input.h"
+#include "common.h"
+#include <sys/mman.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Everything a decoder thread needs. The input buffer starts out holding the prefix. */
+typedef struct {
+  int fd;
+  int format;
+  
+  char *in; /* compressed input */
+  size_t insize; /* allocated size of .in */
+  size_t inlength; /* bytes of .in that are valid */
+  int eof;
+} aio_decoder;
+
+/* A run of complete members/frames for a worker to decode into a slot. */
+typedef struct {
+  const char *src;
+  size_t length;
+  aio_slot *slot;
+} aio_job;
+
+/* State shared by the dispatcher and the workers of a parallel decoder. */
+typedef struct {
+  int format;
+  char *map; /* the whole compressed file */
+  size_t size;
+  
+  aio_stage *stage;
+  pthread_t *workers;
+  int threads;
+  
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  aio_job *jobs; /* ring with one entry per stage slot - there can't be more jobs than slots */
+  int depth;
+  unsigned long head;
+  unsigned long tail;
+  int done;
+} aio_parallel;
+
+/* Private declarations */
+
+static void aio_decoder_free(void *context);
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+static size_t aio_decoder_read(aio_decoder *decoder);
+static void aio_decoder_finish(aio_stage *stage, aio_slot *slot, int status);
+#endif
+#ifdef HAVE_ZLIB
+static void aio_decode_gzip(aio_stage *stage, void *context);
+#endif
+#ifdef HAVE_ZSTD
+static void aio_decode_zstd(aio_stage *stage, void *context);
+#endif
+static void aio_decode_parallel(aio_stage *stage, void *context);
+static void *aio_parallel_work(void *arg);
+static size_t aio_parallel_batch(aio_parallel *parallel, size_t pos, size_t *estimate);
+static int aio_parallel_decode(aio_parallel *parallel, aio_job *job, void *state);
+static size_t aio_parallel_member(aio_parallel *parallel, size_t pos, int *status);
+static void aio_parallel_free(void *context);
+
+/* API */
+
+int aio_decompress_format(const char *bytes, size_t length) {
+  #if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+  const unsigned char *b = (const unsigned char *) bytes;
+  #endif
+  
+  #ifdef HAVE_ZLIB
+  if(length >= 2 && b[0] == 0x1f && b[1] == 0x8b)
+    return AIO_FORMAT_GZIP;
+  #endif
+  
+  #ifdef HAVE_ZSTD
+  if(length >= 4 && b[0] == 0x28 && b[1] == 0xb5 && b[2] == 0x2f && b[3] == 0xfd)
+    return AIO_FORMAT_ZSTD;
+  #endif
+  
+  return AIO_FORMAT_PLAIN;
+}
+
+aio_stage *aio_stage_decoder(int fd, int format, const char *prefix, size_t prefixlen,
+  int depth, size_t bufsize, size_t headroom) {
+  aio_decoder *decoder = xmalloc(sizeof(aio_decoder));
+  decoder->fd = fd;
+  decoder->format = format;
+  decoder->insize = (prefixlen > AIO_DECOMPRESS_INSIZE ? prefixlen : AIO_DECOMPRESS_INSIZE);
+  decoder->in = xmalloc(decoder->insize);
+  decoder->inlength = prefixlen;
+  decoder->eof = 0;
+  memcpy(decoder->in, prefix, prefixlen);
+  
+  aio_stage_fn producer = 0;
+  switch(format) {
+    #ifdef HAVE_ZLIB
+    case AIO_FORMAT_GZIP:
+    producer = aio_decode_gzip;
+    break;
+    #endif
+    #ifdef HAVE_ZSTD
+    case AIO_FORMAT_ZSTD:
+    producer = aio_decode_zstd;
+    break;
+    #endif
+  }
+  assert(producer);
+  
+  return aio_stage_start(depth, bufsize, headroom, producer, decoder, aio_decoder_free);
+}
+
+aio_stage *aio_stage_parallel_decoder(int fd, int format, size_t filesize, int threads, size_t headroom) {
+  char *map = mmap(0, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED)
+    return 0;
+  
+  aio_parallel *parallel = xmalloc(sizeof(aio_parallel));
+  parallel->format = format;
+  parallel->map = map;
+  parallel->size = filesize;
+  
+  /* Only worth it if the first job doesn't already cover the whole file. */
+  size_t estimate;
+  size_t first = aio_parallel_batch(parallel, 0, &estimate);
+  if(first == 0 || first >= filesize) {
+    munmap(map, filesize);
+    free(parallel);
+    return 0;
+  }
+  
+  madvise(map, filesize, MADV_SEQUENTIAL);
+  
+  parallel->threads = threads;
+  parallel->workers = xmalloc(sizeof(pthread_t) * threads);
+  parallel->depth = 2 * threads + 2;
+  parallel->jobs = xmalloc(sizeof(aio_job) * parallel->depth);
+  parallel->head = 0;
+  parallel->tail = 0;
+  parallel->done = 0;
+  pthread_mutex_init(&parallel->lock, 0);
+  pthread_cond_init(&parallel->cond, 0);
+  
+  return aio_stage_start(parallel->depth, AIO_PARALLEL_BATCH, headroom,
+    aio_decode_parallel, parallel, aio_parallel_free);
+}
+
+/* Private implementations */
+
+static void aio_decoder_free(void *context) {
+  aio_decoder *decoder = (aio_decoder *) context;
+  
+  free(decoder->in);
+  free(decoder);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Refills the input buffer from the descriptor. Returns the number of bytes read;
+ * sets .eof on end of file or error.
+ */
+static size_t aio_decoder_read(aio_decoder *decoder) {
+  ssize_t bytesread;
+  
+  while((bytesread = read(decoder->fd, decoder->in, decoder->insize)) < 0 && errno == EINTR)
+    continue;
+  
+  if(bytesread <= 0) {
+    decoder->eof = 1;
+    decoder->inlength = 0;
+    return 0;
+  }
+  
+  decoder->inlength = bytesread;
+  return bytesread;
+}
+
+/* Commits the slot if it holds anything, then commits a final slot with the status. */
+static void aio_decoder_finish(aio_stage *stage, aio_slot *slot, int status) {
+  if(slot->length) {
+    aio_stage_commit(stage, slot);
+    if(!(slot = aio_stage_reserve(stage)))
+      return;
+  }
+  
+  slot->status = status;
+  aio_stage_commit(stage, slot);
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/* Inflates one or more concatenated gzip members (the same thing zcat does). Anything
+ * after the last member that isn't another member is ignored, like gzip's trailing garbage.
+ */
+static void aio_decode_gzip(aio_stage *stage, void *context) {
+  aio_decoder *decoder = (aio_decoder *) context;
+  z_stream zs;
+  int res = Z_OK;
+  int status = AIO_ERROR_END_BUFFER;
+  
+  memset(&zs, 0, sizeof(zs));
+  if(inflateInit2(&zs, 15 + 16) != Z_OK) {
+    aio_slot *slot = aio_stage_reserve(stage);
+    if(slot)
+      aio_decoder_finish(stage, slot, AIO_ERROR_DECOMPRESS);
+    return;
+  }
+  
+  zs.next_in = (Bytef *) decoder->in;
+  zs.avail_in = decoder->inlength;
+  
+  aio_slot *slot = aio_stage_reserve(stage);
+  while(slot) {
+    if(zs.avail_in == 0) {
+      if(!aio_decoder_read(decoder)) {
+        /* A member that hasn't reached Z_STREAM_END is truncated. */
+        if(res != Z_STREAM_END && zs.total_in > 0)
+          status = AIO_ERROR_DECOMPRESS;
+        break;
+      }
+      zs.next_in = (Bytef *) decoder->in;
+      zs.avail_in = decoder->inlength;
+    }
+    
+    if(res == Z_STREAM_END) {
+      /* another member follows, unless this is trailing garbage */
+      if(zs.next_in[0] != 0x1f)
+        break;
+      inflateReset(&zs);
+    }
+    
+    zs.next_out = (Bytef *) slot->start + slot->length;
+    zs.avail_out = slot->capacity - slot->length;
+    
+    res = inflate(&zs, Z_NO_FLUSH);
+    slot->length = slot->capacity - zs.avail_out;
+    
+    if(res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+      status = AIO_ERROR_DECOMPRESS;
+      break;
+    }
+    
+    if(slot->length == slot->capacity) {
+      aio_stage_commit(stage, slot);
+      slot = aio_stage_reserve(stage);
+    }
+  }
+  
+  if(slot)
+    aio_decoder_finish(stage, slot, status);
+  
+  inflateEnd(&zs);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* Decodes one or more concatenated zstd frames. */
+static void aio_decode_zstd(aio_stage *stage, void *context) {
+  aio_decoder *decoder = (aio_decoder *) context;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  ZSTD_inBuffer in = {decoder->in, decoder->inlength, 0};
+  ZSTD_outBuffer out;
+  size_t res = 0;
+  int status = AIO_ERROR_END_BUFFER;
+  
+  aio_slot *slot = aio_stage_reserve(stage);
+  while(slot && dctx) {
+    if(in.pos == in.size) {
+      if(!aio_decoder_read(decoder)) {
+        /* ZSTD_decompressStream returns 0 only once a frame is complete */
+        if(res != 0)
+          status = AIO_ERROR_DECOMPRESS;
+        break;
+      }
+      in.src = decoder->in;
+      in.size = decoder->inlength;
+      in.pos = 0;
+    }
+    
+    out.dst = slot->start;
+    out.size = slot->capacity;
+    out.pos = slot->length;
+    
+    res = ZSTD_decompressStream(dctx, &out, &in);
+    slot->length = out.pos;
+    
+    if(ZSTD_isError(res)) {
+      status = AIO_ERROR_DECOMPRESS;
+      break;
+    }
+    
+    if(slot->length == slot->capacity) {
+      aio_stage_commit(stage, slot);
+      slot = aio_stage_reserve(stage);
+    }
+  }
+  
+  if(!dctx)
+    status = AIO_ERROR_DECOMPRESS;
+  
+  if(slot)
+    aio_decoder_finish(stage, slot, status);
+  
+  ZSTD_freeDCtx(dctx);
+}
+#endif
+
+/* Returns the total size of the BGZF block at pos, or 0 if it isn't one (or is cut short). */
+static size_t aio_bgzf_blocksize(const unsigned char *b, size_t length) {
+  if(length < 18 || b[0] != 0x1f || b[1] != 0x8b || b[2] != 8 || !(b[3] & 4))
+    return 0;
+  
+  size_t xlen = b[10] | (b[11] << 8);
+  if(12 + xlen > length)
+    return 0;
+  
+  const unsigned char *x = b + 12;
+  const unsigned char *xend = x + xlen;
+  while(x + 4 <= xend) {
+    size_t slen = x[2] | (x[3] << 8);
+    if(x[0] == 'B' && x[1] == 'C' && slen == 2 && x + 6 <= xend) {
+      size_t blocksize = (x[4] | (x[5] << 8)) + 1;
+      return (blocksize <= length && blocksize >= 12 + xlen + 8 ? blocksize : 0);
+    }
+    x += 4 + slen;
+  }
+  
+  return 0;
+}
+
+/* Returns how many bytes starting at pos can be handed to a worker as one job (0 if the
+ * piece at pos can't be delimited without decoding it) and an estimate of the decoded size.
+ */
+static size_t aio_parallel_batch(aio_parallel *parallel, size_t pos, size_t *estimate) {
+  const unsigned char *map = (const unsigned char *) parallel->map;
+  size_t start = pos;
+  *estimate = 0;
+  
+  while(pos < parallel->size && *estimate < AIO_PARALLEL_BATCH) {
+    size_t piece = 0;
+    size_t decoded = 0;
+    
+    switch(parallel->format) {
+      case AIO_FORMAT_GZIP:
+      if((piece = aio_bgzf_blocksize(map + pos, parallel->size - pos))) {
+        const unsigned char *isize = map + pos + piece - 4;
+        decoded = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((size_t) isize[3] << 24);
+      }
+      break;
+      #ifdef HAVE_ZSTD
+      case AIO_FORMAT_ZSTD:
+      piece = ZSTD_findFrameCompressedSize(map + pos, parallel->size - pos);
+      if(ZSTD_isError(piece)) {
+        piece = 0;
+      } else {
+        unsigned long long content = ZSTD_getFrameContentSize(map + pos, piece);
+        decoded = (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR ? 4 * piece : content);
+      }
+      break;
+      #endif
+    }
+    
+    if(!piece)
+      break;
+    
+    pos += piece;
+    *estimate += decoded;
+  }
+  
+  return pos - start;
+}
+
+/* The parallel decoder's producer: walks the file, reserving a slot for every job in file
+ * order so the output is re-sequenced by the stage, and feeds the jobs to the workers.
+ */
+static void aio_decode_parallel(aio_stage *stage, void *context) {
+  aio_parallel *parallel = (aio_parallel *) context;
+  size_t pos = 0;
+  int status = AIO_ERROR_END_BUFFER;
+  aio_slot *slot;
+  int i;
+  
+  parallel->stage = stage;
+  for(i = 0; i < parallel->threads; ++i) {
+    if(pthread_create(&parallel->workers[i], 0, aio_parallel_work, parallel) != 0) {
+      fprintf(stderr, "aio_stage: could not start a thread\n");
+      exit(-2);
+    }
+  }
+  
+  while(pos < parallel->size) {
+    size_t estimate;
+    size_t length = aio_parallel_batch(parallel, pos, &estimate);
+    
+    if(!length) {
+      /* not independently decodable - decode a single member right here */
+      if(!(length = aio_parallel_member(parallel, pos, &status)))
+        break;
+      pos += length;
+      continue;
+    }
+    
+    if(!(slot = aio_stage_reserve(stage))) {
+      status = 0;
+      break;
+    }
+    aio_slot_grow(slot, estimate);
+    
+    pthread_mutex_lock(&parallel->lock);
+    aio_job *job = &parallel->jobs[parallel->tail % parallel->depth];
+    job->src = parallel->map + pos;
+    job->length = length;
+    job->slot = slot;
+    ++parallel->tail;
+    pthread_cond_signal(&parallel->cond);
+    pthread_mutex_unlock(&parallel->lock);
+    
+    pos += length;
+  }
+  
+  /* The end of the stream goes in the next slot; the stage makes sure the consumer gets
+   * to it only after the jobs before it have been committed.
+   */
+  if(status && (slot = aio_stage_reserve(stage))) {
+    slot->status = status;
+    aio_stage_commit(stage, slot);
+  }
+  
+  pthread_mutex_lock(&parallel->lock);
+  parallel->done = 1;
+  pthread_cond_broadcast(&parallel->cond);
+  pthread_mutex_unlock(&parallel->lock);
+  
+  for(i = 0; i < parallel->threads; ++i)
+    pthread_join(parallel->workers[i], 0);
+}
+
+static void *aio_parallel_work(void *arg) {
+  aio_parallel *parallel = (aio_parallel *) arg;
+  void *state = 0;
+  aio_job job;
+  
+  #ifdef HAVE_ZLIB
+  z_stream zs;
+  if(parallel->format == AIO_FORMAT_GZIP) {
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, 15 + 16) == Z_OK)
+      state = &zs;
+  }
+  #endif
+  #ifdef HAVE_ZSTD
+  if(parallel->format == AIO_FORMAT_ZSTD)
+    state = ZSTD_createDCtx();
+  #endif
+  
+  for(;;) {
+    pthread_mutex_lock(&parallel->lock);
+    while(!parallel->done && parallel->head == parallel->tail)
+      pthread_cond_wait(&parallel->cond, &parallel->lock);
+    
+    if(parallel->head == parallel->tail) {
+      pthread_mutex_unlock(&parallel->lock);
+      break;
+    }
+    
+    job = parallel->jobs[parallel->head % parallel->depth];
+    ++parallel->head;
+    pthread_mutex_unlock(&parallel->lock);
+    
+    job.slot->status = (state ? aio_parallel_decode(parallel, &job, state) : AIO_ERROR_DECOMPRESS);
+    aio_stage_commit(parallel->stage, job.slot);
+  }
+  
+  #ifdef HAVE_ZLIB
+  if(parallel->format == AIO_FORMAT_GZIP && state)
+    inflateEnd(&zs);
+  #endif
+  #ifdef HAVE_ZSTD
+  if(parallel->format == AIO_FORMAT_ZSTD)
+    ZSTD_freeDCtx(state);
+  #endif
+  
+  return 0;
+}
+
+/* Decodes every member/frame of the job into its slot, growing the slot if the estimate
+ * was short. Returns 0 or AIO_ERROR_DECOMPRESS.
+ */
+static int aio_parallel_decode(aio_parallel *parallel, aio_job *job, void *state) {
+  switch(parallel->format) {
+    #ifdef HAVE_ZLIB
+    case AIO_FORMAT_GZIP: {
+      aio_slot *slot = job->slot;
+      z_stream *zs = (z_stream *) state;
+      zs->next_in = (Bytef *) job->src;
+      zs->avail_in = job->length;
+      
+      while(zs->avail_in) {
+        int res;
+        
+        inflateReset(zs);
+        do {
+          if(slot->length == slot->capacity)
+            aio_slot_grow(slot, slot->capacity * 2);
+          
+          zs->next_out = (Bytef *) slot->start + slot->length;
+          zs->avail_out = slot->capacity - slot->length;
+          res = inflate(zs, Z_NO_FLUSH);
+          slot->length = slot->capacity - zs->avail_out;
+        } while(res == Z_OK || (res == Z_BUF_ERROR && zs->avail_out == 0));
+        
+        if(res != Z_STREAM_END)
+          return AIO_ERROR_DECOMPRESS;
+      }
+      
+      return 0;
+    }
+    #endif
+    #ifdef HAVE_ZSTD
+    case AIO_FORMAT_ZSTD: {
+      aio_slot *slot = job->slot;
+      ZSTD_inBuffer in = {job->src, job->length, 0};
+      ZSTD_outBuffer out;
+      size_t res = 0;
+      
+      while(in.pos < in.size || res != 0) {
+        if(slot->length == slot->capacity)
+          aio_slot_grow(slot, slot->capacity * 2);
+        
+        out.dst = slot->start;
+        out.size = slot->capacity;
+        out.pos = slot->length;
+        
+        res = ZSTD_decompressStream((ZSTD_DCtx *) state, &out, &in);
+        slot->length = out.pos;
+        
+        if(ZSTD_isError(res) || (in.pos == in.size && res != 0 && out.pos < out.size))
+          return AIO_ERROR_DECOMPRESS;
+      }
+      
+      return 0;
+    }
+    #endif
+  }
+  
+  return AIO_ERROR_DECOMPRESS;
+}
+
+/* Decodes the single gzip member at pos on the dispatching thread, committing slots in
+ * order as they fill up. Returns the size of the member, or 0 with *status set to
+ * AIO_ERROR_DECOMPRESS if it is corrupt or to 0 if the stage is shutting down.
+ */
+static size_t aio_parallel_member(aio_parallel *parallel, size_t pos, int *status) {
+  *status = AIO_ERROR_DECOMPRESS;
+  
+  #ifdef HAVE_ZLIB
+  aio_slot *slot = 0;
+  z_stream zs;
+  int res = Z_OK;
+  
+  if(parallel->format != AIO_FORMAT_GZIP)
+    return 0;
+  
+  /* trailing garbage after the last member is ignored, same as aio_decode_gzip */
+  if((unsigned char) parallel->map[pos] != 0x1f) {
+    *status = AIO_ERROR_END_BUFFER;
+    return parallel->size - pos;
+  }
+  
+  memset(&zs, 0, sizeof(zs));
+  if(inflateInit2(&zs, 15 + 16) != Z_OK)
+    return 0;
+  
+  zs.next_in = (Bytef *) parallel->map + pos;
+  zs.avail_in = parallel->size - pos;
+  
+  while(res == Z_OK) {
+    if(!(slot = aio_stage_reserve(parallel->stage))) {
+      *status = 0;
+      break;
+    }
+    
+    zs.next_out = (Bytef *) slot->start;
+    zs.avail_out = slot->capacity;
+    while((res = inflate(&zs, Z_NO_FLUSH)) == Z_OK && zs.avail_out)
+      continue;
+    slot->length = slot->capacity - zs.avail_out;
+    aio_stage_commit(parallel->stage, slot);
+  }
+  
+  inflateEnd(&zs);
+  
+  if(res != Z_STREAM_END)
+    return 0;
+  
+  *status = AIO_ERROR_END_BUFFER;
+  return zs.total_in;
+  #else
+  return 0;
+  #endif
+}
+
+static void aio_parallel_free(void *context) {
+  aio_parallel *parallel = (aio_parallel *) context;
+  
+  pthread_mutex_destroy(&parallel->lock);
+  pthread_cond_destroy(&parallel->cond);
+  munmap(parallel->map, parallel->size);
+  free(parallel->workers);
+  free(parallel->jobs);
+  free(parallel);
+}
@@ -0,0 +1,46 @@
+/* Transparent decompression of aio_buffer input. Compressed streams are recognized by
+ * their magic bytes and decoded by an aio_stage producer thread, so decompression of the
+ * next chunk overlaps with whatever the consumer does with the current one.
+ *
+ * Support for each format is compiled in with HAVE_ZLIB (gzip) and HAVE_ZSTD (zstd).
+ * Formats that weren't compiled in are passed through as plain data.
+ */
+
+#include "stage.h"
+
+#ifndef AIO_DECOMPRESS
+#define AIO_DECOMPRESS
+
+#define AIO_FORMAT_PLAIN 0
+#define AIO_FORMAT_GZIP 1
+#define AIO_FORMAT_ZSTD 2
+
+#define AIO_DECOMPRESS_INSIZE (1 << 17) /* compressed bytes read at a time */
+#define AIO_DECOMPRESS_OUTSIZE (1 << 18) /* minimum decompressed bytes per slot */
+#define AIO_DECOMPRESS_DEPTH 4 /* slots in flight unless aio_readahead asks for more */
+#define AIO_PARALLEL_BATCH (1 << 20) /* decoded bytes per job for parallel decoding */
+
+/* Returns the AIO_FORMAT_ of the stream starting with bytes, or AIO_FORMAT_PLAIN if it
+ * isn't compressed or the format isn't supported by this build.
+ */
+int aio_decompress_format(const char *bytes, size_t length);
+
+/* Starts a stage that decodes fd. The first prefixlen bytes of the stream have already been
+ * read from fd and are passed in prefix (the stage makes its own copy).
+ */
+aio_stage *aio_stage_decoder(int fd, int format, const char *prefix, size_t prefixlen,
+  int depth, size_t bufsize, size_t headroom);
+
+/* Starts a stage that decodes the regular file fd of filesize bytes on threads worker
+ * threads. The file must consist of independently compressed pieces that can be found
+ * without decoding: BGZF blocks (gzip members carrying their own size in a "BC" extra
+ * field) or zstd frames. Consecutive pieces are grouped into jobs of about
+ * AIO_PARALLEL_BATCH decoded bytes, and output comes out in file order.
+ * Any plain gzip members in between are decoded in order by the dispatching thread.
+ *
+ * Returns 0 if the file doesn't qualify (e.g. a single gzip member or zstd frame) or
+ * can't be mapped, in which case the caller should use aio_stage_decoder.
+ */
+aio_stage *aio_stage_parallel_decoder(int fd, int format, size_t filesize, int threads, size_t headroom);
+
+#endif
@@ -0,0 +1,276 @@
+#include "follow.h"
+#include "common.h"
+#include <sys/inotify.h>
+#include <poll.h>
+
+/* Private declarations */
+
+static int aio_follow_attach(aio_follow *follow);
+static void aio_follow_closefd(aio_follow *follow);
+static void aio_follow_watch(aio_follow *follow);
+static int aio_follow_sleep(aio_follow *follow);
+static void aio_follow_load(aio_follow *follow);
+static void aio_follow_save(aio_follow *follow);
+
+/* API */
+
+aio_follow *aio_follow_open(const char *path, aio_buffer *buffer, const char *statepath,
+  volatile sig_atomic_t *stop) {
+  aio_follow *follow = xmalloc(sizeof(aio_follow));
+  follow->path = strdup(path);
+  follow->buffer = buffer;
+  follow->fd = -1;
+  follow->offset = 0;
+  follow->seen = 0;
+  follow->filewd = -1;
+  follow->dirwd = -1;
+  follow->statepath = (statepath ? strdup(statepath) : 0);
+  follow->saved = time(0);
+  follow->stop = stop;
+  
+  follow->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(follow->inotify != -1) {
+    /* the directory is watched for the name coming back after a rotation */
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if(slash == dir)
+      slash[1] = '\0';
+    else if(slash)
+      *slash = '\0';
+    
+    follow->dirwd = inotify_add_watch(follow->inotify, (slash ? dir : "."), IN_CREATE | IN_MOVED_TO);
+    free(dir);
+  }
+  
+  if(aio_follow_attach(follow) != 0) {
+    aio_follow_free(follow);
+    return 0;
+  }
+  
+  aio_follow_load(follow);
+  return follow;
+}
+
+int aio_follow_wait(aio_follow *follow) {
+  struct stat st;
+  int res;
+  
+  for(;;) {
+    if(follow->stop && *follow->stop)
+      return AIO_ERROR_FOLLOW_INTERRUPTED;
+    
+    /* the file was rotated away and nothing has taken its name yet */
+    if(follow->fd == -1) {
+      if(aio_follow_attach(follow) != 0) {
+        if((res = aio_follow_sleep(follow)) != 0)
+          return res;
+        continue;
+      }
+      
+      follow->offset = follow->seen = 0;
+    }
+    
+    if(fstat(follow->fd, &st) != 0)
+      return AIO_ERROR_IO_READ_ERROR;
+    
+    /* truncated in place (copytruncate): start over */
+    if(st.st_size < follow->seen)
+      follow->offset = follow->seen = 0;
+    
+    if(st.st_size > follow->seen) {
+      if(lseek(follow->fd, follow->offset, SEEK_SET) == (off_t) -1)
+        return AIO_ERROR_IO_READ_ERROR;
+      
+      res = aio_buffer_init_raw(follow->buffer, follow->fd);
+      if(res != AIO_ERROR_END_BUFFER)
+        return res;
+      
+      follow->seen = follow->offset;
+      continue;
+    }
+    
+    /* Everything in the current file has been read. If the name now belongs to another
+     * file, the current one has been rotated away and the new one is read from its start.
+     */
+    if(stat(follow->path, &st) == 0 && (st.st_dev != follow->dev || st.st_ino != follow->ino)) {
+      aio_follow_closefd(follow);
+      if(aio_follow_attach(follow) == 0) {
+        follow->offset = follow->seen = 0;
+        aio_follow_save(follow);
+      }
+      continue;
+    }
+    
+    if((res = aio_follow_sleep(follow)) != 0)
+      return res;
+  }
+}
+
+void aio_follow_done(aio_follow *follow) {
+  aio_buffer *buffer = follow->buffer;
+  off_t pos = lseek(follow->fd, 0, SEEK_CUR);
+  if(pos == (off_t) -1)
+    return;
+  
+  /* the line aio_buffer_loadline stopped at has no aio_eol yet */
+  off_t partial = buffer->linelimit - buffer->linestart;
+  if(partial < 0)
+    partial = 0;
+  
+  follow->offset = pos - partial;
+  follow->seen = pos;
+  
+  if(time(0) - follow->saved >= AIO_FOLLOW_INTERVAL / 1000)
+    aio_follow_save(follow);
+}
+
+void aio_follow_free(aio_follow *follow) {
+  if(follow->fd != -1)
+    aio_follow_save(follow);
+  
+  aio_follow_closefd(follow);
+  if(follow->inotify != -1)
+    close(follow->inotify);
+  
+  free(follow->path);
+  free(follow->statepath);
+  free(follow);
+}
+
+/* Private implementations */
+
+/* Opens whatever file is at the path now and makes it the current one. */
+static int aio_follow_attach(aio_follow *follow) {
+  struct stat st;
+  
+  int fd = open(follow->path, O_RDONLY);
+  if(fd == -1)
+    return AIO_ERROR_IO_READ_ERROR;
+  
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    return AIO_ERROR_IO_READ_ERROR;
+  }
+  
+  follow->fd = fd;
+  follow->dev = st.st_dev;
+  follow->ino = st.st_ino;
+  aio_follow_watch(follow);
+  
+  return 0;
+}
+
+/* Closes the current file. Once aio_follow_wait has handed it to the buffer it is the
+ * buffer's descriptor and has to be closed through it.
+ */
+static void aio_follow_closefd(aio_follow *follow) {
+  if(follow->fd == -1)
+    return;
+  
+  if(follow->buffer->fd == follow->fd)
+    aio_buffer_close(follow->buffer);
+  else
+    close(follow->fd);
+  
+  follow->fd = -1;
+}
+
+/* Moves the file watch to the current file. */
+static void aio_follow_watch(aio_follow *follow) {
+  if(follow->inotify == -1)
+    return;
+  
+  if(follow->filewd != -1)
+    inotify_rm_watch(follow->inotify, follow->filewd);
+  
+  follow->filewd = inotify_add_watch(follow->inotify, follow->path,
+    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/* Waits for an inotify event or AIO_FOLLOW_INTERVAL, whichever comes first, and throws the
+ * events away: aio_follow_wait looks at the files themselves to see what has changed.
+ * A signal that arrived just before poll only shows in the flag, so it is checked again
+ * after a timeout.
+ */
+static int aio_follow_sleep(aio_follow *follow) {
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd;
+  int res;
+  
+  pfd.fd = follow->inotify;
+  pfd.events = POLLIN;
+  
+  if(follow->inotify == -1)
+    res = poll(0, 0, AIO_FOLLOW_INTERVAL);
+  else
+    res = poll(&pfd, 1, AIO_FOLLOW_INTERVAL);
+  
+  if(res < 0)
+    return (errno == EINTR ? AIO_ERROR_FOLLOW_INTERRUPTED : AIO_ERROR_IO_READ_ERROR);
+  
+  if(follow->stop && *follow->stop)
+    return AIO_ERROR_FOLLOW_INTERRUPTED;
+  
+  if(res > 0) {
+    while(read(follow->inotify, events, sizeof(events)) > 0)
+      continue;
+  }
+  
+  if(follow->fd != -1 && time(0) - follow->saved >= AIO_FOLLOW_INTERVAL / 1000)
+    aio_follow_save(follow);
+  
+  return 0;
+}
+
+/* Picks up the position from the state file if it was saved for the current file and
+ * the file hasn't been truncated since.
+ */
+static void aio_follow_load(aio_follow *follow) {
+  unsigned long long dev, ino;
+  long long offset;
+  struct stat st;
+  
+  if(!follow->statepath)
+    return;
+  
+  FILE *state = fopen(follow->statepath, "r");
+  if(!state)
+    return;
+  
+  if(fscanf(state, "%llu %llu %lld", &dev, &ino, &offset) == 3
+    && (dev_t) dev == follow->dev && (ino_t) ino == follow->ino
+    && fstat(follow->fd, &st) == 0 && offset >= 0 && offset <= st.st_size) {
+    follow->offset = offset;
+    follow->seen = offset;
+  }
+  
+  fclose(state);
+}
+
+/* Writes the position to the state file. The file is replaced with a rename so it is never
+ * seen half-written.
+ */
+static void aio_follow_save(aio_follow *follow) {
+  follow->saved = time(0);
+  
+  if(!follow->statepath)
+    return;
+  
+  size_t len = strlen(follow->statepath);
+  char *tmppath = xmalloc(len + 5);
+  memcpy(tmppath, follow->statepath, len);
+  memcpy(tmppath + len, ".tmp", 5);
+  
+  FILE *state = fopen(tmppath, "w");
+  if(state) {
+    fprintf(state, "%llu %llu %lld\n",
+      (unsigned long long) follow->dev, (unsigned long long) follow->ino, (long long) follow->offset);
+    
+    if(fclose(state) == 0)
+      rename(tmppath, follow->statepath);
+    else
+      unlink(tmppath);
+  }
+  
+  free(tmppath);
+}
@@ -0,0 +1,72 @@
+/* Follows a growing log file, like tail -F, and feeds the appended lines to an aio_buffer.
+ *
+ * The file is watched with inotify (and checked at least every AIO_FOLLOW_INTERVAL ms in
+ * case events are missed, e.g. on network file systems). Only bytes past the last complete
+ * line are read again; a line that is still being written is left for the next round.
+ * Rotation is handled both ways it is usually done: if the file is renamed away and a new
+ * one created under the same name, the rest of the old file is read first and then the new
+ * file from its start; if the file is truncated in place, reading restarts from its start.
+ *
+ * The position can be saved to a state file so that a restarted follower picks up where
+ * the previous one stopped instead of reading the whole file again.
+ */
+
+#include "input.h"
+#include <sys/stat.h>
+#include <signal.h>
+#include <time.h>
+
+#ifndef AIO_FOLLOW
+#define AIO_FOLLOW
+
+#define AIO_FOLLOW_INTERVAL 1000 /* ms between checks without inotify events; also between state saves */
+
+#define AIO_ERROR_FOLLOW_INTERRUPTED (-7600)
+
+typedef struct {
+  char *path; /* the name being followed */
+  aio_buffer *buffer; /* reads the current file */
+  int fd; /* the current file (-1 if there is none); owned by the buffer once it reads it */
+  dev_t dev; /* identity of the current file, to notice rotation */
+  ino_t ino;
+  
+  off_t offset; /* file offset just past the last complete line read */
+  off_t seen; /* bytes of the file read so far (offset plus any partial line) */
+  
+  int inotify; /* inotify descriptor, or -1 if inotify isn't available */
+  int filewd; /* watch on the current file */
+  int dirwd; /* watch on the directory, for a new file appearing under the name */
+  
+  char *statepath; /* where the position is saved, or 0 */
+  time_t saved; /* when the position was last saved */
+  
+  volatile sig_atomic_t *stop; /* set by a signal handler to end the wait, or 0 */
+} aio_follow;
+
+/* Opens path for following with buffer. If statepath names a state file saved for the
+ * same file, reading resumes from the saved position; otherwise it starts at the
+ * beginning of the file. stop, if not 0, is the flag a signal handler sets to end the
+ * wait. Returns 0 if path can't be opened.
+ */
+aio_follow *aio_follow_open(const char *path, aio_buffer *buffer, const char *statepath,
+  volatile sig_atomic_t *stop);
+
+/* Blocks until there is data past the last complete line and sets up the buffer to read it
+ * with aio_buffer_loadline. Returns 0, an AIO_ERROR_ code, or AIO_ERROR_FOLLOW_INTERRUPTED
+ * once *stop is set. The flag is checked on every pass, so a signal that lands outside of
+ * poll is noticed within AIO_FOLLOW_INTERVAL ms.
+ */
+int aio_follow_wait(aio_follow *follow);
+
+/* Records how far the lines were read once aio_buffer_loadline has returned
+ * AIO_ERROR_END_BUFFER, and saves the position if AIO_FOLLOW_INTERVAL has passed.
+ * Output for those lines should already be flushed.
+ */
+void aio_follow_done(aio_follow *follow);
+
+/* Saves the position (if there is a state file) and frees the follower. The buffer is
+ * left alone, but its descriptor is closed.
+ */
+void aio_follow_free(aio_follow *follow);
+
+#endif
@@ -1,5 +1,14 @@
 #include "input.h"
+#include "stage.h"
+#include "decompress.h"
 #include "common.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AIO_X86 1
+#include <immintrin.h>
+#endif
 
 /*
  * Return VAL aligned to the next multiple of ALIGNMENT.  VAL can be
@@ -10,13 +19,48 @@
 ? (val) \
 : (val) + ((alignment) - (size_t) (val) % (alignment)))
 
+/* Bytes allocated past the end of the private buffer, so that the newline scanner can
+ * load the whole 64-byte block holding the last byte of data.
+ */
+#define AIO_BLOCK_SLACK 64
+
 /* Globals */
 unsigned char aio_eol = '\n';
 size_t aio_pagesize = 0;
+int aio_mmap_enabled = 1;
+int aio_readahead = 0;
+int aio_decompress_enabled = 1;
+int aio_decompress_threads = 1;
+int aio_simd_enabled = 1;
+
+/* Private declarations */
+
+static char *aio_map_window(int fd, off_t offset, size_t len, size_t *maplen);
+static void aio_buffer_detach(aio_buffer *buffer);
+static void aio_buffer_reset(aio_buffer *buffer, int fd);
+static int aio_buffer_slide(aio_buffer *buffer, size_t keep, off_t *adjust);
+static int aio_buffer_pull(aio_buffer *buffer, size_t keep, off_t *adjust);
+static void aio_buffer_resize(aio_buffer *buffer, size_t limit, char *keepstart, size_t keep);
+static inline char *aio_buffer_findeol(aio_buffer *buffer, char *p);
+
+/* Returns the EOL bitmap of the 64-byte aligned block. Selected at runtime by CPU features. */
+typedef uint64_t (*aio_eolmask_t)(const char *block);
+static uint64_t aio_eolmask_scalar(const char *block);
+#ifdef AIO_X86
+static uint64_t aio_eolmask_sse2(const char *block);
+static uint64_t aio_eolmask_avx2(const char *block);
+#endif
+static aio_eolmask_t aio_eolmask = aio_eolmask_scalar;
 
 /* API */
 
 aio_buffer *aio_buffer_alloc(void) {
+  return aio_buffer_alloc_size(AIO_BASE_BUFSIZE);
+}
+
+aio_buffer *aio_buffer_alloc_size(size_t bufsize) {
+  assert(bufsize > 0);
+  
   /* init on the first run */
   if(!aio_pagesize) {
       aio_pagesize = getpagesize();
@@ -24,17 +68,34 @@ aio_buffer *aio_buffer_alloc(void) {
           fprintf(stderr, "aio_buffer: getpagesize either failed or returned something really stupid\n");
           exit(-1);
       }
+      
+      #ifdef AIO_X86
+      __builtin_cpu_init();
+      if(!aio_simd_enabled)
+        aio_eolmask = aio_eolmask_scalar;
+      else if(__builtin_cpu_supports("avx2"))
+        aio_eolmask = aio_eolmask_avx2;
+      else if(__builtin_cpu_supports("sse2"))
+        aio_eolmask = aio_eolmask_sse2;
+      #endif
   }
   
   aio_buffer *buffer = xmalloc(sizeof(aio_buffer));
-  buffer->size = ALIGN_TO(AIO_BASE_BUFSIZE, aio_pagesize) + aio_pagesize + 1;
-  buffer->data = xmalloc(buffer->size);
+  buffer->basesize = ALIGN_TO(bufsize, aio_pagesize);
+  buffer->size = buffer->basesize + aio_pagesize + 1;
+  buffer->data = xmalloc(buffer->size + AIO_BLOCK_SLACK);
   buffer->fd = -1;
+  buffer->mode = AIO_MODE_READ;
+  buffer->map = 0;
+  buffer->stage = 0;
+  buffer->slot = 0;
   
   return buffer;
 }
 
 void aio_buffer_free(aio_buffer *buffer) {
+  aio_buffer_detach(buffer);
+  
   if(buffer->fd != -1)
     close(buffer->fd);
   
@@ -43,6 +104,8 @@ void aio_buffer_free(aio_buffer *buffer) {
 }
 
 void aio_buffer_close(aio_buffer *buffer) {
+  aio_buffer_detach(buffer);
+  
   if(buffer->fd != -1)
     close(buffer->fd);
   
@@ -54,44 +117,180 @@ int aio_buffer_open(aio_buffer *buffer, const char *path) {
   if(fd == -1)
     return AIO_ERROR_IO_READ_ERROR;
   
-  return aio_buffer_init(buffer, fd);
+  return aio_buffer_map(buffer, fd);
 }
 
-int aio_buffer_init(aio_buffer *buffer, int fd) {
-  if(buffer->fd != -1)
+int aio_buffer_map(aio_buffer *buffer, int fd) {
+  struct stat st;
+  
+  if(!aio_mmap_enabled || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return aio_buffer_init(buffer, fd);
+  
+  size_t len = (st.st_size < AIO_MMAP_WINDOW ? (size_t) st.st_size : AIO_MMAP_WINDOW);
+  size_t maplen;
+  char *map = aio_map_window(fd, 0, len, &maplen);
+  if(!map)
+    return aio_buffer_init(buffer, fd);
+  
+  /* Compressed files have to be decoded. Multi-member gzip (BGZF) and multi-frame zstd
+   * can be decoded on several threads; everything else goes through aio_buffer_init.
+   */
+  int format = (aio_decompress_enabled ? aio_decompress_format(map, len) : AIO_FORMAT_PLAIN);
+  if(format != AIO_FORMAT_PLAIN) {
+    munmap(map, maplen);
+    
+    aio_stage *stage = 0;
+    if(aio_decompress_threads > 1)
+      stage = aio_stage_parallel_decoder(fd, format, st.st_size, aio_decompress_threads, buffer->basesize);
+    
+    if(stage)
+      return aio_buffer_attach(buffer, fd, stage);
+    return aio_buffer_init(buffer, fd);
+  }
+  
+  aio_buffer_detach(buffer);
+  if(buffer->fd != -1 && buffer->fd != fd)
     close(buffer->fd);
   
   buffer->fd = fd;
-  buffer->start = ALIGN_TO(buffer->data + 1, aio_pagesize);
-  buffer->limit = buffer->size - (buffer->start - buffer->data);
-  buffer->end = buffer->start + buffer->limit;
-  buffer->start[-1] = aio_eol;
+  buffer->mode = AIO_MODE_MMAP;
+  buffer->eolblock = 0;
+  buffer->map = map;
+  buffer->maplen = maplen;
+  buffer->mapoffset = 0;
+  buffer->filesize = st.st_size;
+  
+  buffer->start = map;
+  buffer->end = map + len;
+  buffer->limit = len;
+  
+  buffer->linestart = buffer->start;
+  buffer->linelimit = buffer->start - 1; /* never dereferenced */
+  
+  return 0;
+}
+
+int aio_buffer_attach(aio_buffer *buffer, int fd, struct aio_stage *stage) {
+  aio_buffer_reset(buffer, fd);
+  
+  buffer->stage = stage;
+  buffer->mode = AIO_MODE_STAGE;
+  buffer->end = buffer->start;
+  
+  off_t adjdump; /* this value will be discarded */
+  int res = aio_buffer_fill(buffer, 0, &adjdump);
   
   buffer->linestart = buffer->start;
   buffer->linelimit = buffer->start - 1;
   
+  return res;
+}
+
+void aio_buffer_wrap(aio_buffer *buffer, char *start, char *end) {
+  aio_buffer_reset(buffer, -1);
+  
+  buffer->mode = AIO_MODE_MEMORY;
+  buffer->start = start;
+  buffer->end = end;
+  buffer->limit = end - start;
+  
+  buffer->linestart = buffer->start;
+  buffer->linelimit = buffer->start - 1; /* never dereferenced */
+}
+
+int aio_buffer_init(aio_buffer *buffer, int fd) {
+  aio_buffer_reset(buffer, fd);
+  
+  /* The first read is always done here so the input can be sniffed for compression. */
+  off_t adjdump; /* this value will be discarded */
+  int res = aio_buffer_fill(buffer, 0, &adjdump);
+  
+  if(res == 0) {
+    size_t length = buffer->end - buffer->start;
+    int format = (aio_decompress_enabled ? aio_decompress_format(buffer->start, length) : AIO_FORMAT_PLAIN);
+    
+    if(format != AIO_FORMAT_PLAIN) {
+      /* hand what was read so far to the decoder, then take the first decoded chunk */
+      size_t bufsize = (buffer->basesize > AIO_DECOMPRESS_OUTSIZE ? buffer->basesize : AIO_DECOMPRESS_OUTSIZE);
+      buffer->stage = aio_stage_decoder(fd, format, buffer->start, length,
+        (aio_readahead > 0 ? aio_readahead : AIO_DECOMPRESS_DEPTH), bufsize, buffer->basesize);
+      buffer->mode = AIO_MODE_STAGE;
+      buffer->end = buffer->start;
+      res = aio_buffer_fill(buffer, 0, &adjdump);
+    } else if(aio_readahead > 0) {
+      /* the first chunk stays in the private buffer; the rest comes from the reader */
+      buffer->stage = aio_stage_reader(fd, aio_readahead, buffer->basesize, buffer->basesize);
+      buffer->mode = AIO_MODE_STAGE;
+    }
+  }
+  
+  /* the data might no longer be in the private buffer */
+  buffer->linestart = buffer->start;
+  buffer->linelimit = buffer->start - 1;
+  
+  return res;
+}
+
+int aio_buffer_init_raw(aio_buffer *buffer, int fd) {
+  aio_buffer_reset(buffer, fd);
+  
   off_t adjdump; /* this value will be discarded */
-  return aio_buffer_fill(buffer, 0, &adjdump);
+  int res = aio_buffer_fill(buffer, 0, &adjdump);
+  
+  buffer->linestart = buffer->start;
+  buffer->linelimit = buffer->start - 1;
+  
+  return res;
 }
 
 int aio_buffer_fill(aio_buffer *buffer, size_t keep, off_t *adjust) {
-  /* calculate how much room there is for new data */
-  size_t readsize = buffer->limit - keep;
-  assert(readsize > 0);
+  buffer->eolblock = 0;
+  
+  if(buffer->mode == AIO_MODE_MMAP)
+    return aio_buffer_slide(buffer, keep, adjust);
+  if(buffer->mode == AIO_MODE_STAGE)
+    return aio_buffer_pull(buffer, keep, adjust);
+  if(buffer->mode == AIO_MODE_MEMORY) {
+    *adjust = 0;
+    return AIO_ERROR_END_BUFFER;
+  }
   
-  char *readstart = buffer->start + keep;
   char *keepstart = buffer->end - keep;
-  *adjust = buffer->start - keepstart;
+  *adjust = 0;
   
-  /* move the saved memory to the start of the buffer */
-  if(keep) {
+  if(keep >= buffer->limit) {
+    /* A single line fills the whole buffer - double it until there is room to read. */
+    size_t limit = buffer->limit;
+    while(limit <= keep)
+      limit *= 2;
+    
+    if(limit > AIO_MAX_BUFSIZE)
+      return AIO_ERROR_LINE_LONGER_THAN_BUFSIZE;
+    
+    aio_buffer_resize(buffer, limit, keepstart, keep);
+  } else if(buffer->size > buffer->basesize + aio_pagesize + 1 && keep <= buffer->basesize / 2) {
+    /* The long line is gone; go back to the base size. */
+    aio_buffer_resize(buffer, buffer->basesize, keepstart, keep);
+  } else if(keep) {
+    /* move the saved memory to the start of the buffer */
     memmove(buffer->start, keepstart, keep);
   }
   
+  *adjust = buffer->start - keepstart;
+  
+  /* calculate how much room there is for new data */
+  size_t readsize = buffer->limit - keep;
+  assert(readsize > 0);
+  
+  char *readstart = buffer->start + keep;
+  
   ssize_t bytesread;
   while((bytesread = read(buffer->fd, readstart, readsize)) < 0 && errno == EINTR)
     continue;
   
+  if(bytesread < 0)
+    return AIO_ERROR_IO_READ_ERROR;
+  
   if(bytesread == 0)
     return AIO_ERROR_END_BUFFER;
   
@@ -111,15 +310,13 @@ int aio_buffer_loadline(aio_buffer *buffer) {
   off_t adjust = 0;
   int res = 0;
   
-  for(; *linelimit != aio_eol; ++linelimit) {
-    /* linelimit can be > buffer->end if previous buffer->linelimit == buffer->end - this is expected */
-    if(linelimit >= buffer->end) {
-      res = aio_buffer_fill(buffer, linelimit - linestart, &adjust);
-      linestart += adjust;
-      linelimit += adjust;
-      if(res != 0)
-        break;
-    }
+  /* linelimit can be > buffer->end if previous buffer->linelimit == buffer->end - this is expected */
+  while((linelimit = aio_buffer_findeol(buffer, linelimit)) >= buffer->end) {
+    res = aio_buffer_fill(buffer, linelimit - linestart, &adjust);
+    linestart += adjust;
+    linelimit += adjust;
+    if(res != 0)
+      break;
   }
   
   buffer->linestart = linestart;
@@ -140,16 +337,267 @@ int aio_buffer_setlinelimit(aio_buffer *buffer) {
   char *limit;
   off_t adj = 0;
   
-  for(limit = buffer->linestart + 1; *limit != aio_eol; ++limit) {
-    if(limit == buffer->end) {
-      if(aio_buffer_fill(buffer, limit - buffer->linestart, &adj) != 0)
-        break;
-      buffer->linestart += adj;
-      limit += adj;
-    }
+  limit = buffer->linestart + 1;
+  while((limit = aio_buffer_findeol(buffer, limit)) >= buffer->end) {
+    int res = aio_buffer_fill(buffer, limit - buffer->linestart, &adj);
+    buffer->linestart += adj;
+    limit += adj;
+    if(res != 0)
+      break;
   }
   
   buffer->linelimit = limit;
   
   return 0;
 }
+
+/* Private implementations */
+
+/* Maps len bytes of the file at offset (which must be page-aligned), followed by
+ * at least one page of anonymous zero memory so that the byte at map + len can be
+ * read even when the file ends on a page boundary. Returns 0 on failure.
+ */
+static char *aio_map_window(int fd, off_t offset, size_t len, size_t *maplen) {
+  size_t reserve = ALIGN_TO(len, aio_pagesize) + aio_pagesize;
+  
+  char *map = mmap(0, reserve, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if(map == MAP_FAILED)
+    return 0;
+  
+  if(mmap(map, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+    munmap(map, reserve);
+    return 0;
+  }
+  
+  madvise(map, len, MADV_SEQUENTIAL);
+  
+  *maplen = reserve;
+  return map;
+}
+
+/* Points the buffer at fd and makes the private buffer pristine (and back to the base size). */
+static void aio_buffer_reset(aio_buffer *buffer, int fd) {
+  aio_buffer_detach(buffer);
+  if(buffer->fd != -1 && buffer->fd != fd)
+    close(buffer->fd);
+  
+  buffer->fd = fd;
+  buffer->eolblock = 0;
+  
+  /* a long line in the previous file might have left the buffer grown */
+  if(buffer->size != buffer->basesize + aio_pagesize + 1) {
+    free(buffer->data);
+    buffer->size = buffer->basesize + aio_pagesize + 1;
+    buffer->data = xmalloc(buffer->size + AIO_BLOCK_SLACK);
+  }
+  
+  buffer->start = ALIGN_TO(buffer->data + 1, aio_pagesize);
+  buffer->limit = buffer->size - (buffer->start - buffer->data);
+  buffer->end = buffer->start + buffer->limit;
+  buffer->start[-1] = aio_eol;
+}
+
+/* Tears down the mapping or the read-ahead stage, leaving the buffer in AIO_MODE_READ.
+ * Must run before the descriptor is closed since a stage may still be reading it.
+ */
+static void aio_buffer_detach(aio_buffer *buffer) {
+  switch(buffer->mode) {
+    case AIO_MODE_MMAP:
+    munmap(buffer->map, buffer->maplen);
+    buffer->map = 0;
+    break;
+    case AIO_MODE_STAGE:
+    aio_stage_free(buffer->stage);
+    buffer->stage = 0;
+    buffer->slot = 0;
+    break;
+  }
+  
+  buffer->mode = AIO_MODE_READ;
+}
+
+/* The read-ahead equivalent of aio_buffer_fill: takes the next slot from the stage and
+ * prepends the kept bytes to it, using the slot's headroom. Partial lines that don't fit
+ * the headroom are assembled in the private buffer instead (growing it like the read path).
+ */
+static int aio_buffer_pull(aio_buffer *buffer, size_t keep, off_t *adjust) {
+  char *keepstart = buffer->end - keep;
+  aio_stage *stage = buffer->stage;
+  *adjust = 0;
+  
+  aio_slot *slot = aio_stage_next(stage);
+  if(slot->status != 0)
+    return slot->status;
+  
+  char *privstart = ALIGN_TO(buffer->data + 1, aio_pagesize);
+  size_t privlimit = buffer->size - (privstart - buffer->data);
+  int inslot = (keep <= slot->headroom);
+  
+  if(inslot) {
+    memcpy(slot->start - keep, keepstart, keep);
+    
+    /* the long line that made the private buffer grow is gone */
+    if(buffer->size > buffer->basesize + aio_pagesize + 1)
+      aio_buffer_resize(buffer, buffer->basesize, buffer->data, 0);
+    
+    buffer->start = slot->start - keep;
+    buffer->end = slot->start + slot->length;
+  } else {
+    if(keep + slot->length > privlimit) {
+      size_t limit = privlimit;
+      while(limit < keep + slot->length)
+        limit *= 2;
+      
+      if(limit > AIO_MAX_BUFSIZE)
+        return AIO_ERROR_LINE_LONGER_THAN_BUFSIZE;
+      
+      aio_buffer_resize(buffer, limit, keepstart, keep);
+    } else {
+      memmove(privstart, keepstart, keep);
+      buffer->start = privstart;
+      buffer->limit = privlimit;
+    }
+    
+    memcpy(buffer->start + keep, slot->start, slot->length);
+    buffer->end = buffer->start + keep + slot->length;
+  }
+  
+  /* The previous slot (if the data was in one) is the oldest; the new one follows. */
+  if(buffer->slot)
+    aio_stage_release(stage);
+  
+  if(inslot) {
+    buffer->slot = slot;
+  } else {
+    aio_stage_release(stage);
+    buffer->slot = 0;
+  }
+  
+  *adjust = buffer->start - keepstart;
+  
+  return 0;
+}
+
+/* Replaces the private buffer with one that can hold at least limit bytes after the
+ * page-aligned start and copies the keep bytes at keepstart to the new start.
+ * buffer->end is left for the caller to set.
+ */
+static void aio_buffer_resize(aio_buffer *buffer, size_t limit, char *keepstart, size_t keep) {
+  size_t size = ALIGN_TO(limit, aio_pagesize) + aio_pagesize + 1;
+  char *data = xmalloc(size + AIO_BLOCK_SLACK);
+  char *start = ALIGN_TO(data + 1, aio_pagesize);
+  
+  memcpy(start, keepstart, keep);
+  free(buffer->data);
+  
+  buffer->data = data;
+  buffer->size = size;
+  buffer->start = start;
+  buffer->limit = size - (start - data);
+  buffer->start[-1] = aio_eol;
+}
+
+/* The mmap equivalent of aio_buffer_fill: maps the next window of the file so that
+ * it starts at the page containing the kept bytes, then drops the old window.
+ * The kept bytes are never copied - only the pointers move.
+ */
+static int aio_buffer_slide(aio_buffer *buffer, size_t keep, off_t *adjust) {
+  *adjust = 0;
+  
+  off_t consumed = buffer->mapoffset + (buffer->end - buffer->map);
+  if(consumed >= buffer->filesize)
+    return AIO_ERROR_END_BUFFER;
+  
+  off_t keepoffset = consumed - keep;
+  off_t offset = keepoffset - (keepoffset % aio_pagesize);
+  size_t len = (keepoffset - offset) + keep + AIO_MMAP_WINDOW;
+  if(offset + len > buffer->filesize)
+    len = buffer->filesize - offset;
+  
+  size_t maplen;
+  char *map = aio_map_window(buffer->fd, offset, len, &maplen);
+  if(!map)
+    return AIO_ERROR_BUFFER_FILL_FAIL;
+  
+  char *keepstart = buffer->end - keep;
+  munmap(buffer->map, buffer->maplen);
+  
+  buffer->map = map;
+  buffer->maplen = maplen;
+  buffer->mapoffset = offset;
+  buffer->start = map + (keepoffset - offset);
+  buffer->end = map + len;
+  buffer->limit = buffer->end - buffer->start;
+  
+  *adjust = buffer->start - keepstart;
+  
+  return 0;
+}
+
+/* Returns the first aio_eol at or after p, or buffer->end if there is none before it.
+ * Pointers already past the end are returned unchanged.
+ *
+ * Blocks are aligned to 64 bytes and whole ones are loaded; bits past buffer->end are
+ * ignored. The block holding the last byte may reach past the data: a mapping is readable
+ * to the end of that page, the private buffer has AIO_BLOCK_SLACK bytes after it and a
+ * stage slot 64 bytes of padding. Memory handed to aio_buffer_wrap needs the same.
+ */
+static inline char *aio_buffer_findeol(aio_buffer *buffer, char *p) {
+  char *end = buffer->end;
+  if(p >= end)
+    return p;
+  
+  for(;;) {
+    char *block = p - ((uintptr_t) p & 63);
+    if(block != buffer->eolblock) {
+      buffer->eolmask = aio_eolmask(block);
+      buffer->eolblock = block;
+    }
+    
+    uint64_t mask = buffer->eolmask >> (p - block);
+    if(mask) {
+      p += __builtin_ctzll(mask);
+      return (p < end ? p : end);
+    }
+    
+    p = block + 64;
+    if(p >= end)
+      return end;
+  }
+}
+
+static uint64_t aio_eolmask_scalar(const char *block) {
+  uint64_t mask = 0;
+  int i;
+  
+  for(i = 0; i < 64; ++i)
+    mask |= (uint64_t) ((unsigned char) block[i] == aio_eol) << i;
+  
+  return mask;
+}
+
+#ifdef AIO_X86
+__attribute__((target("sse2")))
+static uint64_t aio_eolmask_sse2(const char *block) {
+  __m128i eol = _mm_set1_epi8((char) aio_eol);
+  const __m128i *v = (const __m128i *) block;
+  
+  uint64_t m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(v), eol));
+  uint64_t m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(v + 1), eol));
+  uint64_t m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(v + 2), eol));
+  uint64_t m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(v + 3), eol));
+  
+  return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+__attribute__((target("avx2")))
+static uint64_t aio_eolmask_avx2(const char *block) {
+  __m256i eol = _mm256_set1_epi8((char) aio_eol);
+  const __m256i *v = (const __m256i *) block;
+  
+  uint64_t lo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(v), eol));
+  uint64_t hi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(v + 1), eol));
+  
+  return lo | (hi << 32);
+}
+#endif
@@ -8,20 +8,35 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <stdint.h>
 
 #ifndef AIO_BUFFER
 #define AIO_BUFFER
 
 #define AIO_BASE_BUFSIZE 32768
+#define AIO_MAX_BUFSIZE (1 << 30) /* lines longer than this are an error */
+#define AIO_MMAP_WINDOW (1 << 26) /* bytes of a regular file mapped at any one time */
+
+#define AIO_MODE_READ 0 /* read() into the private buffer */
+#define AIO_MODE_MMAP 1 /* point straight into a mapped window of the file */
+#define AIO_MODE_STAGE 2 /* take data from a producer thread (see stage.h) */
+#define AIO_MODE_MEMORY 3 /* split lines in memory owned by the caller; never filled */
 
 extern size_t aio_pagesize; /* memory page alignment */
 extern unsigned char aio_eol;
+extern int aio_mmap_enabled; /* set to 0 to force the read path even for regular files */
+extern int aio_readahead; /* number of reads kept in flight by a reader thread on the read path (0 = none) */
+extern int aio_decompress_enabled; /* set to 0 to pass gzip/zstd input through undecoded */
+extern int aio_decompress_threads; /* threads for decoding BGZF/multi-frame zstd files (1 = serial) */
+extern int aio_simd_enabled; /* set to 0 before the first aio_buffer_alloc to split lines without vector instructions */
 
 #define AIO_ERROR_LINE_LONGER_THAN_BUFSIZE (-7001)
 #define AIO_ERROR_LINE_ZERO_LENGTH (-7002)
 #define AIO_ERROR_IO_READ_ERROR (-7101)
 #define AIO_ERROR_BUFFER_FILL_FAIL (-7200)
 #define AIO_ERROR_END_BUFFER (-7300)
+#define AIO_ERROR_DECOMPRESS (-7400)
 
 /*
  * The allocated memory looks like this:
@@ -30,29 +45,87 @@ extern unsigned char aio_eol;
 typedef struct {
   char *data; /* start of the allocated buffer */
   size_t size; /* allocated size - this is different than BASE_BUFSIZE because of page alignment */
+  size_t basesize; /* page-aligned size the buffer shrinks back to after a long line */
   
   char *start; /* start of user-visible data */
   char *end; /* end of user-visible data */
   size_t limit; /* count of bytes from start to end */
   
   int fd; /* input descriptor for read calls */
+  int mode; /* AIO_MODE_READ, AIO_MODE_MMAP, AIO_MODE_STAGE or AIO_MODE_MEMORY */
+  
+  /* Only used in AIO_MODE_MMAP. The window is followed by at least one readable page
+   * so that looking at *end is always safe, same as with the private buffer.
+   */
+  char *map; /* start of the mapped window (page-aligned) */
+  size_t maplen; /* length of the mapping, including the guard page */
+  off_t mapoffset; /* file offset of .map */
+  off_t filesize;
+  
+  /* Only used in AIO_MODE_STAGE. */
+  struct aio_stage *stage; /* the producer */
+  struct aio_slot *slot; /* the slot .start points into, or 0 if data is in the private buffer */
   
   char *linestart; /* location of the latest newline seen */
   char *linelimit; /* location of the next newline after linestart */
+  
+  /* The newline scanner classifies the data 64 bytes at a time. Short lines tend to
+   * share a block, so the last block's EOL bitmap is cached until the next fill.
+   */
+  char *eolblock; /* 64-byte aligned start of the cached block (0 if none) */
+  uint64_t eolmask; /* bit N set if eolblock[N] == aio_eol */
 } aio_buffer;
 
 /* safely allocates a new buffer and sets pagesize */
 aio_buffer *aio_buffer_alloc(void);
 
+/* Same as aio_buffer_alloc but reads bufsize bytes at a time instead of AIO_BASE_BUFSIZE.
+ * Whatever the size, the buffer grows geometrically (up to AIO_MAX_BUFSIZE) to hold a
+ * single line that doesn't fit and shrinks back once the line has been consumed.
+ */
+aio_buffer *aio_buffer_alloc_size(size_t bufsize);
+
 void aio_buffer_free(aio_buffer *buffer);
 
 /* Sets the file descriptor to fd and fills the buffer for the first time.
  * Other initialization code is also run to ensure the buffer is pristine.
+ * If aio_readahead is set, reads are done ahead of time by a separate thread.
+ * If the data starts with gzip or zstd magic bytes, it is decompressed on a separate
+ * thread (see decompress.h).
  * This function is safe to call multiple times on the same buffer with different file
  * descriptors (for buffer reuse).
  */
 int aio_buffer_init(aio_buffer *buffer, int fd);
+
+/* Same as aio_buffer_init but fd is always read as it is, from its current position and
+ * on the calling thread: no decompression and no read-ahead.
+ */
+int aio_buffer_init_raw(aio_buffer *buffer, int fd);
+
+/* Same as aio_buffer_init, except that if fd refers to a non-empty regular file
+ * the file is memory-mapped in windows of AIO_MMAP_WINDOW bytes and lines are
+ * never copied. Windows are unmapped as soon as the line splitter moves past them.
+ * Falls back to aio_buffer_init for pipes, terminals, etc. or if mmap fails.
+ *
+ * Compressed regular files made of independent members or frames (BGZF, multi-frame
+ * zstd) are decoded on aio_decompress_threads threads if that is more than 1.
+ */
+int aio_buffer_map(aio_buffer *buffer, int fd);
 void aio_buffer_close(aio_buffer *buffer);
+
+/* Takes over a stage (see stage.h) started by the caller as the source of data for fd.
+ * The stage is freed along with the buffer or when the buffer is pointed elsewhere.
+ */
+int aio_buffer_attach(aio_buffer *buffer, int fd, struct aio_stage *stage);
+
+/* Splits the lines in [start, end) without copying them. The memory must stay valid until
+ * the buffer is pointed elsewhere, and the whole 64-byte aligned block holding end[-1]
+ * must be readable (as it is in a mapping). A trailing line without aio_eol is not
+ * returned, same as at the end of a file.
+ */
+void aio_buffer_wrap(aio_buffer *buffer, char *start, char *end);
+
+/* Opens the path and calls aio_buffer_map on it. */
 int aio_buffer_open(aio_buffer *buffer, const char *path);
 int aio_buffer_fill(aio_buffer *buffer, size_t keep, off_t *adjust);
 int aio_buffer_loadline(aio_buffer *buffer);
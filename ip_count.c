@@ -0,0 +1,545 @@
+#include "ip_count.h"
+#include <math.h>
+#include <unistd.h>
+
+struct IPCounter {
+  IPCount *counts; /* kept as a min-heap by count if .max is set */
+  size_t count; /* counters in use */
+  size_t size; /* room in .counts */
+  size_t max; /* 0 if there is no limit */
+  
+  uint32_t *slots; /* index in .counts plus 1; 0 where free */
+  size_t slotcount; /* a power of 2, at least twice .size */
+};
+
+struct IPDistinct {
+  IPCounterRef keys; /* without a limit, so the index of a key's counter is also that of its sketch */
+  uint8_t *registers; /* 2^.precision per sketch */
+  size_t size; /* room in .registers, in sketches */
+  int mode;
+  int precision;
+};
+
+/* Layout of a file written by ipdistinct_save: this header and count sketches, each one a
+ * record, the name of its label (namelen bytes, no NUL) and its registers.
+ */
+#define IPSKETCH_MAGIC "IPSCNHLL"
+#define IPSKETCH_VERSION 1
+#define IPSKETCH_BYTEORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder; /* IPSKETCH_BYTEORDER as the saving machine stores it */
+  uint32_t mode;
+  uint32_t precision;
+  uint64_t count;
+} IPSketchHeader;
+
+typedef struct {
+  uint64_t hi, lo; /* the key; a label with a name has it saved instead of its number */
+  uint8_t family;
+  uint8_t block;
+  uint16_t namelen;
+  uint32_t unused;
+} IPSketchRecord;
+
+/* Private declarations */
+
+static long counter_add(IPCounterRef counter, const IPCountKey *key, uint64_t n, uint64_t error);
+static long counter_find(IPCounterRef counter, const IPCountKey *key, size_t *slot);
+static void counter_rehash(IPCounterRef counter, size_t slotcount);
+static void counter_unslot(IPCounterRef counter, size_t slot);
+static void heap_up(IPCounterRef counter, size_t i);
+static void heap_down(IPCounterRef counter, size_t i);
+static inline void heap_swap(IPCounterRef counter, size_t i, size_t j);
+static inline uint64_t key_hash(const IPCountKey *key);
+static inline int key_equal(const IPCountKey *a, const IPCountKey *b);
+static int count_compare(const void *a, const void *b);
+static inline uint64_t mix64(uint64_t x);
+static uint8_t *distinct_sketch(IPDistinctRef distinct, const IPCountKey *key, uint64_t n);
+static uint64_t sketch_estimate(const uint8_t *registers, int precision);
+static void sketch_fold(uint8_t *registers, int precision, const uint8_t *from, int fromprecision);
+
+/* API */
+
+IPCounterRef makeipcounter(size_t max) {
+  IPCounterRef counter = (IPCounterRef) xmalloc(sizeof(struct IPCounter));
+  counter->max = max;
+  counter->count = 0;
+  counter->size = (max ? max : 1024);
+  counter->counts = xmalloc(sizeof(IPCount) * counter->size);
+  counter->slots = 0;
+  counter->slotcount = 0;
+  
+  size_t slotcount = 16;
+  while(slotcount < counter->size * 2)
+    slotcount *= 2;
+  counter_rehash(counter, slotcount);
+  
+  return counter;
+}
+
+void freeipcounter(IPCounterRef counter) {
+  free(counter->counts);
+  free(counter->slots);
+  free(counter);
+}
+
+void ipcounter_add(IPCounterRef counter, const IPCountKey *key, uint64_t n) {
+  counter_add(counter, key, n, 0);
+}
+
+void ipcounter_merge(IPCounterRef counter, IPCounterRef from) {
+  size_t i;
+  
+  for(i = 0; i < from->count; ++i)
+    counter_add(counter, &from->counts[i].key, from->counts[i].count, from->counts[i].error);
+  
+  from->count = 0;
+  memset(from->slots, 0, sizeof(uint32_t) * from->slotcount);
+}
+
+IPCount *ipcounter_sort(IPCounterRef counter, size_t *n) {
+  qsort(counter->counts, counter->count, sizeof(IPCount), count_compare);
+  
+  *n = counter->count;
+  return counter->counts;
+}
+
+IPDistinctRef makeipdistinct(int mode, int precision) {
+  IPDistinctRef distinct = (IPDistinctRef) xmalloc(sizeof(struct IPDistinct));
+  distinct->keys = makeipcounter(0);
+  distinct->registers = 0;
+  distinct->size = 0;
+  distinct->mode = mode;
+  distinct->precision = precision;
+  
+  return distinct;
+}
+
+void freeipdistinct(IPDistinctRef distinct) {
+  freeipcounter(distinct->keys);
+  free(distinct->registers);
+  free(distinct);
+}
+
+void ipdistinct_add(IPDistinctRef distinct, const IPCountKey *key, ip6_t ip, int family) {
+  uint8_t *registers = distinct_sketch(distinct, key, 1);
+  int precision = distinct->precision;
+  
+  /* the first bits of the hash pick the register, the rest are what the zeros are counted in */
+  uint64_t hash = mix64(mix64(ip.hi ^ ((uint64_t) family << 56)) ^ ip.lo);
+  uint64_t rest = hash << precision;
+  uint8_t rank = (rest ? __builtin_clzll(rest) + 1 : 64 - precision + 1);
+  
+  if(registers[hash >> (64 - precision)] < rank)
+    registers[hash >> (64 - precision)] = rank;
+}
+
+void ipdistinct_merge(IPDistinctRef distinct, IPDistinctRef from) {
+  size_t m = (size_t) 1 << distinct->precision;
+  size_t i, r;
+  
+  for(i = 0; i < from->keys->count; ++i) {
+    IPCount *count = &from->keys->counts[i];
+    uint8_t *registers = distinct_sketch(distinct, &count->key, count->count);
+    const uint8_t *other = from->registers + (i << from->precision);
+    
+    for(r = 0; r < m; ++r) {
+      if(registers[r] < other[r])
+        registers[r] = other[r];
+    }
+  }
+}
+
+int ipdistinct_save(IPDistinctRef distinct, IPTreeRef tree, const char *path) {
+  IPSketchHeader header;
+  IPSketchRecord record;
+  size_t m = (size_t) 1 << distinct->precision;
+  size_t i;
+  
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IPSKETCH_MAGIC, sizeof(header.magic));
+  header.version = IPSKETCH_VERSION;
+  header.byteorder = IPSKETCH_BYTEORDER;
+  header.mode = distinct->mode;
+  header.precision = distinct->precision;
+  header.count = distinct->keys->count;
+  
+  /* written next to the destination and renamed, like iptree_save */
+  size_t len = strlen(path);
+  char *tmppath = xmalloc(len + 5);
+  memcpy(tmppath, path, len);
+  memcpy(tmppath + len, ".tmp", 5);
+  
+  FILE *file = fopen(tmppath, "w");
+  if(!file) {
+    free(tmppath);
+    return IP_ERROR_SET_IO;
+  }
+  
+  int ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+  for(i = 0; ok && i < distinct->keys->count; ++i) {
+    IPCountKey *key = &distinct->keys->counts[i].key;
+    const char *name = 0;
+    
+    memset(&record, 0, sizeof(record));
+    record.hi = key->ip.hi;
+    record.lo = key->ip.lo;
+    record.family = key->family;
+    record.block = key->block;
+    
+    /* label numbers only mean something to the tree that gave them out */
+    if(distinct->mode == IP_COUNT_LABEL && (name = iptree_labelname(tree, (int) key->ip.lo))) {
+      record.lo = 0;
+      record.namelen = (uint16_t) strlen(name);
+    }
+    
+    ok = (fwrite(&record, sizeof(record), 1, file) == 1
+      && (!record.namelen || fwrite(name, record.namelen, 1, file) == 1)
+      && fwrite(distinct->registers + (i << distinct->precision), m, 1, file) == 1);
+  }
+  
+  if(fclose(file) != 0 || !ok || rename(tmppath, path) != 0) {
+    unlink(tmppath);
+    free(tmppath);
+    return IP_ERROR_SET_IO;
+  }
+  
+  free(tmppath);
+  return 0;
+}
+
+int ipdistinct_load(IPDistinctRef distinct, IPTreeRef tree, const char *path) {
+  IPSketchHeader header;
+  IPSketchRecord record;
+  IPCountKey key;
+  char name[65536];
+  uint64_t i;
+  size_t r;
+  int res = 0;
+  
+  FILE *file = fopen(path, "r");
+  if(!file)
+    return IP_ERROR_SET_IO;
+  
+  if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, IPSKETCH_MAGIC, sizeof(header.magic)) != 0) {
+    fclose(file);
+    return IP_ERROR_SET_FORMAT;
+  }
+  
+  if(header.version != IPSKETCH_VERSION || header.byteorder != IPSKETCH_BYTEORDER)
+    res = IP_ERROR_SET_VERSION;
+  else if(header.precision < IP_DISTINCT_PRECISION_MIN || header.precision > IP_DISTINCT_PRECISION_MAX)
+    res = IP_ERROR_SET_FORMAT;
+  else if(header.mode != (uint32_t) distinct->mode)
+    res = IP_ERROR_SKETCH_MODE;
+  else if(header.precision < (uint32_t) distinct->precision)
+    res = IP_ERROR_SKETCH_PRECISION;
+  
+  if(res != 0) {
+    fclose(file);
+    return res;
+  }
+  
+  size_t m = (size_t) 1 << header.precision;
+  uint8_t *registers = xmalloc(m);
+  
+  for(i = 0; res == 0 && i < header.count; ++i) {
+    if(fread(&record, sizeof(record), 1, file) != 1
+      || (record.namelen && fread(name, record.namelen, 1, file) != 1)
+      || fread(registers, m, 1, file) != 1) {
+      res = IP_ERROR_SET_FORMAT;
+      break;
+    }
+    
+    /* a register can't be past the number of bits left after the index */
+    for(r = 0; r < m && registers[r] <= 64 - header.precision + 1; ++r)
+      continue;
+    
+    key.ip.hi = record.hi;
+    key.ip.lo = record.lo;
+    key.family = record.family;
+    key.block = record.block;
+    
+    if(distinct->mode == IP_COUNT_LABEL) {
+      if(record.family != 0 || (!record.namelen && record.lo != IP_LABEL_ANY))
+        res = IP_ERROR_SET_FORMAT;
+      else if(record.namelen)
+        key.ip.lo = iptree_label(tree, name, record.namelen);
+    } else if(!(record.family == IP_FAMILY_4 && record.block <= 32 && record.hi == 0 && record.lo <= 0xffffffff)
+      && !(record.family == IP_FAMILY_6 && record.block <= 128)) {
+      res = IP_ERROR_SET_FORMAT;
+    }
+    
+    if(r < m)
+      res = IP_ERROR_SET_FORMAT;
+    if(res == 0)
+      sketch_fold(distinct_sketch(distinct, &key, 0), distinct->precision, registers, header.precision);
+  }
+  
+  if(res == 0 && fgetc(file) != EOF)
+    res = IP_ERROR_SET_FORMAT;
+  
+  free(registers);
+  fclose(file);
+  return res;
+}
+
+IPCount *ipdistinct_sort(IPDistinctRef distinct, size_t *n) {
+  size_t i;
+  
+  for(i = 0; i < distinct->keys->count; ++i) {
+    distinct->keys->counts[i].count = sketch_estimate(distinct->registers + (i << distinct->precision), distinct->precision);
+    distinct->keys->counts[i].error = 0;
+  }
+  
+  return ipcounter_sort(distinct->keys, n);
+}
+
+/* Private implementations */
+
+/* Returns the index of the key's counter. Only a counter without a limit keeps its
+ * counters where they are, so the index says where the key will be from then on.
+ */
+static long counter_add(IPCounterRef counter, const IPCountKey *key, uint64_t n, uint64_t error) {
+  size_t slot;
+  long i = counter_find(counter, key, &slot);
+  
+  if(i >= 0) {
+    counter->counts[i].count += n;
+    counter->counts[i].error += error;
+    if(counter->max)
+      heap_down(counter, i);
+    return i;
+  }
+  
+  /* Space-Saving: the key takes over the smallest counter, count and all */
+  if(counter->max && counter->count == counter->max) {
+    IPCount *min = &counter->counts[0];
+    counter_unslot(counter, min->slot);
+    counter_find(counter, key, &slot);
+    
+    min->key = *key;
+    min->error = min->count + error;
+    min->count += n;
+    min->slot = slot;
+    counter->slots[slot] = 1;
+    heap_down(counter, 0);
+    return 0;
+  }
+  
+  if(counter->count == counter->size) {
+    counter->size *= 2;
+    counter->counts = xrealloc(counter->counts, sizeof(IPCount) * counter->size);
+    counter_rehash(counter, counter->slotcount * 2);
+    counter_find(counter, key, &slot);
+  }
+  
+  i = counter->count++;
+  counter->counts[i].key = *key;
+  counter->counts[i].count = n;
+  counter->counts[i].error = error;
+  counter->counts[i].slot = slot;
+  counter->slots[slot] = i + 1;
+  
+  if(counter->max)
+    heap_up(counter, i);
+  
+  return i;
+}
+
+/* Returns the index of the key's counter, or -1 if it has none. *slot is set to where the
+ * key is in the hash table, or where it would go.
+ */
+static long counter_find(IPCounterRef counter, const IPCountKey *key, size_t *slot) {
+  size_t mask = counter->slotcount - 1;
+  size_t s = key_hash(key) & mask;
+  uint32_t index;
+  
+  for(; (index = counter->slots[s]); s = (s + 1) & mask) {
+    if(key_equal(&counter->counts[index - 1].key, key)) {
+      *slot = s;
+      return (long) index - 1;
+    }
+  }
+  
+  *slot = s;
+  return -1;
+}
+
+/* Replaces the hash table with an empty one of slotcount slots and puts every key in it. */
+static void counter_rehash(IPCounterRef counter, size_t slotcount) {
+  size_t i, slot;
+  
+  free(counter->slots);
+  counter->slotcount = slotcount;
+  counter->slots = xmalloc(sizeof(uint32_t) * slotcount);
+  memset(counter->slots, 0, sizeof(uint32_t) * slotcount);
+  
+  for(i = 0; i < counter->count; ++i) {
+    counter_find(counter, &counter->counts[i].key, &slot);
+    counter->counts[i].slot = slot;
+    counter->slots[slot] = i + 1;
+  }
+}
+
+/* Empties a slot of the hash table. With linear probing the keys after it (up to the next
+ * free slot) may have been put further along because of it, so each one that would have
+ * gone in the hole is moved back into it, which leaves a hole of its own.
+ */
+static void counter_unslot(IPCounterRef counter, size_t slot) {
+  size_t mask = counter->slotcount - 1;
+  size_t hole = slot;
+  size_t next;
+  
+  counter->slots[hole] = 0;
+  for(next = (hole + 1) & mask; counter->slots[next]; next = (next + 1) & mask) {
+    IPCount *count = &counter->counts[counter->slots[next] - 1];
+    size_t home = key_hash(&count->key) & mask;
+    
+    if(((next - home) & mask) >= ((next - hole) & mask)) {
+      counter->slots[hole] = counter->slots[next];
+      counter->slots[next] = 0;
+      count->slot = hole;
+      hole = next;
+    }
+  }
+}
+
+static void heap_up(IPCounterRef counter, size_t i) {
+  while(i > 0 && counter->counts[(i - 1) / 2].count > counter->counts[i].count) {
+    heap_swap(counter, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void heap_down(IPCounterRef counter, size_t i) {
+  for(;;) {
+    size_t smallest = i;
+    size_t child = 2 * i + 1;
+    
+    if(child < counter->count && counter->counts[child].count < counter->counts[smallest].count)
+      smallest = child;
+    if(child + 1 < counter->count && counter->counts[child + 1].count < counter->counts[smallest].count)
+      smallest = child + 1;
+    if(smallest == i)
+      return;
+    
+    heap_swap(counter, i, smallest);
+    i = smallest;
+  }
+}
+
+/* Swaps two counters, keeping the hash table pointing at them. */
+static inline void heap_swap(IPCounterRef counter, size_t i, size_t j) {
+  IPCount swap = counter->counts[i];
+  counter->counts[i] = counter->counts[j];
+  counter->counts[j] = swap;
+  
+  counter->slots[counter->counts[i].slot] = i + 1;
+  counter->slots[counter->counts[j].slot] = j + 1;
+}
+
+static inline uint64_t key_hash(const IPCountKey *key) {
+  uint64_t hash = key->ip.hi * 0x9e3779b97f4a7c15ull ^ key->ip.lo;
+  hash ^= (((uint64_t) key->family << 8) | key->block) * 0xc2b2ae3d27d4eb4full;
+  
+  return mix64(hash);
+}
+
+/* The finalizer of MurmurHash3: every bit of the result depends on all of x. */
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  
+  return x;
+}
+
+static inline int key_equal(const IPCountKey *a, const IPCountKey *b) {
+  return (a->ip.lo == b->ip.lo && a->ip.hi == b->ip.hi && a->family == b->family && a->block == b->block);
+}
+
+/* Highest count first, then by family, address and block. */
+static int count_compare(const void *a, const void *b) {
+  const IPCount *x = (const IPCount *) a;
+  const IPCount *y = (const IPCount *) b;
+  
+  if(x->count != y->count)
+    return (x->count > y->count ? -1 : 1);
+  if(x->key.family != y->key.family)
+    return (x->key.family < y->key.family ? -1 : 1);
+  if(x->key.ip.hi != y->key.ip.hi)
+    return (x->key.ip.hi < y->key.ip.hi ? -1 : 1);
+  if(x->key.ip.lo != y->key.ip.lo)
+    return (x->key.ip.lo < y->key.ip.lo ? -1 : 1);
+  
+  return (int) x->key.block - (int) y->key.block;
+}
+
+/* Returns the registers of the key's sketch, counting n more hits for it and starting an
+ * empty sketch if it is new.
+ */
+static uint8_t *distinct_sketch(IPDistinctRef distinct, const IPCountKey *key, uint64_t n) {
+  size_t i = (size_t) counter_add(distinct->keys, key, n, 0);
+  
+  if(i == distinct->size) {
+    size_t m = (size_t) 1 << distinct->precision;
+    distinct->size = (distinct->size ? distinct->size * 2 : 16);
+    distinct->registers = xrealloc(distinct->registers, m * distinct->size);
+    memset(distinct->registers + i * m, 0, m * (distinct->size - i));
+  }
+  
+  return distinct->registers + (i << distinct->precision);
+}
+
+static uint64_t sketch_estimate(const uint8_t *registers, int precision) {
+  size_t m = (size_t) 1 << precision;
+  size_t zeros = 0;
+  double sum = 0;
+  size_t r;
+  
+  for(r = 0; r < m; ++r) {
+    sum += 1.0 / (double) ((uint64_t) 1 << registers[r]);
+    zeros += (registers[r] == 0);
+  }
+  
+  double alpha = (m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m));
+  double estimate = alpha * m * m / sum;
+  
+  /* while many registers are still empty, counting them (linear counting) is more accurate */
+  if(estimate <= 2.5 * m && zeros)
+    estimate = m * log((double) m / zeros);
+  
+  return (uint64_t) (estimate + 0.5);
+}
+
+/* Merges a sketch with 2^fromprecision registers into one with 2^precision, which may be
+ * fewer. The index bits that are dropped become the first bits of the rest of the hash,
+ * so the rank of a register is what it would have been with the smaller index.
+ */
+static void sketch_fold(uint8_t *registers, int precision, const uint8_t *from, int fromprecision) {
+  int shift = fromprecision - precision;
+  size_t m = (size_t) 1 << fromprecision;
+  size_t r;
+  
+  for(r = 0; r < m; ++r) {
+    uint8_t rank = from[r];
+    uint64_t dropped = r & (((size_t) 1 << shift) - 1);
+    
+    if(rank == 0)
+      continue;
+    
+    if(dropped)
+      rank = shift - 63 + __builtin_clzll(dropped);
+    else
+      rank += shift;
+    
+    if(registers[r >> shift] < rank)
+      registers[r >> shift] = rank;
+  }
+}
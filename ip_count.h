@@ -0,0 +1,98 @@
+/* Counts hits per key (an address, a CIDR block or a label) for ipscan --count-by, and
+ * distinct addresses per key for --distinct-by.
+ *
+ * Keys are found through an open-addressing hash table (linear probing) that holds the
+ * index of each key's counter. Without a limit the table grows as needed and every count
+ * is exact. With a limit of max counters it works as Space-Saving (Metwally et al.): once
+ * all of them are in use, a new key takes over the counter with the smallest count and
+ * goes on from there. Memory stays fixed, no count is ever too low, and every key seen
+ * more than total / max times is kept. The counters are then kept in a min-heap so the
+ * smallest one is always at hand.
+ *
+ * Distinct addresses are estimated with a HyperLogLog sketch per key (Flajolet et al.):
+ * 2^precision one-byte registers, each holding the longest run of leading zeros seen in
+ * the hashes of the addresses that fell to it. A sketch takes the same memory whatever
+ * the number of addresses, with a standard error of about 1.04 / sqrt(2^precision), and
+ * two sketches combine into that of both inputs by taking the larger of each register,
+ * so runs over separate files can be saved and merged later.
+ *
+ * NOTE: like the tree, counters and sketches are not safe to share between threads. Give
+ * every thread its own and combine them with ipcounter_merge or ipdistinct_merge.
+ */
+
+#include "ip_tree.h"
+
+#ifndef IP_COUNT
+#define IP_COUNT
+
+#define IP_COUNT_IP 0 /* one counter per address */
+#define IP_COUNT_BLOCK 1 /* per block of the tree (as --dump-ips prints them) */
+#define IP_COUNT_LABEL 2 /* per label */
+
+#define IP_DISTINCT_PRECISION_MIN 4
+#define IP_DISTINCT_PRECISION_MAX 18
+
+#define IP_ERROR_SKETCH_PRECISION -1300 /* the file was saved with fewer registers */
+#define IP_ERROR_SKETCH_MODE -1301 /* the file counts by something else */
+
+typedef struct {
+  ip6_t ip; /* the address, or the first of the block (IPv4 in .lo); the label for IP_COUNT_LABEL */
+  uint8_t family; /* IP_FAMILY_4 or IP_FAMILY_6 (0 for a label) */
+  uint8_t block; /* CIDR block */
+} IPCountKey;
+
+typedef struct {
+  IPCountKey key;
+  uint64_t count;
+  uint64_t error; /* how much of count may have been inherited from keys taken over */
+  uint32_t slot; /* position of the key in the hash table */
+} IPCount;
+
+typedef struct IPCounter *IPCounterRef;
+typedef struct IPDistinct *IPDistinctRef;
+
+/* Makes a counter that keeps at most max counters, or any number of them if max is 0. */
+IPCounterRef makeipcounter(size_t max);
+void freeipcounter(IPCounterRef counter);
+
+/* Adds n hits for the key. */
+void ipcounter_add(IPCounterRef counter, const IPCountKey *key, uint64_t n);
+
+/* Adds every count of from to counter and empties from. */
+void ipcounter_merge(IPCounterRef counter, IPCounterRef from);
+
+/* Sorts the counters, highest count first (ties by key), and returns them, setting *n
+ * to how many there are. Nothing may be added to the counter afterwards.
+ */
+IPCount *ipcounter_sort(IPCounterRef counter, size_t *n);
+
+/* Makes a set of sketches for keys of the IP_COUNT_ mode (IP_COUNT_BLOCK or
+ * IP_COUNT_LABEL) with 2^precision registers each.
+ */
+IPDistinctRef makeipdistinct(int mode, int precision);
+void freeipdistinct(IPDistinctRef distinct);
+
+/* Adds the address (IPv4 in .lo, with family IP_FAMILY_4) to the key's sketch. */
+void ipdistinct_add(IPDistinctRef distinct, const IPCountKey *key, ip6_t ip, int family);
+
+/* Adds every sketch of from to distinct, which must have been made the same way. */
+void ipdistinct_merge(IPDistinctRef distinct, IPDistinctRef from);
+
+/* Writes the sketches to path, replacing the file atomically. Label keys are saved by
+ * their names in the tree. Returns 0 or IP_ERROR_SET_IO.
+ */
+int ipdistinct_save(IPDistinctRef distinct, IPTreeRef tree, const char *path);
+
+/* Merges the sketches saved in path into distinct, numbering their labels in the tree.
+ * A file saved with a higher precision is folded down to that of distinct. Returns 0,
+ * IP_ERROR_SET_IO, IP_ERROR_SET_FORMAT, IP_ERROR_SET_VERSION, IP_ERROR_SKETCH_PRECISION
+ * or IP_ERROR_SKETCH_MODE.
+ */
+int ipdistinct_load(IPDistinctRef distinct, IPTreeRef tree, const char *path);
+
+/* Returns the estimated number of distinct addresses of every key, highest first, the
+ * same way as ipcounter_sort. Nothing may be added afterwards.
+ */
+IPCount *ipdistinct_sort(IPDistinctRef distinct, size_t *n);
+
+#endif
@@ -1,216 +1,1829 @@
 #include "ip_tree.h"
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IP_X86 1
+#include <immintrin.h>
+#endif
+
+/* Label names by number (see iptree_label). A name is found by number through .names and
+ * by name through an open-addressing hash table of label numbers, built on first use.
+ */
+typedef struct {
+  char **names; /* 0 below IP_LABEL_FIRST */
+  uint32_t count; /* labels numbered so far, the unnamed ones included */
+  uint32_t size; /* room in .names */
+  uint32_t *slots; /* label numbers; IP_LABEL_NONE where free */
+  uint32_t slotcount; /* a power of 2, or 0 if the table hasn't been built */
+} IPLabels;
 
 /* The reasons why this is a separate struct and has a typedef in the header file
  * basically have to do with making it easier to reuse this code in ASIM.
  */
 struct IPTree {
  IPNodeRef root;
+ IPNodeRef root6; /* IPv6 addresses live in a tree of their own, in the same slabs */
+ 
+ /* Nodes are carved out of slabs of SLAB_NODES and referred to by 32-bit index.
+  * Collapsed nodes go on a free list (linked through children[0]) for reuse.
+  */
+ struct IPNode **slabs;
+ uint32_t slabcount; /* slabs allocated */
+ uint32_t slabsize; /* room in .slabs */
+ uint32_t nodecount; /* nodes carved out of the slabs so far, in use or free */
+ IPNodeRef freelist; /* ZERO if empty */
+ 
+ /* Compiled lookup table (see iptree_compile), or 0 if findip has to walk the tree. */
+ uint32_t *table;
+ size_t tablelen; /* entries in use */
+ size_t tablesize; /* entries allocated */
+ size_t table6; /* index of the IPv6 root table (0 if root6 is a leaf) */
+ 
+ /* A tree opened with iptree_map has its slabs and table in this read-only mapping of
+  * the file. It is copied into memory of its own as soon as anything is added.
+  */
+ void *map;
+ size_t maplen;
+ 
+ IPLabels labels;
 };
 
+/* Layout of a file written by iptree_save: this header, the nodes (nodecount of them, in
+ * index order), the compiled table (tablelen entries) and the names of the labels from
+ * IP_LABEL_FIRST on, each followed by a NUL. Nodes and table entries refer to each other
+ * by index only, so the file can be used wherever it is mapped.
+ * Version 1 files are the same without labels.
+ */
+#define IPSET_MAGIC "IPSCNSET"
+#define IPSET_VERSION 2
+#define IPSET_BYTEORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder; /* IPSET_BYTEORDER as the saving machine stores it */
+  uint32_t root;
+  uint32_t root6;
+  uint32_t nodecount;
+  uint32_t labels; /* named labels (0 in version 1) */
+  uint64_t table6;
+  uint64_t tablelen; /* 0 if the tree was too big to compile */
+  uint64_t nodes; /* file offsets */
+  uint64_t table;
+} IPSetHeader;
+
 /* 0 = left, 1 = right. Using indices instead of struct members is an easy way to avoid conditionals. */
 struct IPNode {
   IPNodeRef children[2];
 };
 
-/* Sentinel values to represent either a subnet range where no IPs exist or one that is fully occupied. */
-static struct IPNode _zero;
-static struct IPNode _full;
-#define ZERO (&_zero)
-#define FULL (&_full)
+/* Scratch space for the addresses detected on one line. Each family has its own arrays
+ * (so IPv4 addresses can go to findip_batch as they are); .families keeps the order.
+ */
+#define IP_BATCH 16 /* lookups findip_batch keeps in flight at once */
+#define IPS_PER_LINE IP_BATCH /* enough for findip_str_r never to grow the arrays unless pos < 0 */
+struct IPScanner {
+  unsigned long max; /* capacity of each array */
+  int count4; /* addresses in ips and blocks */
+  int count6; /* addresses in ips6 and blocks6 */
+  ip_t *ips;
+  int *blocks;
+  ip6_t *ips6;
+  int *blocks6;
+  uint8_t *families; /* IP_FAMILY_4 or IP_FAMILY_6 for every address on the line, in order */
+  IPScannerStats stats;
+};
+
+/* An address block collected by an IPLoader, as its first and last address. */
+typedef struct {
+  ip_t first;
+  ip_t last;
+} IPRange;
+
+typedef struct {
+  ip6_t first;
+  ip6_t last;
+} IPRange6;
+
+/* A block with a label collected by an IPLoader, numbered by the loader's own labels. */
+typedef struct {
+  ip6_t ip; /* IPv4 addresses in .lo */
+  uint32_t label;
+  uint8_t block;
+  uint8_t family;
+} IPLabeled;
+
+struct IPLoader {
+  IPScannerRef scanner;
+  IPRange *ranges;
+  size_t count; /* ranges collected */
+  size_t size; /* room in .ranges */
+  IPRange6 *ranges6;
+  size_t count6;
+  size_t size6;
+  IPLabeled *labeled; /* in the order they were collected */
+  size_t countl;
+  size_t sizel;
+  IPLabels labels;
+};
+
+/* A leaf is NODE_LEAF with the label of every address under it. Two of them work as
+ * sentinel values: ZERO for a subnet range where no IPs exist and FULL for one that is
+ * fully occupied (without a label). Node indices never have NODE_LEAF set.
+ */
+#define NODE_LEAF 0x80000000u
+#define ZERO (NODE_LEAF | IP_LABEL_NONE)
+#define FULL (NODE_LEAF | IP_LABEL_ANY)
+
+/* What iptree_merge does with the addresses of the other tree. */
+#define MERGE_UNION 0
+#define MERGE_INTERSECT 1
+#define MERGE_SUBTRACT 2
+
+#define SLAB_BITS 16
+#define SLAB_NODES (1 << SLAB_BITS)
+#define NODE(tree, ref) (&(tree)->slabs[(ref) >> SLAB_BITS][(ref) & (SLAB_NODES - 1)])
+
+/* Where an IPv6 address may start and end: not in the middle of a word, a number or
+ * another address.
+ */
+#define IP6_WORDCHAR(c) (((c) >= '0' && (c) <= '9') || ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) == '_')
+#define IP6_WORDSTART(start, p) ((p) == (start) || !(IP6_WORDCHAR((p)[-1]) || (p)[-1] == ':' || (p)[-1] == '.'))
+
+/* What separates the address on a line of a labeled list from its label, and ends the label. */
+#define LABEL_SEPARATOR(c) ((c) == ' ' || (c) == '\t' || (c) == ',' || (c) == ';' || (c) == '\r')
+
+/* Bytes that can be part of an address or its CIDR block. No address is ever parsed across
+ * any other byte, so parsing from just after one finds the same addresses from there on
+ * as parsing the whole line does.
+ */
+#define IP_ADDRCHAR(c) (hexvalue[(unsigned char) (c)] >= 0 || (c) == '.' || (c) == ':' || (c) == '/')
+#define IP_TAIL_WINDOW 64 /* bytes at the end of a line parsed first for a negative pos */
+
+static const signed char hexvalue[256] = {
+  [0 ... 255] = -1,
+  ['0'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+  ['a'] = 10, 11, 12, 13, 14, 15,
+  ['A'] = 10, 11, 12, 13, 14, 15
+};
+
+/* Bit number bit (127 = most significant) of a 128-bit key. IPv4 addresses are inserted
+ * as keys with the address in .lo, starting from bit 31.
+ */
+#define KEYBIT(key, bit) ((bit) >= 64 ? ((key).hi >> ((bit) - 64)) & 1 : ((key).lo >> (bit)) & 1)
+
+/* The compiled table is a three-level multibit trie with strides of 16, 8 and 8 bits
+ * (DIR-16-8-8). Every entry is either a leaf, with TABLE_LEAF set and the label in the
+ * other bits, or the index in the same array of a child table of TABLE_CHILD entries.
+ * The root table takes the first TABLE_ROOT entries. IPv6 gets a second root table and
+ * continues in strides of 8 bits as deep as its tree goes.
+ */
+#define TABLE_ROOT (1 << 16)
+#define TABLE_CHILD (1 << 8)
+#define TABLE_LEAF 0x80000000u
+#define TABLE_MAX (1 << 26) /* don't compile trees whose table would be bigger than 256MB */
+
 
 /* Private declarations */
 
-static void node_insert(IPNodeRef *node_p, ip_t ip, int bit, int end);
-static int node_search(IPNodeRef node, ip_t ip, int bit);
-static void freenode(IPNodeRef node);
-static void dumpnode(IPNodeRef node, ip_t ip, int bit);
-static inline void dumpip(ip_t ip, int cidr);
+static void node_insert(IPTreeRef tree, IPNodeRef *node_p, ip6_t key, int bit, int end, IPNodeRef leaf);
+static int node_search(IPTreeRef tree, IPNodeRef node, ip_t ip);
+static int node_search6(IPTreeRef tree, IPNodeRef node, ip6_t ip);
+static IPNodeRef node_alloc(IPTreeRef tree);
+static int table_batch(const uint32_t *table, const ip_t *ips, int n, uint8_t *out);
+static int node_batch(IPTreeRef tree, const ip_t *ips, int n, uint8_t *out);
+static void freenode(IPTreeRef tree, IPNodeRef node);
+static void dumpnode(IPTreeRef tree, IPNodeRef node, ip_t ip, int bit);
+static void dumpnode6(IPTreeRef tree, IPNodeRef node, ip6_t ip, int bit);
+static void node_stats(IPTreeRef tree, IPNodeRef node, int bit, IPTreeStats *stats, size_t *blocks, int *depth);
+static long table_reserve(IPTreeRef tree, size_t entries);
+static int table_expand(IPTreeRef tree, IPNodeRef node, size_t slot, size_t span);
+static void table_free(IPTreeRef tree);
+static void tree_unmap(IPTreeRef tree);
+static inline void dumpip(ip_t ip, int cidr, const char *label);
+static void dumpip6(ip6_t ip, int cidr, const char *label);
+static void dumplabel(const char *label);
 static int validateip(ip_t, int cidr);
+static int validateip6(ip6_t ip, int cidr);
+static void scanner_grow(IPScannerRef scanner);
+static void radixsort(void *items, size_t n, size_t size, const int *order, int passes);
+static size_t ranges_merge(IPRange *ranges, size_t n);
+static size_t ranges_merge6(IPRange6 *ranges, size_t n);
+static IPNodeRef node_build(IPTreeRef tree, const IPRange *ranges, size_t n, ip_t base, int bit);
+static IPNodeRef node_build6(IPTreeRef tree, const IPRange6 *ranges, size_t n, ip6_t base, int bit);
+static IPNodeRef node_union(IPTreeRef tree, IPNodeRef a, IPNodeRef b);
+static void iptree_merge(IPTreeRef tree, IPTreeRef other, int op);
+static IPNodeRef node_merge(IPTreeRef tree, IPNodeRef a, IPTreeRef other, IPNodeRef b, int op, const uint32_t *numbers);
+static ip6_t ip6_last(ip6_t ip, int cidr);
+static inline uint32_t label_hash(const char *name, size_t len);
+static void labels_init(IPLabels *labels);
+static void labels_free(IPLabels *labels);
+static uint32_t labels_number(IPLabels *labels, const char *name, size_t len);
+static void iptree_paint(IPTreeRef tree, IPLoaderRef loader);
+
+/* Detects every full IP address in the string with an optional /CIDR block and stores them in the scanner.
+ * If CIDR block is not provided then the block is set to 32 (128 for IPv6) to indicate a single IP.
+ * Scanning starts at data, which may be past the start of the line at line, and stops at end or
+ * once limit addresses have been found (0 = no limit); *resume is set to where it stopped.
+ * Returns the number of addresses found.
+ */
+static int detectip_str(IPScannerRef scanner, const char *line, char *data, const char *end, int limit, char **resume);
+static int scanner_findany(IPTreeRef tree, IPScannerRef scanner, IPFound *match);
+static inline void scanner_match(IPScannerRef scanner, int family, int nth, IPFound *match);
 
-/* Detects the first full IP address in the string with an optional /CIDR block and populates ipbuf and blockbuf.
- * If CIDR block is not provided then blockbuf value is set to 32 to indicate a single IP.
- * Caller must free returned buffers.
+/* Returns the first byte from p to end (inclusive) that may start an address: a digit or
+ * ':'. Returns end + 1 if there is none. Selected at runtime by CPU features.
  */
-static int detectip_str(char *data, const char *end, ip_t **ips, int **blocks);
+typedef char *(*ipskip_t)(char *p, const char *end);
+#define IP_SKIP_SCALAR 16 /* bytes looked at one by one before ipskip is called */
+#define IP_CANDIDATE(c) ((unsigned char) ((c) - '0') <= ':' - '0') /* ':' comes right after '9' */
+static char *ipskip_scalar(char *p, const char *end);
+#ifdef IP_X86
+static char *ipskip_sse2(char *p, const char *end);
+static char *ipskip_avx2(char *p, const char *end);
+#endif
+static ipskip_t ipskip = 0;
+int ip_simd_enabled = 1;
+
+/* Parses the IPv6 address (with an optional /CIDR block) that starts at p. Returns a
+ * pointer just past the address, or 0 if there isn't one.
+ */
+static char *detectip6(char *p, const char *end, ip6_t *ip, int *block);
+
+/* Used by the non-reentrant addip_str and findip_str. */
+static IPScannerRef shared_scanner = 0;
 
 /* Public API */
 
 int addip_str(IPTreeRef tree, char *data, const char *end) {
-  ip_t *ips;
-  int *blocks;
   int count;
   
-  if((count = detectip_str(data, end, &ips, &blocks)) == 0)
-    return IP_NOT_FOUND;
+  if(!shared_scanner)
+    shared_scanner = makeipscanner();
+  
+  if((count = detectip_str(shared_scanner, data, data, end, 1, &data)) == 0)
+    return IP_NOT_FOUND;
+  
+  if(shared_scanner->families[0] == IP_FAMILY_6)
+    return addip6(tree, shared_scanner->ips6[0], shared_scanner->blocks6[0]);
+  
+  return addip(tree, shared_scanner->ips[0], shared_scanner->blocks[0]);
+}
+
+int findip_str(IPTreeRef tree, char *data, const char *end, int pos) {
+  if(!shared_scanner)
+    shared_scanner = makeipscanner();
+  
+  return findip_str_r(tree, shared_scanner, data, end, pos);
+}
+
+int findip_str_r(IPTreeRef tree, IPScannerRef scanner, char *data, const char *end, int pos) {
+  int res = findlabel_str_r(tree, scanner, data, end, pos);
+  
+  return (res > IP_LABEL_NONE ? 1 : res);
+}
+
+int findlabel_str_r(IPTreeRef tree, IPScannerRef scanner, char *data, const char *end, int pos) {
+  return findmatch_str_r(tree, scanner, data, end, pos, 0);
+}
+
+int findmatch_str_r(IPTreeRef tree, IPScannerRef scanner, char *data, const char *end, int pos, IPFound *match) {
+  char *resume = data;
+  int count;
+  int total = 0;
+  int label;
+  int idx;
+  
+  if(pos == 0) {
+    /* The addresses are taken IP_BATCH at a time and looked up together, so the cache
+     * misses overlap, and the rest of the line is skipped once a batch has a hit.
+     */
+    do {
+      count = detectip_str(scanner, data, resume, end, IP_BATCH, &resume);
+      total += count;
+      if((label = scanner_findany(tree, scanner, match)) != IP_LABEL_NONE)
+        return label;
+    } while(count == IP_BATCH);
+    
+    return (total ? IP_LABEL_NONE : IP_NOT_FOUND);
+  }
+  
+  if(pos > 0) {
+    /* nothing past the pos-th address matters */
+    if((count = detectip_str(scanner, data, data, end, pos, &resume)) == 0)
+      return IP_NOT_FOUND;
+    if(count < pos)
+      return IP_POS_OUT_OF_BOUNDS;
+    
+    if(scanner->families[count - 1] == IP_FAMILY_6) {
+      scanner_match(scanner, IP_FAMILY_6, scanner->count6 - 1, match);
+      return findlabel6(tree, scanner->ips6[scanner->count6 - 1]);
+    }
+    scanner_match(scanner, IP_FAMILY_4, scanner->count4 - 1, match);
+    return findlabel(tree, scanner->ips[scanner->count4 - 1]);
+  }
+  
+  /* A negative pos counts from the end of the line, so the line is parsed from its end
+   * back, a piece at a time: each piece starts at a word IP_TAIL_WINDOW bytes (then four
+   * times as many, and so on) before the previous one and ends where that one starts.
+   * Once the pieces parsed hold enough addresses, the rest of the line doesn't matter.
+   */
+  size_t window = IP_TAIL_WINDOW;
+  const char *stop = end;
+  char *from;
+  for(;;) {
+    from = ((size_t) (stop + 1 - data) > window ? (char *) stop + 1 - window : data);
+    while(from > data && IP_ADDRCHAR(from[-1]))
+      --from;
+    
+    count = detectip_str(scanner, data, from, stop, 0, &resume);
+    total += count;
+    if(total >= -pos || from == data)
+      break;
+    
+    /* the byte before the piece isn't part of an address, so it ends the next one like an EOL */
+    stop = from - 1;
+    window *= 4;
+  }
+  
+  if(total == 0)
+    return IP_NOT_FOUND;
+  if(total < -pos)
+    return IP_POS_OUT_OF_BOUNDS;
+  
+  /* the pieces after this one hold total - count addresses, which leaves the one wanted
+   * at this index in this piece
+   */
+  idx = total + pos;
+  
+  /* the address's index among those of its own family */
+  int family = scanner->families[idx];
+  int nth = 0;
+  int i;
+  for(i = 0; i < idx; ++i)
+    nth += (scanner->families[i] == family);
+  
+  scanner_match(scanner, family, nth, match);
+  if(family == IP_FAMILY_6)
+    return findlabel6(tree, scanner->ips6[nth]);
+  
+  return findlabel(tree, scanner->ips[nth]);
+}
+
+int eachip_str(IPScannerRef scanner, char *data, const char *end, ipfound_fn fn, void *context) {
+  char *resume = data;
+  IPFound found;
+  int count;
+  int res;
+  int i;
+  
+  do {
+    int nth4 = 0, nth6 = 0;
+    
+    count = detectip_str(scanner, data, resume, end, IP_BATCH, &resume);
+    for(i = 0; i < count; ++i) {
+      found.family = scanner->families[i];
+      if(found.family == IP_FAMILY_6) {
+        found.ip6 = scanner->ips6[nth6];
+        found.block = scanner->blocks6[nth6++];
+      } else {
+        found.ip = scanner->ips[nth4];
+        found.block = scanner->blocks[nth4++];
+      }
+      
+      if((res = fn(&found, context)) != 0)
+        return res;
+    }
+  } while(count == IP_BATCH);
+  
+  return 0;
+}
+
+IPScannerRef makeipscanner() {
+  /* init on the first run */
+  if(!ipskip) {
+    ipskip = ipskip_scalar;
+    #ifdef IP_X86
+    __builtin_cpu_init();
+    if(!ip_simd_enabled)
+      ipskip = ipskip_scalar;
+    else if(__builtin_cpu_supports("avx2"))
+      ipskip = ipskip_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+      ipskip = ipskip_sse2;
+    #endif
+  }
+  
+  IPScannerRef scanner = (IPScannerRef) xmalloc(sizeof(struct IPScanner));
+  scanner->max = IPS_PER_LINE;
+  scanner->ips = (ip_t *) xmalloc(sizeof(ip_t) * IPS_PER_LINE);
+  scanner->blocks = (int *) xmalloc(sizeof(int) * IPS_PER_LINE);
+  scanner->ips6 = (ip6_t *) xmalloc(sizeof(ip6_t) * IPS_PER_LINE);
+  scanner->blocks6 = (int *) xmalloc(sizeof(int) * IPS_PER_LINE);
+  scanner->families = (uint8_t *) xmalloc(IPS_PER_LINE);
+  memset(&scanner->stats, 0, sizeof(IPScannerStats));
+  
+  return scanner;
+}
+
+IPScannerStats *ipscanner_stats(IPScannerRef scanner) {
+  return &scanner->stats;
+}
+
+void freeipscanner(IPScannerRef scanner) {
+  free(scanner->ips);
+  free(scanner->blocks);
+  free(scanner->ips6);
+  free(scanner->blocks6);
+  free(scanner->families);
+  free(scanner);
+}
+
+IPTreeRef makeiptree() {
+  IPTreeRef _tree = (IPTreeRef) xmalloc(sizeof(struct IPTree));
+  _tree->root = ZERO;
+  _tree->root6 = ZERO;
+  _tree->slabs = 0;
+  _tree->slabcount = 0;
+  _tree->slabsize = 0;
+  _tree->nodecount = 0;
+  _tree->freelist = ZERO;
+  _tree->table = 0;
+  _tree->map = 0;
+  _tree->maplen = 0;
+  labels_init(&_tree->labels);
+  
+  return _tree;
+}
+
+void iptree_free(IPTreeRef tree) {
+  uint32_t i;
+  
+  if(tree->map) {
+    munmap(tree->map, tree->maplen);
+  } else {
+    for(i = 0; i < tree->slabcount; ++i)
+      free(tree->slabs[i]);
+    table_free(tree);
+  }
+  
+  free(tree->slabs);
+  labels_free(&tree->labels);
+  free(tree);
+}
+
+int iptree_label(IPTreeRef tree, const char *name, size_t len) {
+  return (int) labels_number(&tree->labels, name, len);
+}
+
+const char *iptree_labelname(IPTreeRef tree, int label) {
+  return tree->labels.names[label];
+}
+
+int iptree_labelcount(IPTreeRef tree) {
+  return (int) tree->labels.count;
+}
+
+int iptree_save(IPTreeRef tree, const char *path) {
+  IPSetHeader header;
+  uint32_t i;
+  
+  /* a tree too big to compile is saved without a table and searched node by node */
+  iptree_compile(tree);
+  
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IPSET_MAGIC, sizeof(header.magic));
+  header.version = (tree->labels.count > IP_LABEL_FIRST ? IPSET_VERSION : 1); /* older readers can open a set without labels */
+  header.byteorder = IPSET_BYTEORDER;
+  header.root = tree->root;
+  header.root6 = tree->root6;
+  header.nodecount = tree->nodecount;
+  header.labels = tree->labels.count - IP_LABEL_FIRST;
+  header.table6 = tree->table6;
+  header.tablelen = (tree->table ? tree->tablelen : 0);
+  header.nodes = sizeof(header);
+  header.table = header.nodes + sizeof(struct IPNode) * (uint64_t) tree->nodecount;
+  
+  /* written next to the destination and renamed, so nobody maps a half-written file */
+  size_t len = strlen(path);
+  char *tmppath = xmalloc(len + 5);
+  memcpy(tmppath, path, len);
+  memcpy(tmppath + len, ".tmp", 5);
+  
+  FILE *file = fopen(tmppath, "w");
+  if(!file) {
+    free(tmppath);
+    return IP_ERROR_SET_IO;
+  }
+  
+  int ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+  for(i = 0; ok && i < tree->slabcount; ++i) {
+    uint32_t nodes = tree->nodecount - i * SLAB_NODES;
+    if(nodes > SLAB_NODES)
+      nodes = SLAB_NODES;
+    ok = (fwrite(tree->slabs[i], sizeof(struct IPNode), nodes, file) == nodes);
+  }
+  if(ok && header.tablelen)
+    ok = (fwrite(tree->table, sizeof(uint32_t), header.tablelen, file) == header.tablelen);
+  for(i = IP_LABEL_FIRST; ok && i < tree->labels.count; ++i)
+    ok = (fputs(tree->labels.names[i], file) != EOF && fputc('\0', file) != EOF);
+  
+  if(fclose(file) != 0 || !ok || rename(tmppath, path) != 0) {
+    unlink(tmppath);
+    free(tmppath);
+    return IP_ERROR_SET_IO;
+  }
+  
+  free(tmppath);
+  return 0;
+}
+
+IPTreeRef iptree_map(const char *path, int *error) {
+  struct stat st;
+  IPSetHeader header;
+  uint32_t i;
+  
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    *error = IP_ERROR_SET_IO;
+    return 0;
+  }
+  
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+    *error = (fstat(fd, &st) == 0 ? IP_ERROR_SET_FORMAT : IP_ERROR_SET_IO);
+    close(fd);
+    return 0;
+  }
+  
+  size_t len = (size_t) st.st_size;
+  char *map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    *error = IP_ERROR_SET_IO;
+    return 0;
+  }
+  
+  memcpy(&header, map, sizeof(header));
+  uint64_t names = header.table + sizeof(uint32_t) * header.tablelen;
+  *error = 0;
+  if(memcmp(header.magic, IPSET_MAGIC, sizeof(header.magic)) != 0)
+    *error = IP_ERROR_SET_FORMAT;
+  else if(header.version < 1 || header.version > IPSET_VERSION || header.byteorder != IPSET_BYTEORDER)
+    *error = IP_ERROR_SET_VERSION;
+  else if(header.nodes != sizeof(header)
+    || header.table != header.nodes + sizeof(struct IPNode) * (uint64_t) header.nodecount
+    || names > len || (names == len) != (header.labels == 0) || (len > names && map[len - 1] != '\0')
+    || header.labels >= NODE_LEAF - IP_LABEL_FIRST
+    || header.nodecount >= NODE_LEAF
+    || (!(header.root & NODE_LEAF) && header.root >= header.nodecount)
+    || (!(header.root6 & NODE_LEAF) && header.root6 >= header.nodecount)
+    || (header.tablelen && (header.tablelen < TABLE_ROOT || header.tablelen > TABLE_MAX
+      || header.table6 > header.tablelen - TABLE_ROOT)))
+    *error = IP_ERROR_SET_FORMAT;
+  
+  /* the labels are copied, as there are usually few of them and they outlive the mapping */
+  IPTreeRef tree = makeiptree();
+  char *name = map + names;
+  for(i = 0; *error == 0 && i < header.labels; ++i) {
+    /* every name ends in a NUL (the last byte is one) and none comes twice */
+    size_t namelen = (name < map + len ? strlen(name) : 0);
+    if(name == map + len || labels_number(&tree->labels, name, namelen) != IP_LABEL_FIRST + i)
+      *error = IP_ERROR_SET_FORMAT;
+    name += namelen + 1;
+  }
+  if(*error == 0 && name != map + len)
+    *error = IP_ERROR_SET_FORMAT;
+  
+  if(*error != 0) {
+    iptree_free(tree);
+    munmap(map, len);
+    return 0;
+  }
+  
+  tree->map = map;
+  tree->maplen = len;
+  tree->root = header.root;
+  tree->root6 = header.root6;
+  tree->nodecount = header.nodecount;
+  tree->slabcount = tree->slabsize = (header.nodecount + SLAB_NODES - 1) / SLAB_NODES;
+  if(tree->slabcount) {
+    tree->slabs = xmalloc(sizeof(struct IPNode *) * tree->slabcount);
+    for(i = 0; i < tree->slabcount; ++i)
+      tree->slabs[i] = (struct IPNode *) (map + header.nodes) + (size_t) i * SLAB_NODES;
+  }
+  
+  if(header.tablelen) {
+    tree->table = (uint32_t *) (map + header.table);
+    tree->tablelen = tree->tablesize = header.tablelen;
+    tree->table6 = header.table6;
+  }
+  
+  return tree;
+}
+
+int addip(IPTreeRef tree, ip_t ip, int block) {
+  return addip_label(tree, ip, block, IP_LABEL_ANY);
+}
+
+int addip6(IPTreeRef tree, ip6_t ip, int block) {
+  return addip6_label(tree, ip, block, IP_LABEL_ANY);
+}
+
+int addip_label(IPTreeRef tree, ip_t ip, int block, int label) {
+  int res;
+  if((res = validateip(ip, block)) != 0)
+    return res;
+  
+  /* the compiled table no longer matches the tree */
+  table_free(tree);
+  
+  ip6_t key = {0, ip};
+  node_insert(tree, &(tree->root), key, 31, 31 - block, NODE_LEAF | label);
+  return 0;
+}
+
+int addip6_label(IPTreeRef tree, ip6_t ip, int block, int label) {
+  int res;
+  if((res = validateip6(ip, block)) != 0)
+    return res;
+  
+  table_free(tree);
+  
+  node_insert(tree, &(tree->root6), ip, 127, 127 - block, NODE_LEAF | label);
+  return 0;
+}
+
+int findip(IPTreeRef tree, ip_t ip) {
+  return (findlabel(tree, ip) != IP_LABEL_NONE);
+}
+
+int findip6(IPTreeRef tree, ip6_t ip) {
+  return (findlabel6(tree, ip) != IP_LABEL_NONE);
+}
+
+int findlabel(IPTreeRef tree, ip_t ip) {
+  const uint32_t *table = tree->table;
+  
+  if(!table)
+    return node_search(tree, tree->root, ip);
+  
+  uint32_t entry = table[ip >> 16];
+  if(!(entry & TABLE_LEAF)) {
+    entry = table[entry + ((ip >> 8) & 0xff)];
+    if(!(entry & TABLE_LEAF))
+      entry = table[entry + (ip & 0xff)];
+  }
+  
+  return (int) (entry & ~TABLE_LEAF);
+}
+
+int findlabel6(IPTreeRef tree, ip6_t ip) {
+  const uint32_t *table = tree->table;
+  int byte;
+  
+  if(tree->root6 & NODE_LEAF)
+    return (int) (tree->root6 & ~NODE_LEAF);
+  
+  if(!table)
+    return node_search6(tree, tree->root6, ip);
+  
+  uint32_t entry = table[tree->table6 + (ip.hi >> 48)];
+  for(byte = 2; !(entry & TABLE_LEAF); ++byte)
+    entry = table[entry + ((byte < 8 ? ip.hi >> (56 - 8 * byte) : ip.lo >> (120 - 8 * byte)) & 0xff)];
+  
+  return (int) (entry & ~TABLE_LEAF);
+}
+
+int findblock(IPTreeRef tree, ip_t *ip) {
+  IPNodeRef node = tree->root;
+  int bit = 31;
+  
+  /* the table doesn't know where one block ends and the next starts, the tree does */
+  while(!(node & NODE_LEAF))
+    node = NODE(tree, node)->children[(*ip >> bit--) & 1];
+  
+  if(bit == 31)
+    *ip = 0;
+  else
+    *ip &= 0xffffffff << (bit + 1);
+  
+  return 31 - bit;
+}
+
+int findblock6(IPTreeRef tree, ip6_t *ip) {
+  IPNodeRef node = tree->root6;
+  ip6_t zero = {0, 0};
+  int bit = 127;
+  
+  for(; !(node & NODE_LEAF); --bit)
+    node = NODE(tree, node)->children[KEYBIT(*ip, bit)];
+  
+  ip6_t host = ip6_last(zero, 127 - bit);
+  ip->hi &= ~host.hi;
+  ip->lo &= ~host.lo;
+  
+  return 127 - bit;
+}
+
+int findip_batch(IPTreeRef tree, const ip_t *ips, int n, uint8_t *out) {
+  int found = 0;
+  int i;
+  
+  for(i = 0; i < n; i += IP_BATCH) {
+    int m = (n - i < IP_BATCH ? n - i : IP_BATCH);
+    
+    if(tree->table)
+      found += table_batch(tree->table, ips + i, m, out + i);
+    else
+      found += node_batch(tree, ips + i, m, out + i);
+  }
+  
+  return found;
+}
+
+int iptree_compile(IPTreeRef tree) {
+  /* adding anything throws the table away, so one that is there is up to date; a mapped
+   * tree without one was already too big when it was saved
+   */
+  if(tree->table || tree->map)
+    return (tree->table ? 0 : -1);
+  
+  tree->tablesize = TABLE_ROOT * 2;
+  tree->tablelen = TABLE_ROOT;
+  tree->table = xmalloc(sizeof(uint32_t) * tree->tablesize);
+  
+  if(table_expand(tree, tree->root, 0, TABLE_ROOT) != 0) {
+    table_free(tree);
+    return -1;
+  }
+  
+  tree->table6 = 0;
+  if(!(tree->root6 & NODE_LEAF)) {
+    long slot = table_reserve(tree, TABLE_ROOT);
+    if(slot < 0 || table_expand(tree, tree->root6, slot, TABLE_ROOT) != 0) {
+      table_free(tree);
+      return -1;
+    }
+    tree->table6 = slot;
+  }
+  
+  /* give back what the last doubling didn't use */
+  tree->tablesize = tree->tablelen;
+  tree->table = xrealloc(tree->table, sizeof(uint32_t) * tree->tablesize);
+  
+  return 0;
+}
+
+void dumptree(IPTreeRef tree) {
+  ip6_t zero = {0, 0};
+  
+  dumpnode(tree, tree->root, 0, 31);
+  dumpnode6(tree, tree->root6, zero, 127);
+}
+
+int ip_str(char *buf, ip_t ip, int block) {
+  if(block < 0)
+    return sprintf(buf, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+  
+  return sprintf(buf, "%u.%u.%u.%u/%d", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, block);
+}
+
+/* The canonical text form (RFC 5952): lowercase hex, and the longest run of two or more
+ * zero groups (the first one, on a tie) shortened to "::".
+ */
+int ip6_str(char *buf, ip6_t ip, int block) {
+  unsigned groups[8];
+  int best = -1, bestlen = 1;
+  int len = 0;
+  int i, j;
+  
+  for(i = 0; i < 4; ++i) {
+    groups[i] = (ip.hi >> (48 - 16 * i)) & 0xffff;
+    groups[i + 4] = (ip.lo >> (48 - 16 * i)) & 0xffff;
+  }
+  
+  for(i = 0; i < 8; i = j + 1) {
+    for(j = i; j < 8 && groups[j] == 0; ++j)
+      continue;
+    if(j - i > bestlen) {
+      best = i;
+      bestlen = j - i;
+    }
+  }
+  
+  for(i = 0; i < 8; ++i) {
+    if(i == best) {
+      len += sprintf(buf + len, "::");
+      i += bestlen - 1;
+    } else {
+      len += sprintf(buf + len, (i == 0 || i == best + bestlen) ? "%x" : ":%x", groups[i]);
+    }
+  }
+  
+  if(block >= 0)
+    len += sprintf(buf + len, "/%d", block);
+  
+  return len;
+}
+
+IPLoaderRef makeiploader() {
+  IPLoaderRef loader = (IPLoaderRef) xmalloc(sizeof(struct IPLoader));
+  loader->scanner = makeipscanner();
+  loader->ranges = 0;
+  loader->count = loader->size = 0;
+  loader->ranges6 = 0;
+  loader->count6 = loader->size6 = 0;
+  loader->labeled = 0;
+  loader->countl = loader->sizel = 0;
+  labels_init(&loader->labels);
+  
+  return loader;
+}
+
+void freeiploader(IPLoaderRef loader) {
+  freeipscanner(loader->scanner);
+  free(loader->ranges);
+  free(loader->ranges6);
+  free(loader->labeled);
+  labels_free(&loader->labels);
+  free(loader);
+}
+
+int iploader_add_str(IPLoaderRef loader, char *data, const char *end) {
+  IPScannerRef scanner = loader->scanner;
+  int res;
+  
+  if(detectip_str(scanner, data, data, end, 1, &data) == 0)
+    return IP_NOT_FOUND;
+  
+  if(scanner->families[0] == IP_FAMILY_6) {
+    ip6_t ip = scanner->ips6[0];
+    int block = scanner->blocks6[0];
+    if((res = validateip6(ip, block)) != 0)
+      return res;
+    
+    if(loader->count6 == loader->size6) {
+      loader->size6 = (loader->size6 ? loader->size6 * 2 : 1024);
+      loader->ranges6 = xrealloc(loader->ranges6, sizeof(IPRange6) * loader->size6);
+    }
+    
+    loader->ranges6[loader->count6].first = ip;
+    loader->ranges6[loader->count6++].last = ip6_last(ip, block);
+    return 0;
+  }
+  
+  ip_t ip = scanner->ips[0];
+  int block = scanner->blocks[0];
+  if((res = validateip(ip, block)) != 0)
+    return res;
+  
+  if(loader->count == loader->size) {
+    loader->size = (loader->size ? loader->size * 2 : 1024);
+    loader->ranges = xrealloc(loader->ranges, sizeof(IPRange) * loader->size);
+  }
+  
+  loader->ranges[loader->count].first = ip;
+  loader->ranges[loader->count++].last = ip | (ip_t) (((uint64_t) 1 << (32 - block)) - 1);
+  return 0;
+}
+
+int iploader_add_label_str(IPLoaderRef loader, char *data, const char *end) {
+  IPScannerRef scanner = loader->scanner;
+  IPLabeled labeled;
+  char *label;
+  int res;
+  
+  if(detectip_str(scanner, data, data, end, 1, &data) == 0)
+    return IP_NOT_FOUND;
+  
+  if(scanner->families[0] == IP_FAMILY_6) {
+    labeled.ip = scanner->ips6[0];
+    labeled.block = (uint8_t) scanner->blocks6[0];
+    labeled.family = IP_FAMILY_6;
+    res = validateip6(labeled.ip, scanner->blocks6[0]);
+  } else {
+    labeled.ip.hi = 0;
+    labeled.ip.lo = scanner->ips[0];
+    labeled.block = (uint8_t) scanner->blocks[0];
+    labeled.family = IP_FAMILY_4;
+    res = validateip(scanner->ips[0], scanner->blocks[0]);
+  }
+  if(res != 0)
+    return res;
+  
+  /* the label is the first word after the address */
+  while(data < end && LABEL_SEPARATOR(*data))
+    ++data;
+  for(label = data; data < end && !LABEL_SEPARATOR(*data); ++data)
+    continue;
+  if(data == label)
+    return IP_ERROR_LABEL_MISSING;
+  
+  labeled.label = labels_number(&loader->labels, label, data - label);
+  
+  if(loader->countl == loader->sizel) {
+    loader->sizel = (loader->sizel ? loader->sizel * 2 : 1024);
+    loader->labeled = xrealloc(loader->labeled, sizeof(IPLabeled) * loader->sizel);
+  }
+  
+  loader->labeled[loader->countl++] = labeled;
+  return 0;
+}
+
+void iploader_merge(IPLoaderRef loader, IPLoaderRef from) {
+  if(loader->count + from->count > loader->size) {
+    loader->size = loader->count + from->count;
+    loader->ranges = xrealloc(loader->ranges, sizeof(IPRange) * loader->size);
+  }
+  
+  if(loader->count6 + from->count6 > loader->size6) {
+    loader->size6 = loader->count6 + from->count6;
+    loader->ranges6 = xrealloc(loader->ranges6, sizeof(IPRange6) * loader->size6);
+  }
+  
+  memcpy(loader->ranges + loader->count, from->ranges, sizeof(IPRange) * from->count);
+  memcpy(loader->ranges6 + loader->count6, from->ranges6, sizeof(IPRange6) * from->count6);
+  loader->count += from->count;
+  loader->count6 += from->count6;
+  from->count = from->count6 = 0;
+  
+  if(from->countl == 0)
+    return;
+  
+  /* the labels of from get the numbers loader has (or gives) their names */
+  uint32_t *numbers = xmalloc(sizeof(uint32_t) * from->labels.count);
+  size_t i;
+  for(i = IP_LABEL_FIRST; i < from->labels.count; ++i)
+    numbers[i] = labels_number(&loader->labels, from->labels.names[i], strlen(from->labels.names[i]));
+  
+  if(loader->countl + from->countl > loader->sizel) {
+    loader->sizel = loader->countl + from->countl;
+    loader->labeled = xrealloc(loader->labeled, sizeof(IPLabeled) * loader->sizel);
+  }
+  
+  for(i = 0; i < from->countl; ++i) {
+    loader->labeled[loader->countl] = from->labeled[i];
+    loader->labeled[loader->countl++].label = numbers[from->labeled[i].label];
+  }
+  
+  from->countl = 0;
+  free(numbers);
+}
+
+void iptree_load(IPTreeRef tree, IPLoaderRef loader) {
+  /* byte offsets of the sort keys (.first), least significant first */
+  static const int order[4] = {0, 1, 2, 3};
+  static const int order6[16] = {8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7};
+  ip6_t zero = {0, 0};
+  size_t n;
+  
+  if(loader->count == 0 && loader->count6 == 0 && loader->countl == 0)
+    return;
+  
+  table_free(tree);
+  
+  if(loader->countl) {
+    iptree_paint(tree, loader);
+    return;
+  }
+  
+  if(loader->count) {
+    radixsort(loader->ranges, loader->count, sizeof(IPRange), order, 4);
+    n = ranges_merge(loader->ranges, loader->count);
+    tree->root = node_union(tree, tree->root, node_build(tree, loader->ranges, n, 0, 31));
+  }
+  
+  if(loader->count6) {
+    radixsort(loader->ranges6, loader->count6, sizeof(IPRange6), order6, 16);
+    n = ranges_merge6(loader->ranges6, loader->count6);
+    tree->root6 = node_union(tree, tree->root6, node_build6(tree, loader->ranges6, n, zero, 127));
+  }
+  
+  loader->count = loader->count6 = 0;
+}
+
+void iptree_union(IPTreeRef tree, IPTreeRef other) {
+  iptree_merge(tree, other, MERGE_UNION);
+}
+
+void iptree_intersect(IPTreeRef tree, IPTreeRef other) {
+  iptree_merge(tree, other, MERGE_INTERSECT);
+}
+
+void iptree_subtract(IPTreeRef tree, IPTreeRef other) {
+  iptree_merge(tree, other, MERGE_SUBTRACT);
+}
+
+int iptree_empty(IPTreeRef tree) {
+  return (tree->root == ZERO && tree->root6 == ZERO);
+}
+
+void iptree_stats(IPTreeRef tree, IPTreeStats *stats) {
+  uint32_t i;
+  
+  memset(stats, 0, sizeof(IPTreeStats));
+  node_stats(tree, tree->root, 0, stats, &stats->blocks, &stats->depth);
+  node_stats(tree, tree->root6, 0, stats, &stats->blocks6, &stats->depth6);
+  stats->tablelen = (tree->table ? tree->tablelen : 0);
+  
+  stats->memory = sizeof(struct IPTree) + sizeof(struct IPNode *) * tree->slabsize
+    + sizeof(char *) * tree->labels.size + sizeof(uint32_t) * tree->labels.slotcount;
+  for(i = IP_LABEL_FIRST; i < tree->labels.count; ++i)
+    stats->memory += strlen(tree->labels.names[i]) + 1;
+  
+  /* a mapped tree has its nodes and table in the file */
+  if(tree->map)
+    stats->memory += tree->maplen;
+  else
+    stats->memory += sizeof(struct IPNode) * SLAB_NODES * tree->slabcount + sizeof(uint32_t) * (tree->table ? tree->tablesize : 0);
+}
+
+/* Private implementations */
+
+/* Fills the span entries of the table starting at slot with the subtree under node.
+ * Each entry covers the same number of addresses; where the subtree doesn't end in
+ * a leaf by the time the span is down to one entry, the entry gets a child table
+ * for the next 8 bits. Returns -1 if the table would grow past TABLE_MAX.
+ */
+static int table_expand(IPTreeRef tree, IPNodeRef node, size_t slot, size_t span) {
+  size_t i;
+  
+  if(node & NODE_LEAF) {
+    uint32_t leaf = TABLE_LEAF | (node & ~NODE_LEAF);
+    for(i = 0; i < span; ++i)
+      tree->table[slot + i] = leaf;
+    return 0;
+  }
+  
+  if(span == 1) {
+    long child = table_reserve(tree, TABLE_CHILD);
+    if(child < 0)
+      return -1;
+    
+    tree->table[slot] = (uint32_t) child;
+    return table_expand(tree, node, child, TABLE_CHILD);
+  }
+  
+  if(table_expand(tree, NODE(tree, node)->children[0], slot, span / 2) != 0)
+    return -1;
+  return table_expand(tree, NODE(tree, node)->children[1], slot + span / 2, span / 2);
+}
+
+/* Appends room for entries to the table and returns its index, or -1 past TABLE_MAX. */
+static long table_reserve(IPTreeRef tree, size_t entries) {
+  if(tree->tablelen + entries > TABLE_MAX)
+    return -1;
+  
+  while(tree->tablelen + entries > tree->tablesize) {
+    tree->tablesize *= 2;
+    tree->table = xrealloc(tree->table, sizeof(uint32_t) * tree->tablesize);
+  }
+  
+  size_t slot = tree->tablelen;
+  tree->tablelen += entries;
+  return (long) slot;
+}
+
+/* Throws the compiled table away, as the tree is about to change. A mapped tree gets
+ * copied out of the mapping first.
+ */
+static void table_free(IPTreeRef tree) {
+  if(tree->map) {
+    tree_unmap(tree);
+    return;
+  }
+  
+  free(tree->table);
+  tree->table = 0;
+}
+
+/* Copies the nodes of a tree opened with iptree_map into slabs of its own and drops the
+ * mapping, table and all.
+ */
+static void tree_unmap(IPTreeRef tree) {
+  uint32_t i;
+  
+  for(i = 0; i < tree->slabcount; ++i) {
+    struct IPNode *slab = xmalloc(sizeof(struct IPNode) * SLAB_NODES);
+    uint32_t nodes = tree->nodecount - i * SLAB_NODES;
+    memcpy(slab, tree->slabs[i], sizeof(struct IPNode) * (nodes > SLAB_NODES ? SLAB_NODES : nodes));
+    tree->slabs[i] = slab;
+  }
+  
+  munmap(tree->map, tree->maplen);
+  tree->map = 0;
+  tree->maplen = 0;
+  tree->table = 0;
+}
+
+static void dumpnode(IPTreeRef tree, IPNodeRef node, ip_t ip, int bit) {
+  if(node == ZERO)
+    return;
+  
+  if(node & NODE_LEAF) {
+    dumpip(ip, 31 - bit, iptree_labelname(tree, node & ~NODE_LEAF));
+    return;
+  }
+  
+  dumpnode(tree, NODE(tree, node)->children[0], ip, bit - 1);
+  dumpnode(tree, NODE(tree, node)->children[1], ip | (1 << bit), bit - 1);
+}
+
+static inline void dumpip(ip_t ip, int cidr, const char *label) {
+  char buf[IP_STRLEN];
+  
+  ip_str(buf, ip, cidr);
+  fputs(buf, stdout);
+  dumplabel(label);
+}
+
+static void dumpnode6(IPTreeRef tree, IPNodeRef node, ip6_t ip, int bit) {
+  if(node == ZERO)
+    return;
+  
+  if(node & NODE_LEAF) {
+    dumpip6(ip, 127 - bit, iptree_labelname(tree, node & ~NODE_LEAF));
+    return;
+  }
+  
+  dumpnode6(tree, NODE(tree, node)->children[0], ip, bit - 1);
+  if(bit >= 64)
+    ip.hi |= (uint64_t) 1 << (bit - 64);
+  else
+    ip.lo |= (uint64_t) 1 << bit;
+  dumpnode6(tree, NODE(tree, node)->children[1], ip, bit - 1);
+}
+
+/* Counts the nodes and non-empty leaves under node, bit levels below the root, and
+ * raises *depth to the deepest of them.
+ */
+static void node_stats(IPTreeRef tree, IPNodeRef node, int bit, IPTreeStats *stats, size_t *blocks, int *depth) {
+  if(bit > *depth)
+    *depth = bit;
+  
+  if(node & NODE_LEAF) {
+    *blocks += (node != ZERO);
+    return;
+  }
+  
+  ++stats->nodes;
+  node_stats(tree, NODE(tree, node)->children[0], bit + 1, stats, blocks, depth);
+  node_stats(tree, NODE(tree, node)->children[1], bit + 1, stats, blocks, depth);
+}
+
+static void dumpip6(ip6_t ip, int cidr, const char *label) {
+  char buf[IP_STRLEN];
+  
+  ip6_str(buf, ip, cidr);
+  fputs(buf, stdout);
+  dumplabel(label);
+}
+
+/* Ends the line of a block printed by dumpip or dumpip6 with its label, if it has one. */
+static void dumplabel(const char *label) {
+  if(label)
+    printf(" %s\n", label);
+  else
+    putchar('\n');
+}
+
+static int validateip(ip_t ip, int cidr) {
+  if(ip > 0xffffffff)
+    return IP_ERROR_ADDRESS_INVALID_BAD_IP;
+  
+  if(cidr < 0 || cidr > 32)
+    return IP_ERROR_ADDRESS_INVALID_BAD_CIDR;
+  
+  if((ip & 0xffffffff & (0xffffffff << (32 - cidr))) != ip)
+    return IP_ERROR_ADDRESS_INVALID_BAD_CIDR;
+  
+  return 0;
+}
+
+static int validateip6(ip6_t ip, int cidr) {
+  if(cidr < 0 || cidr > 128)
+    return IP_ERROR_ADDRESS_INVALID_BAD_CIDR;
+  
+  uint64_t himask = (cidr >= 64 ? ~(uint64_t) 0 : (cidr == 0 ? 0 : ~(uint64_t) 0 << (64 - cidr)));
+  uint64_t lomask = (cidr <= 64 ? 0 : (cidr == 128 ? ~(uint64_t) 0 : ~(uint64_t) 0 << (128 - cidr)));
+  if((ip.hi & ~himask) || (ip.lo & ~lomask))
+    return IP_ERROR_ADDRESS_INVALID_BAD_CIDR;
+  
+  return 0;
+}
+
+/* The last address of the block of cidr bits starting at ip. */
+static ip6_t ip6_last(ip6_t ip, int cidr) {
+  int hostbits = 128 - cidr;
+  
+  if(hostbits >= 64) {
+    ip.lo = ~(uint64_t) 0;
+    if(hostbits > 64)
+      ip.hi |= (hostbits == 128 ? ~(uint64_t) 0 : ((uint64_t) 1 << (hostbits - 64)) - 1);
+  } else {
+    ip.lo |= ((uint64_t) 1 << hostbits) - 1;
+  }
+  
+  return ip;
+}
+
+/* iptree_load for a loader with labels. The blocks can't simply be merged, as a block
+ * inside another one with a different label has to keep its own, so every block is added
+ * by itself, shortest first, and the more specific ones paint over those they are in.
+ * Among blocks of the same size the unlabeled ones go first, so they never hide a label.
+ */
+static void iptree_paint(IPTreeRef tree, IPLoaderRef loader) {
+  static const int order[1] = {offsetof(IPLabeled, block)};
+  size_t n = loader->count + loader->count6 + loader->countl;
+  IPLabeled *blocks = xmalloc(sizeof(IPLabeled) * n);
+  uint32_t *numbers = xmalloc(sizeof(uint32_t) * loader->labels.count);
+  size_t i, j = 0;
+  
+  for(i = 0; i < loader->count; ++i, ++j) {
+    blocks[j].ip.hi = 0;
+    blocks[j].ip.lo = loader->ranges[i].first;
+    blocks[j].block = 32 - __builtin_popcount(loader->ranges[i].first ^ loader->ranges[i].last);
+    blocks[j].family = IP_FAMILY_4;
+    blocks[j].label = IP_LABEL_ANY;
+  }
+  
+  for(i = 0; i < loader->count6; ++i, ++j) {
+    IPRange6 *range = &loader->ranges6[i];
+    blocks[j].ip = range->first;
+    blocks[j].block = 128 - __builtin_popcountll(range->first.hi ^ range->last.hi)
+      - __builtin_popcountll(range->first.lo ^ range->last.lo);
+    blocks[j].family = IP_FAMILY_6;
+    blocks[j].label = IP_LABEL_ANY;
+  }
+  
+  memcpy(blocks + j, loader->labeled, sizeof(IPLabeled) * loader->countl);
+  
+  /* from the loader's numbers to the tree's */
+  numbers[IP_LABEL_ANY] = IP_LABEL_ANY;
+  for(i = IP_LABEL_FIRST; i < loader->labels.count; ++i)
+    numbers[i] = labels_number(&tree->labels, loader->labels.names[i], strlen(loader->labels.names[i]));
+  
+  radixsort(blocks, n, sizeof(IPLabeled), order, 1);
+  
+  for(i = 0; i < n; ++i) {
+    IPNodeRef leaf = NODE_LEAF | numbers[blocks[i].label];
+    if(blocks[i].family == IP_FAMILY_6)
+      node_insert(tree, &tree->root6, blocks[i].ip, 127, 127 - blocks[i].block, leaf);
+    else
+      node_insert(tree, &tree->root, blocks[i].ip, 31, 31 - blocks[i].block, leaf);
+  }
   
-  return addip(tree, ips[0], blocks[0]);
+  loader->count = loader->count6 = loader->countl = 0;
+  free(blocks);
+  free(numbers);
 }
 
-int findip_str(IPTreeRef tree, char *data, const char *end, int pos) {
-  ip_t *ips;
-  int *blocks;
-  int count;
-  int idx;
-  int res = 0;
+static inline int ip6_less(ip6_t a, ip6_t b) {
+  return (a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo));
+}
+
+/* Sorts n items of size bytes each by a key made of the bytes at the offsets in order,
+ * least significant first. This is an LSD radix sort, one byte per pass; the counts for
+ * every pass are taken in a single read of the items, and passes where all the items
+ * have the same byte (the upper bytes of most IPv6 lists, say) are skipped.
+ */
+static void radixsort(void *items, size_t n, size_t size, const int *order, int passes) {
+  size_t counts[16][256];
+  unsigned char *src = (unsigned char *) items;
+  unsigned char *dst = xmalloc(n * size);
+  unsigned char *tmp = dst;
+  size_t i;
+  int p, b;
   
-  if((count = detectip_str(data, end, &ips, &blocks)) == 0)
-    return IP_NOT_FOUND;
+  memset(counts, 0, sizeof(counts[0]) * passes);
+  for(i = 0; i < n; ++i) {
+    for(p = 0; p < passes; ++p)
+      ++counts[p][src[i * size + order[p]]];
+  }
   
-  if(pos == 0) {
-    for(idx = 0; idx < count; ++idx) {
-      if((res = findip(tree, ips[idx])))
-        return res;
+  for(p = 0; p < passes; ++p) {
+    size_t *count = counts[p];
+    size_t offset = 0;
+    
+    if(count[src[order[p]]] == n)
+      continue;
+    
+    for(b = 0; b < 256; ++b) {
+      size_t c = count[b];
+      count[b] = offset;
+      offset += c;
     }
     
-    return 0;
-  } else {
-    idx = (pos > 0 ? pos - 1: count - pos);
-    if(idx >= count)
-      return IP_POS_OUT_OF_BOUNDS;
+    for(i = 0; i < n; ++i)
+      memcpy(dst + count[src[i * size + order[p]]]++ * size, src + i * size, size);
     
-    return findip(tree, ips[idx]);
+    unsigned char *swap = src;
+    src = dst;
+    dst = swap;
   }
   
-}
-
-IPTreeRef makeiptree() {
-  IPTreeRef _tree = (IPTreeRef) xmalloc(sizeof(struct IPTree));
-  _tree->root = ZERO;
+  if(src != (unsigned char *) items)
+    memcpy(items, src, n * size);
   
-  return _tree;
+  free(tmp);
 }
 
-int addip(IPTreeRef tree, ip_t ip, int block) {
-  int res;
-  if((res = validateip(ip, block)) != 0)
-    return res;
+/* Merges the ranges (sorted by .first) that overlap or touch, in place. Returns how many
+ * are left.
+ */
+static size_t ranges_merge(IPRange *ranges, size_t n) {
+  size_t i, out = 0;
   
-  node_insert(&(tree->root), ip, 31, 31 - block);
-  return 0;
+  if(n == 0)
+    return 0;
+  
+  for(i = 1; i < n; ++i) {
+    if(ranges[out].last == 0xffffffff || ranges[i].first <= ranges[out].last + 1) {
+      if(ranges[i].last > ranges[out].last)
+        ranges[out].last = ranges[i].last;
+    } else {
+      ranges[++out] = ranges[i];
+    }
+  }
+  
+  return out + 1;
 }
 
-int findip(IPTreeRef tree, ip_t ip) {
-  return node_search(tree->root, ip, 31);
+static size_t ranges_merge6(IPRange6 *ranges, size_t n) {
+  size_t i, out = 0;
+  
+  if(n == 0)
+    return 0;
+  
+  for(i = 1; i < n; ++i) {
+    ip6_t next = ranges[out].last;
+    if(++next.lo == 0)
+      ++next.hi;
+    
+    if((next.hi == 0 && next.lo == 0) || !ip6_less(next, ranges[i].first)) {
+      if(ip6_less(ranges[out].last, ranges[i].last))
+        ranges[out].last = ranges[i].last;
+    } else {
+      ranges[++out] = ranges[i];
+    }
+  }
+  
+  return out + 1;
 }
 
-void dumptree(IPTreeRef tree) {
-  dumpnode(tree->root, 0, 31);
+/* Builds the subtree for the addresses from base to base + 2^(bit + 1) - 1 out of the n
+ * ranges that overlap them, which must be sorted and merged (so none overlap or touch).
+ * Because of that, a subtree is FULL exactly when one range covers all of it, and no node
+ * ever needs collapsing afterwards.
+ */
+static IPNodeRef node_build(IPTreeRef tree, const IPRange *ranges, size_t n, ip_t base, int bit) {
+  size_t lo = 0, hi = n;
+  
+  if(n == 0)
+    return ZERO;
+  
+  ip_t last = (ip_t) (base + ((uint64_t) 1 << (bit + 1)) - 1);
+  if(ranges[0].first <= base && ranges[0].last >= last)
+    return FULL;
+  
+  /* the ranges that start in the lower half go left, the rest right; one that starts in
+   * the lower half and ends in the upper one goes both ways
+   */
+  ip_t mid = base | ((ip_t) 1 << bit);
+  while(lo < hi) {
+    size_t m = lo + (hi - lo) / 2;
+    if(ranges[m].first < mid)
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  size_t right = (lo > 0 && ranges[lo - 1].last >= mid ? lo - 1 : lo);
+  
+  /* .slabs may move while the children are built, so the node is only looked up after */
+  IPNodeRef node = node_alloc(tree);
+  IPNodeRef left = node_build(tree, ranges, lo, base, bit - 1);
+  IPNodeRef rightnode = node_build(tree, ranges + right, n - right, mid, bit - 1);
+  NODE(tree, node)->children[0] = left;
+  NODE(tree, node)->children[1] = rightnode;
+  
+  return node;
 }
 
-int iptree_empty(IPTreeRef tree) {
-  return (tree->root == ZERO);
+static IPNodeRef node_build6(IPTreeRef tree, const IPRange6 *ranges, size_t n, ip6_t base, int bit) {
+  size_t lo = 0, hi = n;
+  
+  if(n == 0)
+    return ZERO;
+  
+  ip6_t last = ip6_last(base, 127 - bit);
+  if(!ip6_less(base, ranges[0].first) && !ip6_less(ranges[0].last, last))
+    return FULL;
+  
+  ip6_t mid = base;
+  if(bit >= 64)
+    mid.hi |= (uint64_t) 1 << (bit - 64);
+  else
+    mid.lo |= (uint64_t) 1 << bit;
+  
+  while(lo < hi) {
+    size_t m = lo + (hi - lo) / 2;
+    if(ip6_less(ranges[m].first, mid))
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  size_t right = (lo > 0 && !ip6_less(ranges[lo - 1].last, mid) ? lo - 1 : lo);
+  
+  IPNodeRef node = node_alloc(tree);
+  IPNodeRef left = node_build6(tree, ranges, lo, base, bit - 1);
+  IPNodeRef rightnode = node_build6(tree, ranges + right, n - right, mid, bit - 1);
+  NODE(tree, node)->children[0] = left;
+  NODE(tree, node)->children[1] = rightnode;
+  
+  return node;
 }
 
-/* Private implementations */
-
-static void dumpnode(IPNodeRef node, ip_t ip, int bit) {
-  if(node == ZERO)
-    return;
+/* Merges the subtree b, which has no labels, into a (both covering the same addresses)
+ * and returns the result, reusing or freeing the nodes of both. Where b is FULL, any
+ * label a had is replaced.
+ */
+static IPNodeRef node_union(IPTreeRef tree, IPNodeRef a, IPNodeRef b) {
+  if(a == FULL || b == ZERO) {
+    freenode(tree, b);
+    return a;
+  }
   
-  if(node == FULL) {
-    dumpip(ip, 31 - bit);
-    return;
+  if(b == FULL || a == ZERO) {
+    freenode(tree, a);
+    return b;
+  }
+  
+  /* a labeled block with parts of b in it */
+  if(a & NODE_LEAF) {
+    IPNodeRef leaf = a;
+    a = node_alloc(tree);
+    NODE(tree, a)->children[0] = leaf;
+    NODE(tree, a)->children[1] = leaf;
+  }
+  
+  struct IPNode *na = NODE(tree, a);
+  struct IPNode *nb = NODE(tree, b);
+  na->children[0] = node_union(tree, na->children[0], nb->children[0]);
+  na->children[1] = node_union(tree, na->children[1], nb->children[1]);
+  nb->children[0] = tree->freelist;
+  tree->freelist = b;
+  
+  if((na->children[0] & NODE_LEAF) && na->children[0] == na->children[1]) {
+    IPNodeRef leaf = na->children[0];
+    na->children[0] = tree->freelist;
+    tree->freelist = a;
+    return leaf;
   }
   
-  dumpnode(node->children[0], ip, bit - 1);
-  dumpnode(node->children[1], ip | (1 << bit), bit - 1);
+  return a;
 }
 
-static inline void dumpip(ip_t ip, int cidr) {
-  printf("%u.%u.%u.%u/%d\n", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, cidr);
+/* The set algebra behind iptree_union, iptree_intersect and iptree_subtract. */
+static void iptree_merge(IPTreeRef tree, IPTreeRef other, int op) {
+  uint32_t *numbers = xmalloc(sizeof(uint32_t) * other->labels.count);
+  uint32_t i;
+  
+  table_free(tree);
+  
+  /* from the labels of other to those of tree */
+  numbers[IP_LABEL_NONE] = IP_LABEL_NONE;
+  numbers[IP_LABEL_ANY] = IP_LABEL_ANY;
+  for(i = IP_LABEL_FIRST; op == MERGE_UNION && i < other->labels.count; ++i)
+    numbers[i] = labels_number(&tree->labels, other->labels.names[i], strlen(other->labels.names[i]));
+  
+  tree->root = node_merge(tree, tree->root, other, other->root, op, numbers);
+  tree->root6 = node_merge(tree, tree->root6, other, other->root6, op, numbers);
+  
+  free(numbers);
 }
 
-static int validateip(ip_t ip, int cidr) {
-  if(ip > 0xffffffff)
-    return IP_ERROR_ADDRESS_INVALID_BAD_IP;
+/* Combines the subtree a of tree with the subtree b of other (both covering the same
+ * addresses) and returns the result, reusing or freeing the nodes of a. Where b is a
+ * leaf, the result is either a as it is or a single leaf; where a is a leaf and b isn't,
+ * a is split to follow b down.
+ */
+static IPNodeRef node_merge(IPTreeRef tree, IPNodeRef a, IPTreeRef other, IPNodeRef b, int op, const uint32_t *numbers) {
+  if(b & NODE_LEAF) {
+    IPNodeRef leaf;
+    
+    if(op == MERGE_UNION)
+      leaf = (b == ZERO ? a : NODE_LEAF | numbers[b & ~NODE_LEAF]);
+    else if(op == MERGE_INTERSECT)
+      leaf = (b == ZERO ? ZERO : a);
+    else
+      leaf = (b == ZERO ? a : ZERO);
+    
+    if(leaf != a)
+      freenode(tree, a);
+    return leaf;
+  }
   
-  if((ip & 0xffffffff & (0xffffffff << (32 - cidr))) != ip)
-    return IP_ERROR_ADDRESS_INVALID_BAD_CIDR;
+  if(a == ZERO && op != MERGE_UNION)
+    return ZERO;
   
-  return 0;
+  if(a & NODE_LEAF) {
+    IPNodeRef fill = a;
+    a = node_alloc(tree);
+    NODE(tree, a)->children[0] = fill;
+    NODE(tree, a)->children[1] = fill;
+  }
+  
+  struct IPNode *na = NODE(tree, a);
+  struct IPNode *nb = NODE(other, b);
+  na->children[0] = node_merge(tree, na->children[0], other, nb->children[0], op, numbers);
+  na->children[1] = node_merge(tree, na->children[1], other, nb->children[1], op, numbers);
+  
+  if((na->children[0] & NODE_LEAF) && na->children[0] == na->children[1]) {
+    IPNodeRef leaf = na->children[0];
+    na->children[0] = tree->freelist;
+    tree->freelist = a;
+    return leaf;
+  }
+  
+  return a;
 }
 
 /* Adds an address to a node.
- * node_p - the node that the address is being added to. May be replaced with a sentinel value (ZERO or FULL).
- * ip - the IP address being added
+ * node_p - the node that the address is being added to. May be replaced with a leaf.
+ * key - the IP address being added
  * bit - indicates which bit of the address the node_p represents and (therefore) how far down the tree it is
  * end - the size of the block being added, -1 being a /32, 0 a /31 and so on.
+ * leaf - what the block becomes: FULL, or the leaf for its label
  */
-static void node_insert(IPNodeRef *node_p, ip_t ip, int bit, int end) {
+static void node_insert(IPTreeRef tree, IPNodeRef *node_p, ip6_t key, int bit, int end, IPNodeRef leaf) {
   IPNodeRef node;
   node = *node_p;
   
   /* Are we adding something that doesn't exist yet? If not then bail. */
-  if(node == FULL)
+  if(node == leaf)
     return;
   
-  /* Are we at the point where we can operate? If so then set to FULL and bail. */
+  /* Are we at the point where we can operate? If so then set to the leaf and bail. */
   if(bit <= end) {
-    if(node != ZERO) freenode(node);
-    *node_p = FULL;
+    freenode(tree, node);
+    *node_p = leaf;
     return;
   }
   
-  /* If we ended up in a fresh branch then create a new node here. */
-  if(node == ZERO) {
-    node = xmalloc(sizeof(struct IPNode));
-    node->children[0] = ZERO;
-    node->children[1] = ZERO;
+  /* If we ended up in a fresh branch (or one with another label) then create a new node here. */
+  if(node & NODE_LEAF) {
+    IPNodeRef fill = node;
+    node = node_alloc(tree);
+    NODE(tree, node)->children[0] = fill;
+    NODE(tree, node)->children[1] = fill;
     *node_p = node;
   }
   
-  /* Recur using either the left or the right branch based on the bit value. */
-  node_insert(&node->children[(ip >> bit) & 1], ip, bit -1, end);
+  /* Recur using either the left or the right branch based on the bit value.
+   * Slabs never move, so the pointer into this node stays valid while the recursion allocates.
+   */
+  struct IPNode *n = NODE(tree, node);
+  node_insert(tree, &n->children[KEYBIT(key, bit)], key, bit -1, end, leaf);
   
-  /* If both branches are full then collapse them. */
-  if((node->children[0] == FULL) && (node->children[1] == FULL)) {
-    free(node);
-    *node_p = FULL;
+  /* If both branches are the same leaf then collapse them. */
+  if((n->children[0] == leaf) && (n->children[1] == leaf)) {
+    n->children[0] = tree->freelist;
+    tree->freelist = node;
+    *node_p = leaf;
   }
 }
 
-static int node_search(IPNodeRef node, ip_t ip, int bit) {
-  if(node == FULL)
-    return 1;
+static int node_search(IPTreeRef tree, IPNodeRef node, ip_t ip) {
+  int bit = 31;
   
-  if(node == ZERO)
-    return 0;
+  while(!(node & NODE_LEAF))
+    node = NODE(tree, node)->children[(ip >> bit--) & 1];
+  
+  return (int) (node & ~NODE_LEAF);
+}
+
+/* findip_batch on the compiled table for up to IP_BATCH addresses. Each level is done for
+ * all of them before the next one, with the entries for the next level prefetched, so up
+ * to n cache misses are in flight at a time instead of one.
+ */
+static int table_batch(const uint32_t *table, const ip_t *ips, int n, uint8_t *out) {
+  uint32_t entries[IP_BATCH];
+  int found = 0;
+  int i;
+  
+  for(i = 0; i < n; ++i)
+    __builtin_prefetch(&table[ips[i] >> 16]);
+  
+  for(i = 0; i < n; ++i) {
+    entries[i] = table[ips[i] >> 16];
+    if(!(entries[i] & TABLE_LEAF))
+      __builtin_prefetch(&table[entries[i] + ((ips[i] >> 8) & 0xff)]);
+  }
+  
+  for(i = 0; i < n; ++i) {
+    if(!(entries[i] & TABLE_LEAF)) {
+      entries[i] = table[entries[i] + ((ips[i] >> 8) & 0xff)];
+      if(!(entries[i] & TABLE_LEAF))
+        __builtin_prefetch(&table[entries[i] + (ips[i] & 0xff)]);
+    }
+  }
+  
+  for(i = 0; i < n; ++i) {
+    if(!(entries[i] & TABLE_LEAF))
+      entries[i] = table[entries[i] + (ips[i] & 0xff)];
+    
+    out[i] = ((entries[i] & ~TABLE_LEAF) != IP_LABEL_NONE);
+    found += out[i];
+  }
+  
+  return found;
+}
+
+/* findip_batch on the tree itself: the walks go down one level at a time side by side,
+ * prefetching the next node of each, until every one of them has reached a leaf.
+ */
+static int node_batch(IPTreeRef tree, const ip_t *ips, int n, uint8_t *out) {
+  IPNodeRef nodes[IP_BATCH];
+  int found = 0;
+  int active = n;
+  int bit = 31;
+  int i;
+  
+  for(i = 0; i < n; ++i)
+    nodes[i] = tree->root;
+  
+  while(active) {
+    active = 0;
+    for(i = 0; i < n; ++i) {
+      if(nodes[i] & NODE_LEAF)
+        continue;
+      
+      nodes[i] = NODE(tree, nodes[i])->children[(ips[i] >> bit) & 1];
+      if(!(nodes[i] & NODE_LEAF)) {
+        __builtin_prefetch(NODE(tree, nodes[i]));
+        ++active;
+      }
+    }
+    --bit;
+  }
+  
+  for(i = 0; i < n; ++i) {
+    out[i] = (nodes[i] != ZERO);
+    found += out[i];
+  }
+  
+  return found;
+}
+
+static int node_search6(IPTreeRef tree, IPNodeRef node, ip6_t ip) {
+  int bit = 127;
+  
+  for(; !(node & NODE_LEAF); --bit)
+    node = NODE(tree, node)->children[KEYBIT(ip, bit)];
+  
+  return (int) (node & ~NODE_LEAF);
+}
+
+/* Takes a node off the free list, or carves a new one out of the last slab. */
+static IPNodeRef node_alloc(IPTreeRef tree) {
+  IPNodeRef node = tree->freelist;
+  
+  if(node != ZERO) {
+    tree->freelist = NODE(tree, node)->children[0];
+    return node;
+  }
+  
+  if(tree->nodecount == tree->slabcount * SLAB_NODES) {
+    if(tree->nodecount >= NODE_LEAF) {
+      fprintf(stderr, "ip_tree: too many nodes\n");
+      exit(-2);
+    }
+    
+    if(tree->slabcount == tree->slabsize) {
+      tree->slabsize = (tree->slabsize ? tree->slabsize * 2 : 16);
+      tree->slabs = xrealloc(tree->slabs, sizeof(struct IPNode *) * tree->slabsize);
+    }
+    
+    tree->slabs[tree->slabcount++] = xmalloc(sizeof(struct IPNode) * SLAB_NODES);
+  }
   
-  return node_search(node->children[(ip >> bit) & 1], ip, bit -1);
+  return tree->nodecount++;
 }
 
-static void freenode(IPNodeRef node) {
-  if((node == FULL || node == ZERO))
+/* Puts node and everything under it on the free list. */
+static void freenode(IPTreeRef tree, IPNodeRef node) {
+  if(node & NODE_LEAF)
     return;
   
-  freenode(node->children[0]);
-  freenode(node->children[1]);
-  free(node);
+  struct IPNode *n = NODE(tree, node);
+  freenode(tree, n->children[0]);
+  freenode(tree, n->children[1]);
+  
+  n->children[0] = tree->freelist;
+  tree->freelist = node;
+}
+
+static void labels_init(IPLabels *labels) {
+  labels->size = 16;
+  labels->names = xmalloc(sizeof(char *) * labels->size);
+  labels->names[IP_LABEL_NONE] = 0;
+  labels->names[IP_LABEL_ANY] = 0;
+  labels->count = IP_LABEL_FIRST;
+  labels->slots = 0;
+  labels->slotcount = 0;
+}
+
+static void labels_free(IPLabels *labels) {
+  uint32_t i;
+  
+  for(i = IP_LABEL_FIRST; i < labels->count; ++i)
+    free(labels->names[i]);
+  
+  free(labels->names);
+  free(labels->slots);
+}
+
+/* FNV-1a */
+static inline uint32_t label_hash(const char *name, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  
+  for(i = 0; i < len; ++i)
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  
+  return hash;
+}
+
+/* Returns the number of the label called name, numbering it if it is new. The hash table
+ * is kept at most half full and rebuilt from .names whenever it doubles.
+ */
+static uint32_t labels_number(IPLabels *labels, const char *name, size_t len) {
+  uint32_t slot, label;
+  
+  if(labels->count * 2 >= labels->slotcount) {
+    labels->slotcount = (labels->slotcount ? labels->slotcount * 2 : 64);
+    free(labels->slots);
+    labels->slots = xmalloc(sizeof(uint32_t) * labels->slotcount);
+    memset(labels->slots, 0, sizeof(uint32_t) * labels->slotcount);
+    
+    for(label = IP_LABEL_FIRST; label < labels->count; ++label) {
+      const char *known = labels->names[label];
+      slot = label_hash(known, strlen(known)) & (labels->slotcount - 1);
+      for(; labels->slots[slot]; slot = (slot + 1) & (labels->slotcount - 1))
+        continue;
+      labels->slots[slot] = label;
+    }
+  }
+  
+  for(slot = label_hash(name, len) & (labels->slotcount - 1); (label = labels->slots[slot]); slot = (slot + 1) & (labels->slotcount - 1)) {
+    if(strncmp(labels->names[label], name, len) == 0 && labels->names[label][len] == '\0')
+      return label;
+  }
+  
+  if(labels->count >= NODE_LEAF - 1) {
+    fprintf(stderr, "ip_tree: too many labels\n");
+    exit(-2);
+  }
+  
+  if(labels->count == labels->size) {
+    labels->size *= 2;
+    labels->names = xrealloc(labels->names, sizeof(char *) * labels->size);
+  }
+  
+  label = labels->count++;
+  labels->names[label] = xmalloc(len + 1);
+  memcpy(labels->names[label], name, len);
+  labels->names[label][len] = '\0';
+  labels->slots[slot] = label;
+  
+  return label;
 }
 
-/* By default, detectip_str will use a statically-allocated buffer to store the
- * IPs it detects. If it ever runs out of space it'll allocate a dynamic buffer
- * and use that instead.
- *
- * In hindsight it would have made more sense to just use a dynamic buffer, but I was
- * tired and I had a deadline to meet. I'll probably scrap this whole thing later and 
- * replace it with Ragel, at which point I'll make it thread-safe.
+/* Each scanner starts out with room for IPS_PER_LINE addresses and doubles it whenever
+ * a line has more.
  */
-#define IPS_PER_LINE 4
-static unsigned long detectip_max = IPS_PER_LINE;
-static ip_t detectip_ips_static[IPS_PER_LINE];
-static int detectip_blocks_static[IPS_PER_LINE];
-static ip_t *detectip_ips = detectip_ips_static;
-static int *detectip_blocks = detectip_blocks_static;
-
-static int detectip_str(char *data, const char *end, ip_t **ipsbuf, int **blocksbuf) {
+static int detectip_str(IPScannerRef scanner, const char *line, char *data, const char *end, int limit, char **resume) {
   /* This is basically just a state machine. */
+  const char *start = line;
   int count = 0;
   
   unsigned char byte;
   ip_t ip;
   unsigned char ipbyte;
   int block;
+  char *word; /* where a possible IPv6 address starts */
+  char *skip;
+  ip6_t ip6;
+  int block6;
+  char *next;
+  uint64_t started = (scanner->stats.timed ? nanotime() : 0);
+  
+  scanner->count4 = 0;
+  scanner->count6 = 0;
   
   #define STATE_LOOP_BEGIN_EOL_FINISH while(1) { if(data > end) {goto finish;}; byte = *data; ++data; 
   #define STATE_LOOP_BEGIN_EOL_TAIL while(1) { if(data > end) {goto tail;}; byte = *data; ++data;
@@ -222,15 +1835,24 @@ static int detectip_str(char *data, const char *end, ip_t **ipsbuf, int **blocks
   block = 32;
   goto scan;
   
+  /* Most of a log line is not addresses, so the bytes that can't start one (anything but a
+   * digit or ':') are skipped without going through the switch: a few one by one, as gaps
+   * between numbers are usually short, then a vector at a time.
+   */
   scan:
-  STATE_LOOP_BEGIN_EOL_FINISH
-    switch(byte) {
-      case '0'...'9':
-      ip = 0;
-      ipbyte = byte - '0';
-      goto ipbyte1;
-    }
-  STATE_LOOP_END
+  for(skip = data + IP_SKIP_SCALAR; data <= end && data < skip && !IP_CANDIDATE(*data); ++data)
+    continue;
+  if(data == skip)
+    data = ipskip(data, end);
+  if(data > end)
+    goto finish;
+  byte = *data;
+  ++data;
+  if(byte == ':')
+    goto ip6;
+  ip = 0;
+  ipbyte = byte - '0';
+  goto ipbyte1;
   
   ipbyte1:
   STATE_LOOP_BEGIN_EOL_FINISH
@@ -241,11 +1863,26 @@ static int detectip_str(char *data, const char *end, ip_t **ipsbuf, int **blocks
       break;
       case '.':
       goto dot1;
+      case ':':
+      goto ip6;
       default:
       goto scan;
     }
   STATE_LOOP_END
   
+  /* Every IPv6 address has a colon after at most four hex digits, so colons are what
+   * trigger a look for one: back up over the digits to the start of the word. If there
+   * is no address, scanning goes on from the colon, same as when an IPv4 state gives up.
+   */
+  ip6:
+  word = data - 1;
+  while(word > start && data - 1 - word < 4 && hexvalue[(unsigned char) word[-1]] >= 0)
+    --word;
+  if((word < data - 1 || (data <= end && *data == ':')) && IP6_WORDSTART(start, word)
+    && (next = detectip6(word, end, &ip6, &block6)))
+    goto found6;
+  goto scan;
+  
   dot1:
   STATE_LOOP_BEGIN_EOL_FINISH
     switch(byte) {
@@ -364,34 +2001,264 @@ static int detectip_str(char *data, const char *end, ip_t **ipsbuf, int **blocks
   goto found;
   
   found:
-  if(count > detectip_max) {
-    /* If we ever run out of space in the static buffer we allocate a chunk of dynamic memory */
-    if(detectip_max == IPS_PER_LINE) {
-      detectip_max *= 2;
-      ip_t *ips = (ip_t *) xmalloc(sizeof(ip_t) * detectip_max);
-      int *blocks = (int *) xmalloc(sizeof(int) * detectip_max);
-      memcpy(ips, detectip_ips, IPS_PER_LINE * sizeof(ip_t));
-      memcpy(blocks, detectip_blocks, IPS_PER_LINE * sizeof(int));
-      detectip_ips = ips;
-      detectip_blocks = blocks;
-    } else {
-      detectip_max *= 2;
-      detectip_ips = (ip_t *) xrealloc(detectip_ips, sizeof(ip_t) * detectip_max);
-      detectip_blocks = (int *) xrealloc(detectip_blocks, sizeof(int) * detectip_max);
-    }
-    
+  if(count == scanner->max)
+    scanner_grow(scanner);
+  
+  scanner->families[count++] = IP_FAMILY_4;
+  scanner->ips[scanner->count4] = ip;
+  scanner->blocks[scanner->count4++] = block;
+  
+  if(count == limit)
+    goto finish;
+  goto init;
+  
+  found6:
+  data = next;
+  
+  /* an IPv4-mapped address (::ffff:a.b.c.d) is looked up as the IPv4 address it maps */
+  if(ip6.hi == 0 && (ip6.lo >> 32) == 0xffff && block6 >= 96) {
+    ip = (ip_t) ip6.lo;
+    block = block6 - 96;
+    goto found;
   }
   
-  detectip_ips[count] = ip;
-  detectip_blocks[count] = block;
-  ++count;
+  if(count == scanner->max)
+    scanner_grow(scanner);
+  
+  scanner->families[count++] = IP_FAMILY_6;
+  scanner->ips6[scanner->count6] = ip6;
+  scanner->blocks6[scanner->count6++] = block6;
   
+  if(count == limit)
+    goto finish;
   goto init;
   
   finish:
+  *resume = data;
   
-  *ipsbuf = detectip_ips;
-  *blocksbuf = detectip_blocks;
+  scanner->stats.addresses += count;
+  if(started)
+    scanner->stats.parsens += nanotime() - started;
   
   return count;
 }
+
+/* Returns the label of the first address in the scanner (in the order of the line) that is
+ * in the tree, or IP_LABEL_NONE if there is none. If match isn't 0 it is set to that address.
+ */
+static int scanner_findany(IPTreeRef tree, IPScannerRef scanner, IPFound *match) {
+  uint8_t found[IP_BATCH];
+  int nth4 = 0, nth6 = 0;
+  int label;
+  int i;
+  
+  /* only the hit is looked up a second time for its label */
+  if(scanner->count6 == 0) {
+    if(scanner->count4 == 1) {
+      scanner_match(scanner, IP_FAMILY_4, 0, match);
+      return findlabel(tree, scanner->ips[0]);
+    }
+    
+    if(findip_batch(tree, scanner->ips, scanner->count4, found) == 0)
+      return IP_LABEL_NONE;
+    
+    for(i = 0; !found[i]; ++i)
+      continue;
+    scanner_match(scanner, IP_FAMILY_4, i, match);
+    return findlabel(tree, scanner->ips[i]);
+  }
+  
+  for(i = 0; i < scanner->count4 + scanner->count6; ++i) {
+    if(scanner->families[i] == IP_FAMILY_6) {
+      scanner_match(scanner, IP_FAMILY_6, nth6, match);
+      label = findlabel6(tree, scanner->ips6[nth6++]);
+    } else {
+      scanner_match(scanner, IP_FAMILY_4, nth4, match);
+      label = findlabel(tree, scanner->ips[nth4++]);
+    }
+    
+    if(label != IP_LABEL_NONE)
+      return label;
+  }
+  
+  return IP_LABEL_NONE;
+}
+
+/* Sets match (unless it is 0) to the nth address of the family in the scanner. */
+static inline void scanner_match(IPScannerRef scanner, int family, int nth, IPFound *match) {
+  if(!match)
+    return;
+  
+  match->family = family;
+  if(family == IP_FAMILY_6) {
+    match->ip6 = scanner->ips6[nth];
+    match->block = scanner->blocks6[nth];
+  } else {
+    match->ip = scanner->ips[nth];
+    match->block = scanner->blocks[nth];
+  }
+}
+
+static char *ipskip_scalar(char *p, const char *end) {
+  while(p <= end && !IP_CANDIDATE(*p))
+    ++p;
+  
+  return p;
+}
+
+#ifdef IP_X86
+__attribute__((target("sse2")))
+static char *ipskip_sse2(char *p, const char *end) {
+  __m128i zero = _mm_set1_epi8('0');
+  __m128i range = _mm_set1_epi8(':' - '0');
+  
+  /* unaligned loads, and never past end: the line may be anywhere in memory */
+  for(; end + 1 - p >= 16; p += 16) {
+    __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) p), zero);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, range), v));
+    if(mask)
+      return p + __builtin_ctz(mask);
+  }
+  
+  return ipskip_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static char *ipskip_avx2(char *p, const char *end) {
+  __m256i zero = _mm256_set1_epi8('0');
+  __m256i range = _mm256_set1_epi8(':' - '0');
+  
+  for(; end + 1 - p >= 32; p += 32) {
+    __m256i v = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) p), zero);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, range), v));
+    if(mask)
+      return p + __builtin_ctz(mask);
+  }
+  
+  return ipskip_sse2(p, end);
+}
+#endif
+
+/* Doubles the capacity of every array in the scanner. */
+static void scanner_grow(IPScannerRef scanner) {
+  scanner->max *= 2;
+  scanner->ips = (ip_t *) xrealloc(scanner->ips, sizeof(ip_t) * scanner->max);
+  scanner->blocks = (int *) xrealloc(scanner->blocks, sizeof(int) * scanner->max);
+  scanner->ips6 = (ip6_t *) xrealloc(scanner->ips6, sizeof(ip6_t) * scanner->max);
+  scanner->blocks6 = (int *) xrealloc(scanner->blocks6, sizeof(int) * scanner->max);
+  scanner->families = (uint8_t *) xrealloc(scanner->families, scanner->max);
+}
+
+/* Parses a dotted quad at p for the last 32 bits of an IPv6 address. Returns a pointer
+ * just past it, or 0.
+ */
+static char *detectip6_quad(char *p, const char *end, ip_t *ip) {
+  int octet, digits, i;
+  
+  *ip = 0;
+  for(i = 0; i < 4; ++i) {
+    if(i > 0) {
+      if(p > end || *p != '.')
+        return 0;
+      ++p;
+    }
+    
+    for(octet = 0, digits = 0; p <= end && *p >= '0' && *p <= '9' && digits < 3; ++p, ++digits)
+      octet = octet * 10 + (*p - '0');
+    if(digits == 0 || octet > 255)
+      return 0;
+    
+    *ip = (*ip << 8) | octet;
+  }
+  
+  return p;
+}
+
+static char *detectip6(char *p, const char *end, ip6_t *ip, int *block) {
+  uint16_t groups[8];
+  int ngroups = 0;
+  int gap = -1; /* number of groups before the "::", if there is one */
+  int i;
+  
+  if(*p == ':') {
+    if(p + 1 > end || p[1] != ':')
+      return 0;
+    gap = 0;
+    p += 2;
+  }
+  
+  while(ngroups < 8) {
+    char *group = p;
+    unsigned value = 0;
+    int digit;
+    
+    while(p <= end && p - group < 5 && (digit = hexvalue[(unsigned char) *p]) >= 0) {
+      value = value * 16 + digit;
+      ++p;
+    }
+    
+    /* only possible right after a "::", which may end the address */
+    if(p == group)
+      break;
+    
+    if(p <= end && *p == '.') {
+      /* dotted-quad tail, as in ::ffff:192.0.2.1; a plain IPv4 address gets out here */
+      ip_t quad;
+      if(ngroups > 6 || (gap < 0 && ngroups < 6) || (p = detectip6_quad(group, end, &quad)) == 0)
+        return 0;
+      groups[ngroups++] = quad >> 16;
+      groups[ngroups++] = quad & 0xffff;
+      break;
+    }
+    
+    if(p - group > 4)
+      return 0;
+    groups[ngroups++] = value;
+    
+    if(p > end || *p != ':')
+      break;
+    
+    if(p + 1 <= end && p[1] == ':') {
+      if(gap >= 0)
+        return 0;
+      gap = ngroups;
+      p += 2;
+    } else {
+      if(ngroups == 8 || p + 1 > end || hexvalue[(unsigned char) p[1]] < 0)
+        return 0;
+      ++p;
+    }
+  }
+  
+  if(gap < 0 ? ngroups != 8 : ngroups > 7)
+    return 0;
+  
+  /* a bare "::" is far more likely to be punctuation than the unspecified address */
+  if(ngroups == 0 && (p > end || *p != '/'))
+    return 0;
+  
+  *block = 128;
+  if(p + 1 <= end && *p == '/' && p[1] >= '0' && p[1] <= '9') {
+    int digits;
+    ++p;
+    for(*block = 0, digits = 0; p <= end && *p >= '0' && *p <= '9' && digits < 3; ++p, ++digits)
+      *block = *block * 10 + (*p - '0');
+  }
+  
+  if(p <= end && (IP6_WORDCHAR(*p) || *p == ':'))
+    return 0;
+  
+  if(gap >= 0) {
+    int tail = ngroups - gap;
+    memmove(groups + 8 - tail, groups + gap, tail * sizeof(uint16_t));
+    memset(groups + gap, 0, (8 - ngroups) * sizeof(uint16_t));
+  }
+  
+  ip->hi = ip->lo = 0;
+  for(i = 0; i < 4; ++i) {
+    ip->hi = (ip->hi << 16) | groups[i];
+    ip->lo = (ip->lo << 16) | groups[i + 4];
+  }
+  
+  return p;
+}
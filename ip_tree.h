@@ -7,7 +7,9 @@
  *
  * NOTE: I have no idea what this code will do on a big-endian system. It might break.
  * NOTE: It is NOT safe to call these functions from multiple threads, even when
- * using separate instances of the data structure.
+ * using separate instances of the data structure. The exception is searching: once a tree
+ * is built, findip and findip_str_r only read it, so any number of threads may search it
+ * at the same time as long as each one uses its own IPScanner.
  */
 
 #include <stdlib.h>
@@ -23,17 +25,76 @@
 #define IP_ERROR_ADDRESS_INVALID -1000
 #define IP_ERROR_ADDRESS_INVALID_BAD_CIDR -1001
 #define IP_ERROR_ADDRESS_INVALID_BAD_IP -1002
+#define IP_ERROR_LABEL_MISSING -1003
 
 #define IP_NOT_FOUND -1100
 #define IP_POS_OUT_OF_BOUNDS -1101
 
+#define IP_ERROR_SET_IO -1200
+#define IP_ERROR_SET_FORMAT -1201
+#define IP_ERROR_SET_VERSION -1202
+
 typedef struct IPTree *IPTreeRef;
-typedef struct IPNode *IPNodeRef;
+typedef uint32_t IPNodeRef; /* index of a node in the tree's slabs */
+typedef struct IPScanner *IPScannerRef;
+typedef struct IPLoader *IPLoaderRef;
 typedef uint32_t ip_t;
+typedef struct { uint64_t hi, lo; } ip6_t; /* IPv6 address, hi holding the first 64 bits */
+
+#define IP_FAMILY_4 4
+#define IP_FAMILY_6 6
+
+/* Every address in a tree has a label, numbered from 0. Blocks added without one get
+ * IP_LABEL_ANY; named labels (see iptree_label) are numbered from IP_LABEL_FIRST.
+ */
+#define IP_LABEL_NONE 0 /* not in the tree */
+#define IP_LABEL_ANY 1 /* in the tree, without a name */
+#define IP_LABEL_FIRST 2
+
+/* An address found on a line by eachip_str. */
+typedef struct {
+  int family; /* IP_FAMILY_4 or IP_FAMILY_6 */
+  ip_t ip; /* the address, if family is IP_FAMILY_4 */
+  ip6_t ip6; /* the address, if family is IP_FAMILY_6 */
+  int block; /* the CIDR block; 32 (or 128) for a single IP */
+} IPFound;
+
+/* Called by eachip_str for every address; returning anything but 0 stops the scan. */
+typedef int (*ipfound_fn)(const IPFound *found, void *context);
 
 IPTreeRef makeiptree();
 
-/* Unless explictly stated otherwise, the expected IP notation is dotted decimal.*/
+/* Frees the tree and all of its nodes. */
+void iptree_free(IPTreeRef tree);
+
+/* Returns the number of the label called name (len bytes), numbering it if it is new. */
+int iptree_label(IPTreeRef tree, const char *name, size_t len);
+
+/* Returns the name of a label, or 0 if it has none (IP_LABEL_NONE and IP_LABEL_ANY). */
+const char *iptree_labelname(IPTreeRef tree, int label);
+
+/* Labels are numbered below this. */
+int iptree_labelcount(IPTreeRef tree);
+
+/* Compiles the tree (see iptree_compile) and writes it to path, replacing the file
+ * atomically. Returns 0 or IP_ERROR_SET_IO.
+ */
+int iptree_save(IPTreeRef tree, const char *path);
+
+/* Opens a file written by iptree_save. Nothing is parsed or built: the file is mapped
+ * read-only and searched in place, so opening takes the same short time whatever its
+ * size, and processes that open the same file share its pages. Adding to the tree
+ * copies it into memory first.
+ * The file is trusted beyond a check of its header and size; only open files that
+ * iptree_save wrote. Returns 0 and sets error to an IP_ERROR_SET_ code on failure.
+ */
+IPTreeRef iptree_map(const char *path, int *error);
+
+/* Unless explictly stated otherwise, the expected IP notation is dotted decimal for IPv4
+ * and RFC 4291 text (with "::" and an optional dotted-quad tail) for IPv6. The string
+ * functions handle both families; an IPv4-mapped IPv6 address (::ffff:a.b.c.d) is treated
+ * as the IPv4 address it maps.
+ */
 
 /* Find the first valid IP in the string and add it to the tree. Supports CIDR notation. */
 int addip_str(IPTreeRef tree, char *string, const char *end);
@@ -41,13 +102,160 @@ int addip_str(IPTreeRef tree, char *string, const char *end);
 /* Find the first valid IP in the string and check for its presence in the tree. Supports CIDR notation. */
 int findip_str(IPTreeRef tree, char *string, const char *end, int pos);
 
+/* Same as findip_str but keeps the addresses found on the line in the caller's scanner
+ * instead of a shared one, so it can be called from several threads. The line is only
+ * parsed as far as needed: up to the pos-th address, or the first one in the tree if pos is 0.
+ * A negative pos counts from the end of the line, which is then parsed from the end back.
+ */
+int findip_str_r(IPTreeRef tree, IPScannerRef scanner, char *string, const char *end, int pos);
+
+/* Same as findip_str_r, but returns the label of the address instead of 1 (or
+ * IP_LABEL_NONE instead of 0). If pos is 0 that is the first address on the line that is
+ * in the tree.
+ */
+int findlabel_str_r(IPTreeRef tree, IPScannerRef scanner, char *string, const char *end, int pos);
+
+/* Same as findlabel_str_r, and also sets match to the address the result is for: the one
+ * in the tree if there is one, otherwise (with pos) the pos-th address. match is left
+ * alone if there is no address to speak of.
+ */
+int findmatch_str_r(IPTreeRef tree, IPScannerRef scanner, char *string, const char *end, int pos, IPFound *match);
+
+/* Calls fn for every address in the string, in order, until it returns something other
+ * than 0; returns that, or 0 once the string is done. Like findip_str_r it only needs the
+ * caller's scanner, which doesn't allocate once it has been used a couple of times.
+ */
+int eachip_str(IPScannerRef scanner, char *string, const char *end, ipfound_fn fn, void *context);
+
+/* Scratch space used by findip_str_r. Grows as needed to hold all the IPs on a line. */
+IPScannerRef makeipscanner();
+void freeipscanner(IPScannerRef scanner);
+
+/* What a scanner has done so far, over every line. Reading the clock costs more than
+ * parsing a short line, so parsing is only timed while .timed is set; a caller that wants
+ * the time can set it for a sample of the lines.
+ */
+typedef struct {
+  uint64_t addresses; /* addresses parsed */
+  uint64_t parsens; /* nanoseconds spent parsing while .timed was set */
+  int timed;
+} IPScannerStats;
+
+IPScannerStats *ipscanner_stats(IPScannerRef scanner);
+
+/* Set to 0 before the first makeipscanner to parse without vector instructions, which
+ * gives the same results more slowly.
+ */
+extern int ip_simd_enabled;
+
 /* Add an IP to the tree. Second arg is CIDR block; pass 32 for single IP. */
 int addip(IPTreeRef tree, ip_t ip, int block);
  
 /* Return 1 if ip exists in the tree; otherwise return 0. */
 int findip(IPTreeRef tree, ip_t ip);
 
+/* Same as addip and findip for IPv6 addresses, which are kept in a tree of their own.
+ * Pass 128 as the block for a single IP.
+ */
+int addip6(IPTreeRef tree, ip6_t ip, int block);
+int findip6(IPTreeRef tree, ip6_t ip);
+
+/* Labeled sets. An address takes the label of the most specific block it was added in,
+ * which the tree gets right as long as shorter blocks are added first: addip_label gives
+ * every address of the block the label, whatever it had before (addip is the same with
+ * IP_LABEL_ANY). iptree_load adds the blocks in that order by itself.
+ * Adjacent blocks are only merged into one if they have the same label.
+ */
+int addip_label(IPTreeRef tree, ip_t ip, int block, int label);
+int addip6_label(IPTreeRef tree, ip6_t ip, int block, int label);
+
+/* Return the label of ip, or IP_LABEL_NONE if it isn't in the tree. */
+int findlabel(IPTreeRef tree, ip_t ip);
+int findlabel6(IPTreeRef tree, ip6_t ip);
+
+/* Return the CIDR block of the block ip is in, as dumptree prints them, and set ip to its
+ * first address. ip must be in the tree.
+ */
+int findblock(IPTreeRef tree, ip_t *ip);
+int findblock6(IPTreeRef tree, ip6_t *ip);
+
+/* Looks up n addresses at once, setting out[i] to findip(tree, ips[i]). The lookups are
+ * interleaved and prefetched so their cache misses overlap, which pays off once the tree
+ * or table no longer fits in cache. Returns the number of addresses found.
+ */
+int findip_batch(IPTreeRef tree, const ip_t *ips, int n, uint8_t *out);
+
+/* Converts the tree into a flat, read-only lookup table that findip (and everything built
+ * on it) uses from then on; most lookups take one or two memory accesses instead of a
+ * pointer chase per bit. The tree itself is kept for dumptree. Adding an IP afterwards
+ * throws the table away, so call this once the lists are loaded.
+ * Returns -1 (and keeps using the tree) if the table would be unreasonably large.
+ */
+int iptree_compile(IPTreeRef tree);
+
+/* Bulk loading. Adding a large list one address at a time walks the tree from the root for
+ * every entry; a loader instead just collects the address ranges, and iptree_load sorts
+ * them (radix sort), merges the ones that overlap or touch and builds the tree from the
+ * result bottom-up, creating every node exactly once.
+ * A loader may be filled from one thread at a time, but several threads may each fill
+ * their own and combine them with iploader_merge.
+ */
+IPLoaderRef makeiploader();
+void freeiploader(IPLoaderRef loader);
+
+/* Same as addip_str, but the address goes to the loader. */
+int iploader_add_str(IPLoaderRef loader, char *string, const char *end);
+
+/* Same as iploader_add_str, but the first word after the address (up to a space, tab, ','
+ * or ';') is the label of the block. Returns IP_ERROR_LABEL_MISSING if there is none.
+ */
+int iploader_add_label_str(IPLoaderRef loader, char *string, const char *end);
+
+/* Moves everything collected by from into loader. */
+void iploader_merge(IPLoaderRef loader, IPLoaderRef from);
+
+/* Adds everything collected by the loader to the tree and empties the loader. Blocks with
+ * labels get the label of the most specific one each address is in (the one collected
+ * last, for the same block twice), regardless of the order they were collected in. Either
+ * kind replaces whatever the tree had for its addresses before.
+ */
+void iptree_load(IPTreeRef tree, IPLoaderRef loader);
+
+/* Set algebra. Each of these turns tree into the result of combining it with other, a
+ * different tree that is left alone. The two are walked side by side, so the time taken
+ * depends on the size of the trees and not on how many blocks went into them.
+ * An address keeps the label it has in tree, except that iptree_union gives the ones
+ * in other the label they have there.
+ */
+void iptree_union(IPTreeRef tree, IPTreeRef other);
+void iptree_intersect(IPTreeRef tree, IPTreeRef other);
+void iptree_subtract(IPTreeRef tree, IPTreeRef other);
+
 int iptree_empty(IPTreeRef);
+
+/* Size and shape of a tree, as iptree_stats finds them by walking it. */
+typedef struct {
+  size_t nodes; /* nodes in use, IPv4 and IPv6 */
+  size_t blocks; /* leaves holding addresses: whole subtrees collapsed into FULL or a label */
+  size_t blocks6;
+  int depth; /* longest path from the root, in bits */
+  int depth6;
+  size_t tablelen; /* entries of the compiled table (0 if there is none) */
+  size_t memory; /* bytes taken by nodes, table and labels (or the mapped file) */
+} IPTreeStats;
+
+void iptree_stats(IPTreeRef tree, IPTreeStats *stats);
+
+/* Writes ip to buf as text, followed by "/block" unless block is negative, and returns
+ * the length. buf needs IP_STRLEN bytes.
+ */
+#define IP_STRLEN 48
+int ip_str(char *buf, ip_t ip, int block);
+int ip6_str(char *buf, ip6_t ip, int block);
+
+/* Prints every block in the tree, merged as far as possible, followed by its label if
+ * it has a name.
+ */
 void dumptree(IPTreeRef tree);
 
 #endif
@@ -1,22 +1,61 @@
+#define _GNU_SOURCE /* memmem */
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include "common.h"
 #include <string.h>
 #include "input.h"
+#include "output.h"
+#include "chunks.h"
+#include "follow.h"
+#include <signal.h>
+#include <pthread.h>
 #include "ip_tree.h"
+#include "ip_count.h"
 #include "list.h"
 
 static aio_buffer *buffer;
+static aio_output *output;
 static IPTreeRef iptree;
+static IPScannerRef scanner; /* used by the main thread; chunk workers have their own */
+static IPLoaderRef loader; /* collects the lists until they are loaded into iptree at once */
+static pthread_mutex_t loader_lock = PTHREAD_MUTEX_INITIALIZER; /* for merging into loader */
 
 static int once_warning_outofbounds = 1;
 
 static int verbose = 1; /* print some additional messages */
 static ListRef files = 0; /* files to load */
+static ListRef labelfiles = 0; /* labeled lists to load */
+static ListRef intersectfiles = 0; /* --intersect-list */
+static ListRef excludefiles = 0; /* --exclude-list */
 static ListRef ips = 0; /* inline ips to parse and load */
+static size_t bufsize = AIO_BASE_BUFSIZE; /* bytes per read() */
+static int threads = 1; /* threads scanning each regular file */
+static char *followpath = 0; /* file to follow instead of scanning FILEs */
+static char *statepath = 0; /* where --follow keeps its position */
+static char *savesetpath = 0; /* --save-set */
+static char *loadsetpath = 0; /* --load-set */
+static int annotate = 0; /* --annotate */
+static char *routeprefix = 0; /* --route */
+static aio_output **routes = 0; /* --route outputs by label, opened on first use */
+static int countby = -1; /* --count-by, as an IP_COUNT_ mode */
+static size_t counttop = 0; /* --top (0 = all) */
+static size_t countmax = 0; /* --count-max (0 = exact) */
+static IPCounterRef counter = 0; /* counts of the main thread, into which chunk workers merge theirs */
+static int distinctby = -1; /* --distinct-by, as an IP_COUNT_ mode */
+static int distinctprecision = 12; /* --distinct-precision */
+static ListRef sketchfiles = 0; /* --load-sketch */
+static char *savesketchpath = 0; /* --save-sketch */
+static IPDistinctRef distinct = 0; /* sketches of the main thread, like counter */
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER; /* for merging into counter, distinct and stats */
+static int showstats = 0; /* --stats */
+static volatile sig_atomic_t interrupted = 0;
 int search_ippos = 0;
 int search_invertmatch = 0;
+int search_field = 0; /* --field (0 = the whole line) */
+char search_delimiter = ' '; /* --delimiter */
+char *search_after = 0; /* --after */
+size_t search_afterlen = 0;
 
 typedef enum {
   DebugNone = 0,
@@ -25,46 +64,222 @@ typedef enum {
 
 static int debuglvl = (int) DebugNone;
 
-static void loadlist(void *arg) {
-  char *path = (char *)arg;
-  int res = 0;
-  
-  if((res = aio_buffer_open(buffer, path)) != 0) {
-    if(verbose)
-      fprintf(stderr, "Warning: could not open file %s, error code: %d.\n", path, res);
-    return;
-  }
+/* Long options without a short equivalent that take an argument. */
+typedef enum {
+  OptBufferSize = 0x100,
+  OptReadAhead,
+  OptDecompressThreads,
+  OptFollow,
+  OptStateFile,
+  OptSaveSet,
+  OptLoadSet,
+  OptNoSimd,
+  OptLabelList,
+  OptRoute,
+  OptIntersectList,
+  OptExcludeList,
+  OptCountBy,
+  OptTop,
+  OptCountMax,
+  OptDistinctBy,
+  OptDistinctPrecision,
+  OptSaveSketch,
+  OptLoadSketch,
+  OptField,
+  OptDelimiter,
+  OptAfter
+} LongOpt;
+
+#define STATS_SAMPLE 256 /* --stats times one line in this many through each phase */
+
+/* What a thread has scanned, for --stats. The counts are kept all the time, but reading
+ * the clock around every phase of every line would take longer than some of the phases,
+ * so with --stats they are only timed on every STATS_SAMPLE-th line. That gives the share
+ * of each one, by which the time spent scanning (which is timed as a whole) is split when
+ * printed.
+ */
+typedef struct {
+  uint64_t bytes; /* of the lines, EOLs included */
+  uint64_t lines;
+  uint64_t matched; /* lines whose address is in the tree, whether printed or not (-v) */
+  uint64_t addresses; /* parsed on the lines (see IPScannerStats) */
+  uint64_t sampled; /* lines timed */
+  uint64_t scanns; /* in scanlines, from start to end */
+  uint64_t readns; /* reading and splitting the sampled lines */
+  uint64_t matchns; /* parsing them and looking the addresses up */
+  uint64_t parsens; /* the parsing part of .matchns */
+  uint64_t outputns; /* writing or counting them */
+  uint64_t flushns; /* flushing the output, on every flush */
+} ScanStats;
+
+static ScanStats stats; /* of the main thread, into which chunk workers merge theirs */
+
+/* State of a thread scanning chunks of a file (see chunks.h). */
+typedef struct {
+  IPTreeRef tree;
+  IPScannerRef scanner;
+  IPCounterRef counter; /* 0 unless --count-by */
+  IPDistinctRef distinct; /* 0 unless --distinct-by */
+  ScanStats stats;
+} ScanState;
+
+static void print_ioerror(int res) {
+  if(res == AIO_ERROR_LINE_LONGER_THAN_BUFSIZE)
+    fprintf(stderr, "Error: a line is longer than the maximum buffer size of %d bytes.\n", AIO_MAX_BUFSIZE);
+  else if(res == AIO_ERROR_DECOMPRESS)
+    fprintf(stderr, "Error: compressed input is corrupt or truncated.\n");
+  else
+    fprintf(stderr, "IO Error code %d.\n", res);
+}
+
+/* Adds every line left in lines to the loader, warning about the ones that don't hold
+ * a valid IP (or label, if labeled). Returns the result of the aio_buffer_loadline call
+ * that ended the loop.
+ */
+static int loadlines(IPLoaderRef into, aio_buffer *lines, int labeled) {
+  int res;
   
-  while((res = aio_buffer_loadline(buffer)) == 0) {
-    res = addip_str(iptree, buffer->linestart, buffer->linelimit);
+  while((res = aio_buffer_loadline(lines)) == 0) {
+    if(labeled)
+      res = iploader_add_label_str(into, lines->linestart, lines->linelimit);
+    else
+      res = iploader_add_str(into, lines->linestart, lines->linelimit);
     
     if(verbose) {
       switch(res) {
         case IP_ERROR_ADDRESS_INVALID_BAD_IP:
-        fprintf(stderr, "Warning: The IP address on the line below is invalid.\n%.*s\n", (int) (buffer->linelimit - buffer->linestart), buffer->linestart);
+        fprintf(stderr, "Warning: The IP address on the line below is invalid.\n%.*s\n", (int) (lines->linelimit - lines->linestart), lines->linestart);
         break;
         case IP_ERROR_ADDRESS_INVALID_BAD_CIDR:
-        fprintf(stderr, "Warning: The CIDR block on the line below is invalid.\n%.*s\n", (int) (buffer->linelimit - buffer->linestart), buffer->linestart);
+        fprintf(stderr, "Warning: The CIDR block on the line below is invalid.\n%.*s\n", (int) (lines->linelimit - lines->linestart), lines->linestart);
         break;
         case IP_NOT_FOUND:
-        fprintf(stderr, "Warning: The line below does not contain an IP address.\n%.*s\n", (int) (buffer->linelimit - buffer->linestart), buffer->linestart);
+        fprintf(stderr, "Warning: The line below does not contain an IP address.\n%.*s\n", (int) (lines->linelimit - lines->linestart), lines->linestart);
+        break;
+        case IP_ERROR_LABEL_MISSING:
+        fprintf(stderr, "Warning: The line below has no label after the IP address.\n%.*s\n", (int) (lines->linelimit - lines->linestart), lines->linestart);
         break;
       }
     }
   }
   
+  return res;
+}
+
+/* Lists are parsed in chunks on several threads just like the files being scanned; each
+ * thread fills a loader of its own and hands it over at the end.
+ */
+static void *loadchunk_begin(void *context) {
+  return makeiploader();
+}
+
+static int loadchunk(aio_buffer *lines, aio_output *out, void *state) {
+  int res = loadlines((IPLoaderRef) state, lines, 0);
+  
+  return (res == AIO_ERROR_END_BUFFER ? 0 : res);
+}
+
+static void loadchunk_end(void *state) {
+  pthread_mutex_lock(&loader_lock);
+  iploader_merge(loader, (IPLoaderRef) state);
+  pthread_mutex_unlock(&loader_lock);
+  
+  freeiploader((IPLoaderRef) state);
+}
+
+/* Loads the list at path. A labeled list is read on one thread, since the label of a
+ * block listed twice is the one on the later line.
+ */
+static void loadfile(const char *path, int labeled) {
+  int res = 0;
+  int fd;
+  
+  if((fd = open(path, O_RDONLY)) == -1) {
+    if(verbose)
+      fprintf(stderr, "Warning: could not open file %s, error code: %d.\n", path, AIO_ERROR_IO_READ_ERROR);
+    return;
+  }
+  
+  if(threads > 1 && !labeled) {
+    res = aio_chunks_scan(fd, threads, loadchunk, loadchunk_begin, loadchunk_end, 0, output);
+    if(res != AIO_ERROR_CHUNKS_UNSUITABLE) {
+      close(fd);
+      if(res != 0) {
+        print_ioerror(res);
+        exit(res);
+      }
+      return;
+    }
+  }
+  
+  if((res = aio_buffer_map(buffer, fd)) != 0) {
+    if(verbose)
+      fprintf(stderr, "Warning: could not open file %s, error code: %d.\n", path, res);
+    return;
+  }
+  
+  res = loadlines(loader, buffer, labeled);
+  
   if(res != AIO_ERROR_END_BUFFER) {
-    fprintf(stderr, "IO Error code %d.\n", res);
+    print_ioerror(res);
     exit(res);
   } else {
     return;
   }
 }
 
+static void loadlist(void *arg) {
+  loadfile((char *)arg, 0);
+}
+
+static void loadlabellist(void *arg) {
+  loadfile((char *)arg, 1);
+}
+
+/* Loads the list at path into a tree of its own. */
+static IPTreeRef loadtree(const char *path) {
+  IPTreeRef tree = makeiptree();
+  
+  loader = makeiploader();
+  loadfile(path, 0);
+  iptree_load(tree, loader);
+  freeiploader(loader);
+  loader = 0;
+  
+  return tree;
+}
+
+static void intersectlist(void *arg) {
+  IPTreeRef other = loadtree((char *)arg);
+  iptree_intersect(iptree, other);
+  iptree_free(other);
+}
+
+static void excludelist(void *arg) {
+  IPTreeRef other = loadtree((char *)arg);
+  iptree_subtract(iptree, other);
+  iptree_free(other);
+}
+
+/* Merges the sketches saved in a file into distinct. */
+static void loadsketch(void *arg) {
+  char *path = (char *)arg;
+  int res = ipdistinct_load(distinct, iptree, path);
+  
+  if(res != 0) {
+    fprintf(stderr, "Error: could not load the sketches in %s (%s).\n", path,
+      (res == IP_ERROR_SET_VERSION ? "saved by an incompatible version"
+        : res == IP_ERROR_SET_FORMAT ? "not a sketch file"
+        : res == IP_ERROR_SKETCH_MODE ? "saved for another --distinct-by"
+        : res == IP_ERROR_SKETCH_PRECISION ? "saved with a lower --distinct-precision" : strerror(errno)));
+    exit(res);
+  }
+}
+
 static void loadip(void *arg) {
   char *ip = (char *)arg;
   unsigned int len = strlen(ip);
-  int res = addip_str(iptree, ip, (ip + len));
+  int res = iploader_add_str(loader, ip, (ip + len));
   
   if(verbose) {
     switch(res) {
@@ -81,40 +296,506 @@ static void loadip(void *arg) {
   }
 }
 
-static int work(IPTreeRef tree, int fd) {
-  int res = 0;
+/* Returns the --route output for lines with the label, creating the file the first time. */
+static aio_output *route(IPTreeRef tree, int label) {
+  if(!routes[label]) {
+    const char *name = iptree_labelname(tree, label);
+    char *path = xmalloc(strlen(routeprefix) + strlen(name) + 1);
+    strcpy(path, routeprefix);
+    strcat(path, name);
+    
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1) {
+      fprintf(stderr, "Error: could not open %s for writing (%s).\n", path, strerror(errno));
+      exit(AIO_ERROR_IO_WRITE_ERROR);
+    }
+    
+    free(path);
+    routes[label] = aio_output_alloc(fd);
+  }
   
-  if((res = aio_buffer_init(buffer, fd)) != 0)
-    return res;
+  return routes[label];
+}
+
+/* Flushes the --route outputs; like output, before the input file is closed. */
+static void flushroutes(IPTreeRef tree) {
+  int label;
   
-  while((res = aio_buffer_loadline(buffer)) == 0) {
-    res = findip_str(tree, buffer->linestart, buffer->linelimit, search_ippos);
+  for(label = IP_LABEL_FIRST; routes && label < iptree_labelcount(tree); ++label) {
+    if(routes[label])
+      aio_output_flush(routes[label]);
+  }
+}
+
+static void freeroutes(IPTreeRef tree) {
+  int label;
+  
+  for(label = IP_LABEL_FIRST; routes && label < iptree_labelcount(tree); ++label) {
+    if(routes[label]) {
+      int fd = routes[label]->fd;
+      aio_output_free(routes[label]);
+      close(fd);
+    }
+  }
+  
+  free(routes);
+  routes = 0;
+}
+
+/* Writes out a matched line whose address has the label, as --annotate and --route say. */
+static void writematch(IPTreeRef tree, aio_output *out, aio_buffer *lines, int label) {
+  if(routes && label >= IP_LABEL_FIRST)
+    out = route(tree, label);
+  
+  if(annotate) {
+    const char *name = iptree_labelname(tree, label);
+    if(!name)
+      name = "-";
+    aio_output_write(out, name, strlen(name));
+    aio_output_write(out, "\t", 1);
+  }
+  
+  aio_output_writeline(out, lines);
+}
+
+/* Sets key to what a match of the address (which has the label) is counted under in the
+ * IP_COUNT_ mode.
+ */
+static void matchkey(IPTreeRef tree, int mode, IPFound *match, int label, IPCountKey *key) {
+  key->ip.hi = 0;
+  key->family = match->family;
+  key->block = match->block;
+  
+  if(mode == IP_COUNT_LABEL) {
+    key->ip.lo = label;
+    key->family = 0;
+    key->block = 0;
+  } else if(match->family == IP_FAMILY_6) {
+    key->ip = match->ip6;
+    if(mode == IP_COUNT_BLOCK)
+      key->block = findblock6(tree, &key->ip);
+  } else {
+    ip_t ip = match->ip;
+    if(mode == IP_COUNT_BLOCK)
+      key->block = findblock(tree, &ip);
+    key->ip.lo = ip;
+  }
+}
+
+/* Counts a match as --count-by and --distinct-by say. */
+static void countmatch(IPTreeRef tree, IPCounterRef counter, IPDistinctRef distinct, IPFound *match, int label) {
+  IPCountKey key;
+  
+  if(counter) {
+    matchkey(tree, countby, match, label, &key);
+    ipcounter_add(counter, &key, 1);
+  }
+  
+  if(distinct) {
+    ip6_t ip = match->ip6;
+    if(match->family == IP_FAMILY_4) {
+      ip.hi = 0;
+      ip.lo = match->ip;
+    }
+    
+    matchkey(tree, distinctby, match, label, &key);
+    ipdistinct_add(distinct, &key, ip, match->family);
+  }
+}
+
+/* Prints the --count-by or --distinct-by summary (counts of keys of the IP_COUNT_ mode),
+ * highest count first, the way uniq -c would. If bounded, the counts may be too high
+ * (--count-max) and each one is followed by the least it can be.
+ */
+static void printcounts(IPTreeRef tree, int mode, IPCount *counts, size_t n, int bounded) {
+  char line[64 + IP_STRLEN];
+  size_t i;
+  
+  if(counttop && counttop < n)
+    n = counttop;
+  
+  for(i = 0; i < n; ++i) {
+    IPCountKey *key = &counts[i].key;
+    const char *name = 0;
+    int len = sprintf(line, "%7llu ", (unsigned long long) counts[i].count);
+    if(bounded)
+      len += sprintf(line + len, "%7llu ", (unsigned long long) (counts[i].count - counts[i].error));
+    
+    if(mode == IP_COUNT_LABEL) {
+      if(!(name = iptree_labelname(tree, (int) key->ip.lo)))
+        name = "-";
+    } else {
+      /* a single address is printed without its block */
+      int block = key->block;
+      if(mode == IP_COUNT_IP && block == (key->family == IP_FAMILY_6 ? 128 : 32))
+        block = -1;
+      
+      if(key->family == IP_FAMILY_6)
+        len += ip6_str(line + len, key->ip, block);
+      else
+        len += ip_str(line + len, (ip_t) key->ip.lo, block);
+      
+      if(mode == IP_COUNT_BLOCK) {
+        ip6_t ip = key->ip;
+        int label = (key->family == IP_FAMILY_6 ? findlabel6(tree, ip) : findlabel(tree, (ip_t) ip.lo));
+        name = iptree_labelname(tree, label);
+        if(name)
+          line[len++] = ' ';
+      }
+    }
+    
+    aio_output_write(output, line, len);
+    if(name)
+      aio_output_write(output, name, strlen(name));
+    aio_output_write(output, "\n", 1);
+  }
+  
+  aio_output_flush(output);
+}
+
+/* Narrows a line, from start to end (inclusive, at the EOL), down to the part --field and
+ * --after pick. Returns 0 if the line has no such part.
+ */
+static int selectfield(char **start, char **end) {
+  char *p = *start;
+  char *stop = *end;
+  int field;
+  
+  if(search_field) {
+    for(field = 1; field < search_field; ++field) {
+      if(!(p = memchr(p, search_delimiter, stop - p)))
+        return 0;
+      ++p;
+    }
+    
+    /* the delimiter after the field ends it like the EOL ends the line */
+    char *next = memchr(p, search_delimiter, stop - p);
+    if(next)
+      stop = next;
+  }
+  
+  if(search_after) {
+    if(!(p = memmem(p, stop - p, search_after, search_afterlen)))
+      return 0;
+    p += search_afterlen;
+  }
+  
+  *start = p;
+  *end = stop;
+  return 1;
+}
+
+/* Adds the counts of from, and those of the scanner it was collected with, to into. */
+static void addstats(ScanStats *into, ScanStats *from, IPScannerRef scanner) {
+  IPScannerStats *scanned = ipscanner_stats(scanner);
+  
+  into->bytes += from->bytes;
+  into->lines += from->lines;
+  into->matched += from->matched;
+  into->addresses += from->addresses + scanned->addresses;
+  into->sampled += from->sampled;
+  into->scanns += from->scanns;
+  into->readns += from->readns;
+  into->matchns += from->matchns;
+  into->parsens += from->parsens + scanned->parsens;
+  into->outputns += from->outputns;
+  into->flushns += from->flushns;
+}
+
+/* Flushes the output, timing it for --stats. */
+static void flushoutput(ScanStats *stats) {
+  uint64_t start = (showstats ? nanotime() : 0);
+  
+  aio_output_flush(output);
+  
+  if(start)
+    stats->flushns += nanotime() - start;
+}
+
+/* Matches every line left in lines against the tree and writes out the selected ones, or
+ * counts them if there is a counter or a set of sketches. Returns the result of the
+ * aio_buffer_loadline call that ended the loop.
+ */
+static int scanlines(IPTreeRef tree, IPScannerRef scanner, IPCounterRef counter, IPDistinctRef distinct, aio_buffer *lines, aio_output *out, ScanStats *stats) {
+  IPScannerStats *scanned = ipscanner_stats(scanner);
+  uint64_t begun = (showstats ? nanotime() : 0);
+  uint64_t sample = 0; /* when the line being timed was asked for, or 0 */
+  uint64_t loaded = 0, lookedup = 0; /* when the timed line was, for the phases after */
+  IPFound match;
+  char *start, *end;
+  int res;
+  
+  while((res = aio_buffer_loadline(lines)) == 0) {
+    if(sample) {
+      loaded = nanotime();
+      stats->readns += loaded - sample;
+      scanned->timed = 1;
+    }
+    
+    ++stats->lines;
+    stats->bytes += lines->linelimit - lines->linestart + 1;
+    start = lines->linestart;
+    end = lines->linelimit;
+    
+    if((search_field || search_after) && !selectfield(&start, &end))
+      res = IP_NOT_FOUND;
+    else if(counter || distinct)
+      res = findmatch_str_r(tree, scanner, start, end, search_ippos, &match);
+    else
+      res = findlabel_str_r(tree, scanner, start, end, search_ippos);
+    
+    if(sample) {
+      scanned->timed = 0;
+      lookedup = nanotime();
+      stats->matchns += lookedup - loaded;
+    }
     
     switch(res) {
-      case 1:
-      if(!search_invertmatch)
-        aio_buffer_writeline(buffer, STDOUT_FILENO);
+      case IP_NOT_FOUND:
       break;
       case IP_POS_OUT_OF_BOUNDS:
-      if(verbose && once_warning_outofbounds) {
+      if(verbose && __sync_lock_test_and_set(&once_warning_outofbounds, 0)) {
         fprintf(stderr,
           "Warning: IP position %d is out of bounds for at least some lines in the input stream.\n",
           search_ippos);
-        once_warning_outofbounds = 0;
       }
-      case 0:
+      case IP_LABEL_NONE:
       if(search_invertmatch)
-        aio_buffer_writeline(buffer, STDOUT_FILENO);
+        aio_output_writeline(out, lines);
+      break;
+      default:
+      ++stats->matched;
+      if(counter || distinct)
+        countmatch(tree, counter, distinct, &match, res);
+      else if(!search_invertmatch)
+        writematch(tree, out, lines, res);
     }
-      
+    
+    if(sample) {
+      stats->outputns += nanotime() - lookedup;
+      ++stats->sampled;
+      sample = 0;
+    }
+    
+    if(showstats && (stats->lines & (STATS_SAMPLE - 1)) == 0)
+      sample = nanotime();
   }
   
+  if(begun)
+    stats->scanns += nanotime() - begun;
+  
+  return res;
+}
+
+static void *scanchunk_begin(void *context) {
+  ScanState *state = xmalloc(sizeof(ScanState));
+  state->tree = (IPTreeRef) context;
+  state->scanner = makeipscanner();
+  state->counter = (counter ? makeipcounter(countmax) : 0);
+  state->distinct = (distinct ? makeipdistinct(distinctby, distinctprecision) : 0);
+  memset(&state->stats, 0, sizeof(ScanStats));
+  
+  return state;
+}
+
+static int scanchunk(aio_buffer *lines, aio_output *out, void *arg) {
+  ScanState *state = (ScanState *) arg;
+  int res = scanlines(state->tree, state->scanner, state->counter, state->distinct, lines, out, &state->stats);
+  
+  return (res == AIO_ERROR_END_BUFFER ? 0 : res);
+}
+
+static void scanchunk_end(void *arg) {
+  ScanState *state = (ScanState *) arg;
+  
+  if(state->counter) {
+    pthread_mutex_lock(&counter_lock);
+    ipcounter_merge(counter, state->counter);
+    pthread_mutex_unlock(&counter_lock);
+    freeipcounter(state->counter);
+  }
+  
+  if(state->distinct) {
+    pthread_mutex_lock(&counter_lock);
+    ipdistinct_merge(distinct, state->distinct);
+    pthread_mutex_unlock(&counter_lock);
+    freeipdistinct(state->distinct);
+  }
+  
+  pthread_mutex_lock(&counter_lock);
+  addstats(&stats, &state->stats, state->scanner);
+  pthread_mutex_unlock(&counter_lock);
+  
+  freeipscanner(state->scanner);
+  free(state);
+}
+
+/* Scans the file at path (or STDIN if path is 0) and prints out matched lines.
+ * Regular files are split between several threads if asked to.
+ */
+static int work(IPTreeRef tree, const char *path) {
+  int res = 0;
+  int fd = STDIN_FILENO;
+  
+  if(path && (fd = open(path, O_RDONLY)) == -1) {
+    res = AIO_ERROR_IO_READ_ERROR;
+    if(verbose)
+      fprintf(stderr, "Warning: could not open file %s, error code: %d.\n", path, res);
+    return res;
+  }
+  
+  /* chunks are put back in order into a single output, so --route scans on this thread */
+  if(path && threads > 1 && !routes) {
+    res = aio_chunks_scan(fd, threads, scanchunk, scanchunk_begin, scanchunk_end, tree, output);
+    if(res != AIO_ERROR_CHUNKS_UNSUITABLE) {
+      close(fd);
+      flushoutput(&stats);
+      if(res != 0)
+        print_ioerror(res);
+      return res;
+    }
+  }
+  
+  if(path)
+    res = aio_buffer_map(buffer, fd);
+  else
+    res = aio_buffer_init(buffer, fd);
+  
+  if(res != 0)
+    return res;
+  
+  res = scanlines(tree, scanner, counter, distinct, buffer, output, &stats);
+  
+  flushoutput(&stats);
+  flushroutes(tree);
+  
   if(res != AIO_ERROR_END_BUFFER)
-    fprintf(stderr, "IO Error code %d.\n", res);
+    print_ioerror(res);
+  
+  return res;
+}
+
+static void on_interrupt(int sig) {
+  interrupted = 1;
+}
+
+/* Keeps scanning lines appended to the file at path until interrupted. */
+static int follow(IPTreeRef tree, const char *path) {
+  struct sigaction sa;
+  int res = 0;
+  
+  /* no SA_RESTART: the wait for more data has to be interrupted */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_interrupt;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  
+  aio_follow *follower = aio_follow_open(path, buffer, statepath, &interrupted);
+  if(!follower) {
+    res = AIO_ERROR_IO_READ_ERROR;
+    if(verbose)
+      fprintf(stderr, "Warning: could not open file %s, error code: %d.\n", path, res);
+    return res;
+  }
+  
+  while(!interrupted && (res = aio_follow_wait(follower)) == 0) {
+    res = scanlines(tree, scanner, counter, distinct, buffer, output, &stats);
+    flushoutput(&stats);
+    flushroutes(tree);
+    
+    if(res != AIO_ERROR_END_BUFFER)
+      break;
+    
+    /* only once the output is out, so a restart never skips lines */
+    aio_follow_done(follower);
+    res = 0;
+  }
+  
+  aio_follow_free(follower);
+  
+  if(res != 0 && res != AIO_ERROR_FOLLOW_INTERRUPTED)
+    print_ioerror(res);
   
   return res;
 }
 
+/* Prints bytes as a size with a unit, the way dumpstats does. */
+static void printsize(const char *name, uint64_t bytes) {
+  const char units[5] = {' ', 'k', 'M', 'G', 'T'};
+  double size = bytes;
+  int unit = 0;
+  
+  while(size > 1024 && unit < 4) {
+    ++unit;
+    size /= 1024;
+  }
+  
+  fprintf(stderr, "\t%s: %.2lf %cB (%llu bytes)\n", name, size, units[unit], (unsigned long long) bytes);
+}
+
+/* Prints the time of a phase and its share of total, both in nanoseconds. */
+static void printphase(const char *name, double ns, double total) {
+  fprintf(stderr, "\t%s: %.3lf s (%.1lf%%)\n", name, ns / 1e9, (total > 0 ? 100 * ns / total : 0.0));
+}
+
+/* Prints the --stats report to STDERR: what was scanned, where the time went and what
+ * the tree looks like. loadns and scanns are the wall-clock time taken to load the lists
+ * and to scan the input.
+ */
+static void printstats(IPTreeRef tree, uint64_t loadns, uint64_t scanns) {
+  IPTreeStats treestats;
+  
+  /* the chunk workers' scanners are counted in already, not the main thread's */
+  stats.addresses += ipscanner_stats(scanner)->addresses;
+  stats.parsens += ipscanner_stats(scanner)->parsens;
+  iptree_stats(tree, &treestats);
+  
+  fprintf(stderr,
+    "Scan:\n"
+    "\tbytes read: %llu\n"
+    "\tlines read: %llu\n"
+    "\tlines matched: %llu\n"
+    "\tIPs extracted: %llu\n"
+    "\tloading the lists: %.3lf s\n"
+    "\tscanning: %.3lf s\n",
+    (unsigned long long) stats.bytes,
+    (unsigned long long) stats.lines,
+    (unsigned long long) stats.matched,
+    (unsigned long long) stats.addresses,
+    loadns / 1e9,
+    scanns / 1e9);
+  
+  if(stats.sampled) {
+    double scale = (double) stats.scanns / (stats.readns + stats.matchns + stats.outputns);
+    double readns = stats.readns * scale;
+    double parsens = stats.parsens * scale;
+    double lookupns = (stats.matchns > stats.parsens ? stats.matchns - stats.parsens : 0) * scale;
+    double outputns = stats.outputns * scale + stats.flushns;
+    double total = stats.scanns + stats.flushns;
+    
+    fprintf(stderr, "Time per phase (shares timed on 1 line in %d, summed over threads):\n", STATS_SAMPLE);
+    printphase("read and split", readns, total);
+    printphase("IP extraction", parsens, total);
+    printphase("tree lookup", lookupns, total);
+    printphase("output", outputns, total);
+  }
+  
+  fprintf(stderr,
+    "IPTree:\n"
+    "\tnode count: %zu\n"
+    "\tdepth: %d (IPv6: %d)\n"
+    "\tFULL blocks: %zu (IPv6: %zu)\n"
+    "\tcompiled table entries: %zu\n",
+    treestats.nodes,
+    treestats.depth,
+    treestats.depth6,
+    treestats.blocks,
+    treestats.blocks6,
+    treestats.tablelen);
+  printsize("total size", treestats.memory);
+}
+
 static void print_version() {
   printf(
     "ipscan %d.%d.%d\n\n",
@@ -126,35 +807,124 @@ static void print_version() {
 
 static void print_usage() {
   printf(
-    "Usage: ipscan [OPTION]...\n"
-    "Search for IP addresses or CIDR blocks in STDIN and print out matched lines.\n"
+    "Usage: ipscan [OPTION]... [FILE]...\n"
+    "Search for IP addresses or CIDR blocks in each FILE (or STDIN) and print out matched lines.\n"
+    "IPv4 and IPv6 addresses may be mixed freely, both in the lists and in the input.\n"
     "\nLoading IP lists:\n"
     "  -i, --ip-list FILE\t\tload newline-separated list of IP addresses (CIDR notation supported)\n"
     "  -I, --ip-search IP\t\tadd the IP to the list of IP addresses searched for (CIDR notation is supported)\n"
+    "  --label-list FILE\t\tload a list of IP addresses (CIDR notation supported) each followed by a label,\n"
+    "\t\t\t\te.g. \"10.0.0.0/8 internal\"; an IP gets the label of the most specific block it is in\n"
+    "  --intersect-list FILE\t\tonce the lists above are loaded, keep only the IP addresses that are also in FILE\n"
+    "  --exclude-list FILE\t\tonce the lists above are loaded, remove the IP addresses that are in FILE\n"
+    "  --load-set FILE\t\tstart from the IP set saved in FILE with --save-set (mapped, not parsed)\n"
+    "  --save-set FILE\t\tsave the loaded IP set to FILE for --load-set; exits unless FILEs to scan are given\n"
     "\nSearch options:\n"
     "  -v, --invert-match\t\tinstead of printing lines that match the IP list, print ones that don't\n"
     "  -p, --match-position IDX\tinstead of checking against the first IP on the line, check against the IDXth\n"
     "\t\t\t\tSupports negative IDX, counting from right instead from left.\n"
     "\t\t\t\t(-1 = last IP, 1 = first IP, 0 = any position; default: 0)\n"
+    "  --field N\t\t\tonly look for IPs in the Nth field of the line (counting from 1, like cut -f);\n"
+    "\t\t\t\t-p then counts within the field\n"
+    "  --delimiter CHAR\t\tfields are separated by CHAR (\\t for a tab; default: space)\n"
+    "  --after STRING\t\tonly look for IPs after the first STRING on the line (or in the --field),\n"
+    "\t\t\t\te.g. --after src=; lines without it have no IP\n"
     "\nOutput control:\n"
-    "  --dump-ips\t\t\tinstead of running the search dump the computed CIDR blocks to STDOUT\n"
+    "  --dump-ips\t\t\tinstead of running the search dump the computed CIDR blocks (and labels) to STDOUT\n"
+    "  --annotate\t\t\tprefix every matched line with the label of its IP and a tab (\"-\" if it has none)\n"
+    "  --route PREFIX\t\twrite matched lines to the file PREFIX followed by the label of their IP\n"
+    "\t\t\t\t(lines whose IP has no label still go to STDOUT)\n"
+    "  --count-by KEY\t\tinstead of the matched lines print how many there are per KEY, most first:\n"
+    "\t\t\t\tip (the matched IP), block (the CIDR block it is in, as --dump-ips prints them)\n"
+    "\t\t\t\tor label\n"
+    "  --top K\t\t\twith --count-by or --distinct-by, print only the K highest counts\n"
+    "  --count-max N\t\twith --count-by, keep at most N counters (per thread): memory stays fixed, but once\n"
+    "\t\t\t\tthey are in use a new key takes over the lowest one and inherits its count, so the\n"
+    "\t\t\t\tcounts may be too high (never too low); keys with more than 1/N of the matches are kept;\n"
+    "\t\t\t\teach count is then followed by the least it can be\n"
+    "  --distinct-by KEY\t\tinstead of the matched lines print the estimated number of distinct matched IPs\n"
+    "\t\t\t\tper KEY (block or label), most first, using fixed memory per KEY\n"
+    "  --distinct-precision P\tuse 2^P bytes per KEY for --distinct-by, for an error of about 104/sqrt(2^P)%%\n"
+    "\t\t\t\t(%d to %d; default: 12, about 1.6%%)\n"
+    "  --save-sketch FILE\t\talso save the --distinct-by sketches to FILE, for --load-sketch\n"
+    "  --load-sketch FILE\t\tmerge the sketches saved in FILE into --distinct-by; without FILEs to scan,\n"
+    "\t\t\t\tprint the merged estimates instead of reading STDIN\n"
     "  --verbose\t\t\tprint additional messages to STDERR (default)\n"
     "  --quiet\t\t\tdon't print messages to STDERR\n"
+    "\nFollowing:\n"
+    "  --follow FILE\t\t\tkeep scanning lines as they are appended to FILE, like tail -F\n"
+    "\t\t\t\t(rotation by rename or truncation is followed; stop with SIGINT or SIGTERM)\n"
+    "  --state-file PATH\t\tsave the --follow position in PATH and resume from it on restart\n"
+    "\nPerformance:\n"
+    "  --no-mmap\t\t\tread regular files with read() instead of memory-mapping them\n"
+    "  --buffer-size SIZE\t\tread SIZE bytes at a time (k and M suffixes supported; default: 32k)\n"
+    "\t\t\t\tThe buffer still grows as needed to hold lines longer than SIZE.\n"
+    "  --read-ahead N\t\tkeep N reads in flight on a separate thread while scanning\n"
+    "\t\t\t\t(applies to pipes, STDIN and --no-mmap; default: 0 = off)\n"
+    "  --no-zero-copy\t\talways copy matched lines (by default, long runs of matched lines\n"
+    "\t\t\t\tin a FILE are sent to a file or pipe with copy_file_range/splice)\n"
+    "  --no-decompress\t\tdon't decompress gzip and zstd input (detected by magic bytes)\n"
+    "  --no-simd\t\t\tsplit lines and look for IPs without SSE2/AVX2 (same output, slower)\n"
+    "  --decompress-threads N\tdecode BGZF and multi-frame zstd files on N threads\n"
+    "\t\t\t\t(default: number of CPUs)\n"
+    "  -j, --threads N\t\tscan each uncompressed regular FILE (and parse each -i list) on N threads (default: 1)\n"
+    "\t\t\t\tThe output is the same as with a single thread.\n"
     "\nMiscellaneous:\n"
     "  -V, --version\t\t\tprint version information and exit\n"
+    "  --stats\t\t\tat exit, print what was scanned, where the time went and the size of the\n"
+    "\t\t\t\tIP tree to STDERR\n"
     "  -h, --help\t\t\tprint this message and exit\n"
     "\nExamples:\n"
     "# Find all communication where neither source nor destination are in a private range:\n"
     "> cat /var/syslog/* | ipscan -v -I 10.0.0.0/8 -I 192.168.0.0/16 -I 172.16.0.0/12 -p 0\n"
+    "# Match the source address of firewall lines like \"... SRC=1.2.3.4 DST=5.6.7.8 ...\":\n"
+    "> ipscan -i blocked.txt --after SRC= -p 1 /var/log/kern.log\n"
     "# Find all communication originating from China:\n"
     "> cat /var/syslog/* | ipscan -i chinese_ranges.txt -p 0\n\n"
     "# Simplify a list of IP ranges:\n"
     "> ipscan -I 10.0.0.0/24 -I 10.0.1.0/24 --dump-ips\n"
     "\t# outputs: 10.0.0.0/23\n"
+    "# Find the addresses of a threat feed outside of our own ranges:\n"
+    "> ipscan -i feed.txt --exclude-list our_ranges.txt --dump-ips\n"
+    "# Split a log by the country of the client IP (country.txt has lines like \"1.0.0.0/24 AU\"):\n"
+    "> ipscan --label-list country.txt -p 1 --route by_country/ access.log\n"
+    "# The 10 client IPs from a threat feed seen most often:\n"
+    "> ipscan -i feed.txt -p 1 --count-by ip --top 10 access.log\n"
+    "# Distinct clients per range, a day at a time, then for the whole week:\n"
+    "> ipscan -i ranges.txt -p 1 --distinct-by block --save-sketch mon.hll access.log.mon\n"
+    "> ipscan -i ranges.txt --distinct-by block --load-sketch mon.hll --load-sketch tue.hll ...\n",
+    IP_DISTINCT_PRECISION_MIN, IP_DISTINCT_PRECISION_MAX
     );
   exit(0);
 }
 
+/* Parses a byte count with an optional k, M or G suffix. Returns 0 if the string is invalid. */
+static size_t parse_size(const char *arg) {
+  char *suffix;
+  unsigned long long size = strtoull(arg, &suffix, 10);
+  
+  if(suffix == arg)
+    return 0;
+  
+  switch(*suffix) {
+    case 'k': case 'K':
+    size <<= 10;
+    break;
+    case 'm': case 'M':
+    size <<= 20;
+    break;
+    case 'g': case 'G':
+    size <<= 30;
+    break;
+    case '\0':
+    break;
+    default:
+    return 0;
+  }
+  
+  return (size_t) size;
+}
+
 static inline void getopts(int argc, char **argv) {
   int c;
   while(1) {
@@ -168,11 +938,39 @@ static inline void getopts(int argc, char **argv) {
       {"version",         no_argument,        0,          'V'},
       {"help",            no_argument,        0,          'h'},
       {"dump-ips",        no_argument,        &debuglvl,  (int) DebugTree},
+      {"no-mmap",         no_argument,        &aio_mmap_enabled, 0},
+      {"no-decompress",   no_argument,        &aio_decompress_enabled, 0},
+      {"no-zero-copy",    no_argument,        &aio_output_zerocopy_enabled, 0},
+      {"no-simd",         no_argument,        0,          OptNoSimd},
+      {"stats",           no_argument,        &showstats, 1},
+      {"buffer-size",     required_argument,  0,          OptBufferSize},
+      {"read-ahead",      required_argument,  0,          OptReadAhead},
+      {"decompress-threads", required_argument, 0,        OptDecompressThreads},
+      {"threads",         required_argument,  0,          'j'},
+      {"follow",          required_argument,  0,          OptFollow},
+      {"state-file",      required_argument,  0,          OptStateFile},
+      {"save-set",        required_argument,  0,          OptSaveSet},
+      {"load-set",        required_argument,  0,          OptLoadSet},
+      {"label-list",      required_argument,  0,          OptLabelList},
+      {"annotate",        no_argument,        &annotate,  1},
+      {"route",           required_argument,  0,          OptRoute},
+      {"intersect-list",  required_argument,  0,          OptIntersectList},
+      {"exclude-list",    required_argument,  0,          OptExcludeList},
+      {"count-by",        required_argument,  0,          OptCountBy},
+      {"top",             required_argument,  0,          OptTop},
+      {"count-max",       required_argument,  0,          OptCountMax},
+      {"distinct-by",     required_argument,  0,          OptDistinctBy},
+      {"distinct-precision", required_argument, 0,        OptDistinctPrecision},
+      {"save-sketch",     required_argument,  0,          OptSaveSketch},
+      {"load-sketch",     required_argument,  0,          OptLoadSketch},
+      {"field",           required_argument,  0,          OptField},
+      {"delimiter",       required_argument,  0,          OptDelimiter},
+      {"after",           required_argument,  0,          OptAfter},
       {0,0,0,0}
     };
     
     int opt_index;
-    c = getopt_long(argc, argv, "i:I:p:hvV", long_options, &opt_index);
+    c = getopt_long(argc, argv, "i:I:j:p:hvV", long_options, &opt_index);
     if(c == -1)
       break;
     
@@ -182,11 +980,19 @@ static inline void getopts(int argc, char **argv) {
       case 'i':
       files = LIST_APPEND_CPY(files, optarg);
       break;
+      case 'j':
+      threads = atoi(optarg);
+      if(threads < 1) {
+        fprintf(stderr, "Invalid thread count %s.\n", optarg);
+        exit(-1);
+      }
+      break;
       case 'p':
       search_ippos = atoi(optarg);
       break;
       case 'v':
       search_invertmatch = 1;
+      break;
       case 'V':
       print_version();
       break;
@@ -196,6 +1002,120 @@ static inline void getopts(int argc, char **argv) {
       case 'h':
       print_usage();
       break;
+      case OptBufferSize:
+      bufsize = parse_size(optarg);
+      if(bufsize == 0 || bufsize > AIO_MAX_BUFSIZE) {
+        fprintf(stderr, "Invalid buffer size %s.\n", optarg);
+        exit(-1);
+      }
+      break;
+      case OptReadAhead:
+      aio_readahead = atoi(optarg);
+      break;
+      case OptDecompressThreads:
+      aio_decompress_threads = atoi(optarg);
+      break;
+      case OptFollow:
+      followpath = optarg;
+      break;
+      case OptStateFile:
+      statepath = optarg;
+      break;
+      case OptSaveSet:
+      savesetpath = optarg;
+      break;
+      case OptLoadSet:
+      if(loadsetpath) {
+        fprintf(stderr, "Only one --load-set can be given.\n");
+        exit(-1);
+      }
+      loadsetpath = optarg;
+      break;
+      case OptNoSimd:
+      aio_simd_enabled = 0;
+      ip_simd_enabled = 0;
+      break;
+      case OptLabelList:
+      labelfiles = LIST_APPEND_CPY(labelfiles, optarg);
+      break;
+      case OptRoute:
+      routeprefix = optarg;
+      break;
+      case OptIntersectList:
+      intersectfiles = LIST_APPEND_CPY(intersectfiles, optarg);
+      break;
+      case OptExcludeList:
+      excludefiles = LIST_APPEND_CPY(excludefiles, optarg);
+      break;
+      case OptCountBy:
+      if(strcmp(optarg, "ip") == 0)
+        countby = IP_COUNT_IP;
+      else if(strcmp(optarg, "block") == 0)
+        countby = IP_COUNT_BLOCK;
+      else if(strcmp(optarg, "label") == 0)
+        countby = IP_COUNT_LABEL;
+      else {
+        fprintf(stderr, "Invalid --count-by %s (expected ip, block or label).\n", optarg);
+        exit(-1);
+      }
+      break;
+      case OptDistinctBy:
+      if(strcmp(optarg, "block") == 0)
+        distinctby = IP_COUNT_BLOCK;
+      else if(strcmp(optarg, "label") == 0)
+        distinctby = IP_COUNT_LABEL;
+      else {
+        fprintf(stderr, "Invalid --distinct-by %s (expected block or label).\n", optarg);
+        exit(-1);
+      }
+      break;
+      case OptDistinctPrecision:
+      distinctprecision = atoi(optarg);
+      if(distinctprecision < IP_DISTINCT_PRECISION_MIN || distinctprecision > IP_DISTINCT_PRECISION_MAX) {
+        fprintf(stderr, "Invalid precision %s (expected %d to %d).\n", optarg,
+          IP_DISTINCT_PRECISION_MIN, IP_DISTINCT_PRECISION_MAX);
+        exit(-1);
+      }
+      break;
+      case OptSaveSketch:
+      savesketchpath = optarg;
+      break;
+      case OptLoadSketch:
+      sketchfiles = LIST_APPEND_CPY(sketchfiles, optarg);
+      break;
+      case OptField:
+      search_field = atoi(optarg);
+      if(search_field < 1) {
+        fprintf(stderr, "Invalid field %s (fields are counted from 1).\n", optarg);
+        exit(-1);
+      }
+      break;
+      case OptDelimiter:
+      if(strcmp(optarg, "\\t") == 0)
+        search_delimiter = '\t';
+      else if(strlen(optarg) == 1)
+        search_delimiter = optarg[0];
+      else {
+        fprintf(stderr, "Invalid delimiter %s (expected a single character).\n", optarg);
+        exit(-1);
+      }
+      break;
+      case OptAfter:
+      search_after = optarg;
+      search_afterlen = strlen(optarg);
+      if(search_afterlen == 0)
+        search_after = 0;
+      break;
+      case OptTop:
+      counttop = (size_t) strtoull(optarg, 0, 10);
+      break;
+      case OptCountMax:
+      countmax = (size_t) strtoull(optarg, 0, 10);
+      if(countmax == 0 || countmax > UINT32_MAX / 2) {
+        fprintf(stderr, "Invalid counter limit %s.\n", optarg);
+        exit(-1);
+      }
+      break;
       default:
       print_usage();
     }
@@ -203,29 +1123,148 @@ static inline void getopts(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
+  uint64_t started = nanotime();
+  uint64_t loaded;
+  size_t n;
+  
   if(argc == 1)
     print_usage();
   /* Initialize the global instances of IP tree and buffer */
   iptree = makeiptree();
-  buffer = aio_buffer_alloc();
+  aio_decompress_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
   
   getopts(argc, argv);
   
+  /* only now, as the options say whether it may use vector instructions */
+  scanner = makeipscanner();
+  
+  buffer = aio_buffer_alloc_size(bufsize);
+  output = aio_output_alloc(STDOUT_FILENO);
+  
+  if(loadsetpath) {
+    int res;
+    iptree_free(iptree);
+    if(!(iptree = iptree_map(loadsetpath, &res))) {
+      fprintf(stderr, "Error: could not load the IP set %s (%s).\n", loadsetpath,
+        (res == IP_ERROR_SET_VERSION ? "saved by an incompatible version"
+          : res == IP_ERROR_SET_FORMAT ? "not an IP set file" : strerror(errno)));
+      exit(res);
+    }
+  }
+  
+  if(search_invertmatch && (annotate || routeprefix)) {
+    fprintf(stderr, "--annotate and --route can't be used with -v.\n");
+    exit(-1);
+  }
+  
+  if((countby < 0 && countmax) || (countby < 0 && distinctby < 0 && counttop)) {
+    fprintf(stderr, "--top only applies to --count-by and --distinct-by, --count-max to --count-by.\n");
+    exit(-1);
+  }
+  
+  if(distinctby < 0 && (sketchfiles || savesketchpath)) {
+    fprintf(stderr, "--save-sketch and --load-sketch only apply to --distinct-by.\n");
+    exit(-1);
+  }
+  
+  if(countby >= 0 && distinctby >= 0) {
+    fprintf(stderr, "--count-by and --distinct-by can't be used together.\n");
+    exit(-1);
+  }
+  
+  if((countby >= 0 || distinctby >= 0) && (search_invertmatch || annotate || routeprefix)) {
+    fprintf(stderr, "--count-by and --distinct-by can't be used with -v, --annotate or --route.\n");
+    exit(-1);
+  }
+  
+  /* only merging saved sketches: there is nothing to scan */
+  int mergeonly = (sketchfiles && optind == argc && !followpath);
+  
+  loader = makeiploader();
   list_each(files, &loadlist);
   list_free(files); files = 0;
+  list_each(labelfiles, &loadlabellist);
+  list_free(labelfiles); labelfiles = 0;
   list_each(ips, &loadip);
   list_free(ips); ips = 0;
+  iptree_load(iptree, loader);
+  freeiploader(loader);
   
-  if(iptree_empty(iptree) && verbose)
+  if(iptree_empty(iptree) && verbose && !mergeonly)
     fprintf(stderr, "Warning: no IP blocks have been loaded.\n");
   
+  list_each(intersectfiles, &intersectlist);
+  list_free(intersectfiles); intersectfiles = 0;
+  list_each(excludefiles, &excludelist);
+  list_free(excludefiles); excludefiles = 0;
+  
   switch(debuglvl) {
     case DebugTree:
     dumptree(iptree);
     exit(0);
   }
   
-  work(iptree, STDIN_FILENO);
+  iptree_compile(iptree);
+  
+  if(savesetpath) {
+    if(iptree_save(iptree, savesetpath) != 0) {
+      fprintf(stderr, "Error: could not save the IP set to %s (%s).\n", savesetpath, strerror(errno));
+      exit(IP_ERROR_SET_IO);
+    }
+    
+    if(optind == argc && !followpath)
+      exit(0);
+  }
+  
+  if(routeprefix) {
+    routes = xmalloc(sizeof(aio_output *) * iptree_labelcount(iptree));
+    memset(routes, 0, sizeof(aio_output *) * iptree_labelcount(iptree));
+  }
+  
+  if(countby >= 0)
+    counter = makeipcounter(countmax);
+  
+  if(distinctby >= 0) {
+    distinct = makeipdistinct(distinctby, distinctprecision);
+    list_each(sketchfiles, &loadsketch);
+    list_free(sketchfiles); sketchfiles = 0;
+  }
+  
+  loaded = nanotime();
+  
+  if(mergeonly) {
+    /* nothing to scan */
+  } else if(followpath) {
+    follow(iptree, followpath);
+  } else if(optind < argc) {
+    for(; optind < argc; ++optind)
+      work(iptree, argv[optind]);
+  } else {
+    work(iptree, 0);
+  }
+  
+  if(counter) {
+    IPCount *counts = ipcounter_sort(counter, &n);
+    printcounts(iptree, countby, counts, n, countmax != 0);
+    freeipcounter(counter);
+  }
+  
+  if(distinct) {
+    if(savesketchpath && ipdistinct_save(distinct, iptree, savesketchpath) != 0) {
+      fprintf(stderr, "Error: could not save the sketches to %s (%s).\n", savesketchpath, strerror(errno));
+      exit(IP_ERROR_SET_IO);
+    }
+    
+    IPCount *counts = ipdistinct_sort(distinct, &n);
+    printcounts(iptree, distinctby, counts, n, 0);
+    freeipdistinct(distinct);
+  }
+  
+  if(showstats)
+    printstats(iptree, loaded - started, nanotime() - loaded);
+  
+  aio_output_free(output);
+  freeroutes(iptree);
   
   return 0;
 }
@@ -30,8 +30,8 @@ static inline ListRef list_make(void *value) {
 
 static inline ListRef list_make_cpy(char *value) {
   unsigned long len = strlen(value);
-  char *cpy = (char *) xmalloc(len);
-  strncpy(cpy, value, len);
+  char *cpy = (char *) xmalloc(len + 1);
+  memcpy(cpy, value, len + 1);
   
   ListRef list = list_make((void *) cpy);
   list->free_value = 1;
@@ -53,8 +53,8 @@ static inline ListRef list_append(ListRef list, void *value) {
 
 static inline ListRef list_append_cpy(ListRef list, const char *value) {
   unsigned long len = strlen(value);
-  char *cpy = (char *) xmalloc(len);
-  strncpy(cpy, value, len);
+  char *cpy = (char *) xmalloc(len + 1);
+  memcpy(cpy, value, len + 1);
   
   list = list_append(list, (void *) cpy);
   list->free_value = 1;
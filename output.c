@@ -0,0 +1,253 @@
+#define _GNU_SOURCE /* copy_file_range, splice */
+#include "output.h"
+#include "common.h"
+#include <sys/stat.h>
+
+/* Globals */
+int aio_output_zerocopy_enabled = 1;
+
+/* Private declarations */
+
+static int aio_output_writeall(int fd, const char *bytes, size_t length);
+static int aio_output_append(aio_output *output, const char *bytes, size_t length, int inrun);
+static int aio_output_drain(aio_output *output);
+static int aio_output_endrun(aio_output *output);
+static int aio_output_copyrange(aio_output *output);
+static int aio_output_zerocopy(int fd);
+
+/* API */
+
+aio_output *aio_output_alloc(int fd) {
+  size_t pagesize = (aio_pagesize ? aio_pagesize : (size_t) getpagesize());
+  
+  aio_output *output = xmalloc(sizeof(aio_output));
+  output->size = (fd == AIO_OUTPUT_MEMORY ? AIO_OUTPUT_MEMSIZE : AIO_OUTPUT_BUFSIZE);
+  output->data = xmemalign(pagesize, output->size);
+  output->used = 0;
+  output->fd = fd;
+  output->zerocopy = aio_output_zerocopy(fd);
+  output->runfd = -1;
+  
+  return output;
+}
+
+void aio_output_free(aio_output *output) {
+  aio_output_flush(output);
+  
+  free(output->data);
+  free(output);
+}
+
+int aio_output_write(aio_output *output, const char *bytes, size_t length) {
+  int res;
+  
+  if((res = aio_output_endrun(output)) != 0)
+    return res;
+  
+  return aio_output_append(output, bytes, length, 0);
+}
+
+int aio_output_writeline(aio_output *output, aio_buffer *buffer) {
+  size_t length = buffer->linelimit - buffer->linestart;
+  off_t offset = -1;
+  int res;
+  
+  /* file offset of the line, if it could be part of a zero-copy run */
+  if(output->zerocopy != AIO_ZEROCOPY_NONE && buffer->mode == AIO_MODE_MMAP && aio_eol == '\n')
+    offset = buffer->mapoffset + (buffer->linestart - buffer->map);
+  
+  if(offset < 0 || buffer->fd != output->runfd || offset != output->runend) {
+    /* not adjacent to the previous line; start a new run */
+    if((res = aio_output_endrun(output)) != 0)
+      return res;
+    
+    if(offset >= 0) {
+      output->runfd = buffer->fd;
+      output->runstart = offset;
+      output->runend = offset;
+      output->runcopied = 1;
+    }
+  } else if(!output->runcopied) {
+    output->runend += length + 1;
+    return 0;
+  } else if(output->runend - output->runstart + length + 1 >= AIO_OUTPUT_ZEROCOPY_MIN) {
+    /* The run is long enough; take back what was copied and send it with the rest. */
+    output->used -= output->runend - output->runstart;
+    output->runend += length + 1;
+    output->runcopied = 0;
+    return 0;
+  }
+  
+  int inrun = (output->runfd != -1);
+  
+  /* fast path: the line and its newline both fit */
+  if(output->used + length < output->size) {
+    memcpy(output->data + output->used, buffer->linestart, length);
+    output->used += length;
+    output->data[output->used++] = '\n';
+    if(inrun)
+      output->runend += length + 1;
+    return 0;
+  }
+  
+  if((res = aio_output_append(output, buffer->linestart, length, inrun)) != 0)
+    return res;
+  
+  return aio_output_append(output, "\n", 1, inrun);
+}
+
+int aio_output_flush(aio_output *output) {
+  int res;
+  
+  if((res = aio_output_endrun(output)) != 0)
+    return res;
+  
+  return aio_output_drain(output);
+}
+
+/* Private implementations */
+
+static int aio_output_writeall(int fd, const char *bytes, size_t length) {
+  ssize_t written;
+  
+  while(length) {
+    if((written = write(fd, bytes, length)) < 0) {
+      if(errno == EINTR)
+        continue;
+      return AIO_ERROR_IO_WRITE_ERROR;
+    }
+    
+    bytes += written;
+    length -= written;
+  }
+  
+  return 0;
+}
+
+/* Copies bytes to the end of the buffer, writing out what is there first if they don't fit.
+ * Writes that are larger than the whole buffer bypass it. inrun is set if the bytes belong
+ * to the current run, whose copied part has to keep matching the tail of the buffer.
+ */
+static int aio_output_append(aio_output *output, const char *bytes, size_t length, int inrun) {
+  int res;
+  
+  if(output->used + length > output->size && output->fd == AIO_OUTPUT_MEMORY) {
+    while(output->used + length > output->size)
+      output->size *= 2;
+    output->data = xrealloc(output->data, output->size);
+  } else if(output->used + length > output->size) {
+    if((res = aio_output_drain(output)) != 0)
+      return res;
+    
+    if(length > output->size) {
+      if(inrun) {
+        output->runstart += length;
+        output->runend += length;
+      }
+      return aio_output_writeall(output->fd, bytes, length);
+    }
+  }
+  
+  memcpy(output->data + output->used, bytes, length);
+  output->used += length;
+  if(inrun)
+    output->runend += length;
+  
+  return 0;
+}
+
+/* Writes out the buffer. The copied part of the run goes with it. */
+static int aio_output_drain(aio_output *output) {
+  int res = 0;
+  
+  if(output->fd == AIO_OUTPUT_MEMORY)
+    return 0;
+  
+  if(output->used)
+    res = aio_output_writeall(output->fd, output->data, output->used);
+  
+  output->used = 0;
+  if(output->runfd != -1 && output->runcopied)
+    output->runstart = output->runend;
+  
+  return res;
+}
+
+/* Finishes the current run: a run that is still in the file is written out after the
+ * buffer, a copied one is simply left in the buffer.
+ */
+static int aio_output_endrun(aio_output *output) {
+  int res = 0;
+  
+  if(output->runfd == -1)
+    return 0;
+  
+  if(!output->runcopied) {
+    if((res = aio_output_drain(output)) == 0)
+      res = aio_output_copyrange(output);
+  }
+  
+  output->runfd = -1;
+  return res;
+}
+
+/* Sends the run from the input file straight to the output. If the kernel refuses (older
+ * kernels, file systems without support, an O_APPEND output...) zero-copy is turned off
+ * and the run is read back into the buffer instead.
+ */
+static int aio_output_copyrange(aio_output *output) {
+  off_t offset = output->runstart;
+  size_t length = output->runend - output->runstart;
+  ssize_t copied;
+  int res;
+  
+  while(length && output->zerocopy != AIO_ZEROCOPY_NONE) {
+    if(output->zerocopy == AIO_ZEROCOPY_COPY_FILE_RANGE)
+      copied = copy_file_range(output->runfd, &offset, output->fd, 0, length, 0);
+    else
+      copied = splice(output->runfd, &offset, output->fd, 0, length, SPLICE_F_MORE);
+    
+    if(copied < 0 && errno == EINTR)
+      continue;
+    if(copied <= 0) {
+      output->zerocopy = AIO_ZEROCOPY_NONE;
+      break;
+    }
+    
+    length -= copied;
+  }
+  
+  while(length) {
+    size_t chunk = (length < output->size ? length : output->size);
+    
+    while((copied = pread(output->runfd, output->data, chunk, offset)) < 0 && errno == EINTR)
+      continue;
+    if(copied <= 0)
+      return AIO_ERROR_IO_READ_ERROR;
+    
+    if((res = aio_output_writeall(output->fd, output->data, copied)) != 0)
+      return res;
+    
+    offset += copied;
+    length -= copied;
+  }
+  
+  return 0;
+}
+
+/* Picks the way runs can be sent to fd without a copy, if any. */
+static int aio_output_zerocopy(int fd) {
+  struct stat st;
+  
+  if(!aio_output_zerocopy_enabled || fd == AIO_OUTPUT_MEMORY || fstat(fd, &st) != 0)
+    return AIO_ZEROCOPY_NONE;
+  
+  if(S_ISFIFO(st.st_mode))
+    return AIO_ZEROCOPY_SPLICE;
+  
+  /* copy_file_range writes at the file position, which O_APPEND doesn't allow */
+  if(S_ISREG(st.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND))
+    return AIO_ZEROCOPY_COPY_FILE_RANGE;
+  
+  return AIO_ZEROCOPY_NONE;
+}
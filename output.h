@@ -0,0 +1,75 @@
+/* Buffered output for line-oriented tools. Matched lines are copied into a large,
+ * page-aligned buffer and written out in big chunks instead of with one or two
+ * write() calls per line.
+ *
+ * Because lines are copied, it is safe to keep appending lines from an aio_buffer
+ * across calls to aio_buffer_fill, which overwrites (or unmaps) the input data.
+ *
+ * Lines from a memory-mapped file (AIO_MODE_MMAP) that follow each other in the file are
+ * coalesced into a run. Once a run grows past AIO_OUTPUT_ZEROCOPY_MIN bytes it is no longer
+ * copied: the file range is handed to the kernel with copy_file_range (when the output
+ * is a regular file) or splice (when it is a pipe), so the data never passes through
+ * user space. Shorter runs are cheaper to copy and stay in the buffer.
+ */
+
+#include "input.h"
+
+#ifndef AIO_OUTPUT
+#define AIO_OUTPUT
+
+#define AIO_OUTPUT_BUFSIZE (1 << 20)
+#define AIO_OUTPUT_MEMSIZE (1 << 16) /* initial size of an in-memory buffer */
+
+/* Pass as the descriptor to collect output in memory. The buffer grows instead of
+ * being written out, and aio_output_flush leaves the data in place.
+ */
+#define AIO_OUTPUT_MEMORY (-1)
+
+#define AIO_OUTPUT_ZEROCOPY_MIN (1 << 16)
+
+#define AIO_ZEROCOPY_NONE 0
+#define AIO_ZEROCOPY_COPY_FILE_RANGE 1
+#define AIO_ZEROCOPY_SPLICE 2
+
+extern int aio_output_zerocopy_enabled; /* set to 0 to always copy lines into the buffer */
+
+#define AIO_ERROR_IO_WRITE_ERROR (-7102)
+
+typedef struct {
+  char *data; /* page-aligned buffer */
+  size_t size; /* allocated size of .data */
+  size_t used; /* bytes waiting to be written */
+  
+  int fd; /* output descriptor for write calls */
+  int zerocopy; /* AIO_ZEROCOPY_ method that works for fd */
+  
+  /* The run of consecutive lines written last. Bytes from runstart to runend are either
+   * the tail of .data (runcopied) or still only in the input file.
+   */
+  int runfd; /* input descriptor of the run (-1 if there is none) */
+  off_t runstart; /* file offset of the first byte of the run not written out yet */
+  off_t runend; /* file offset just past the run's last newline */
+  int runcopied;
+} aio_output;
+
+/* Allocates a new output buffer writing to fd. */
+aio_output *aio_output_alloc(int fd);
+
+/* Flushes any pending data and frees the buffer. Does not close fd. */
+void aio_output_free(aio_output *output);
+
+/* Appends length bytes to the buffer, flushing it first if there isn't enough room.
+ * Writes that are larger than the whole buffer bypass it.
+ */
+int aio_output_write(aio_output *output, const char *bytes, size_t length);
+
+/* Appends the current line of the input buffer followed by a newline.
+ * A run of lines from a mapped file is read from its descriptor when it is written out,
+ * so aio_output_flush must be called before that descriptor is closed or reused.
+ */
+int aio_output_writeline(aio_output *output, aio_buffer *buffer);
+
+/* Writes out everything that has been buffered so far and ends the current run. */
+int aio_output_flush(aio_output *output);
+
+#endif
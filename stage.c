@@ -0,0 +1,184 @@
+#include "stage.h"
+#include "input.h"
+#include "common.h"
+
+/* Private declarations */
+
+static void *aio_stage_run(void *arg);
+static void aio_stage_read(aio_stage *stage, void *context);
+
+/* API */
+
+aio_stage *aio_stage_start(int depth, size_t capacity, size_t headroom,
+  aio_stage_fn producer, void *context, aio_stage_freefn freecontext) {
+  int i;
+  
+  if(depth < AIO_STAGE_MIN_DEPTH)
+    depth = AIO_STAGE_MIN_DEPTH;
+  
+  /* Keep both ends of the payload on 64-byte boundaries for the newline scanner. */
+  headroom = (headroom + 63) & ~((size_t) 63);
+  capacity = (capacity + 63) & ~((size_t) 63);
+  
+  aio_stage *stage = xmalloc(sizeof(aio_stage));
+  stage->slots = xmalloc(sizeof(aio_slot) * depth);
+  stage->depth = depth;
+  
+  for(i = 0; i < depth; ++i) {
+    aio_slot *slot = &stage->slots[i];
+    slot->data = xmemalign(64, headroom + capacity + 64);
+    slot->start = slot->data + headroom;
+    slot->headroom = headroom;
+    slot->capacity = capacity;
+    slot->length = 0;
+    slot->status = 0;
+    slot->ready = 0;
+    slot->seq = 0;
+  }
+  
+  stage->head = 0;
+  stage->taken = 0;
+  stage->tail = 0;
+  stage->stopping = 0;
+  stage->producer = producer;
+  stage->freecontext = freecontext;
+  stage->context = context;
+  
+  pthread_mutex_init(&stage->lock, 0);
+  pthread_cond_init(&stage->cond, 0);
+  
+  if(pthread_create(&stage->thread, 0, aio_stage_run, stage) != 0) {
+    fprintf(stderr, "aio_stage: could not start a thread\n");
+    exit(-2);
+  }
+  
+  return stage;
+}
+
+void aio_stage_free(aio_stage *stage) {
+  int i;
+  
+  pthread_mutex_lock(&stage->lock);
+  stage->stopping = 1;
+  pthread_cond_broadcast(&stage->cond);
+  pthread_mutex_unlock(&stage->lock);
+  
+  pthread_join(stage->thread, 0);
+  
+  pthread_mutex_destroy(&stage->lock);
+  pthread_cond_destroy(&stage->cond);
+  
+  for(i = 0; i < stage->depth; ++i)
+    free(stage->slots[i].data);
+  
+  free(stage->slots);
+  free(stage);
+}
+
+aio_slot *aio_stage_reserve(aio_stage *stage) {
+  aio_slot *slot = 0;
+  
+  pthread_mutex_lock(&stage->lock);
+  while(!stage->stopping && stage->tail - stage->head >= (unsigned long) stage->depth)
+    pthread_cond_wait(&stage->cond, &stage->lock);
+  
+  if(!stage->stopping) {
+    slot = &stage->slots[stage->tail % stage->depth];
+    slot->seq = stage->tail;
+    slot->length = 0;
+    slot->status = 0;
+    ++stage->tail;
+  }
+  pthread_mutex_unlock(&stage->lock);
+  
+  return slot;
+}
+
+void aio_stage_commit(aio_stage *stage, aio_slot *slot) {
+  pthread_mutex_lock(&stage->lock);
+  slot->ready = 1;
+  pthread_cond_broadcast(&stage->cond);
+  pthread_mutex_unlock(&stage->lock);
+}
+
+void aio_slot_grow(aio_slot *slot, size_t capacity) {
+  if(capacity <= slot->capacity)
+    return;
+  
+  capacity = (capacity + 63) & ~((size_t) 63);
+  char *data = xmemalign(64, slot->headroom + capacity + 64);
+  memcpy(data + slot->headroom, slot->start, slot->length);
+  free(slot->data);
+  
+  slot->data = data;
+  slot->start = data + slot->headroom;
+  slot->capacity = capacity;
+}
+
+aio_slot *aio_stage_next(aio_stage *stage) {
+  pthread_mutex_lock(&stage->lock);
+  
+  aio_slot *slot = &stage->slots[(stage->head + stage->taken) % stage->depth];
+  while(!slot->ready)
+    pthread_cond_wait(&stage->cond, &stage->lock);
+  
+  if(slot->status == 0)
+    ++stage->taken;
+  
+  pthread_mutex_unlock(&stage->lock);
+  
+  return slot;
+}
+
+void aio_stage_release(aio_stage *stage) {
+  pthread_mutex_lock(&stage->lock);
+  assert(stage->taken > 0);
+  
+  stage->slots[stage->head % stage->depth].ready = 0;
+  ++stage->head;
+  --stage->taken;
+  
+  pthread_cond_broadcast(&stage->cond);
+  pthread_mutex_unlock(&stage->lock);
+}
+
+aio_stage *aio_stage_reader(int fd, int depth, size_t bufsize, size_t headroom) {
+  int *context = xmalloc(sizeof(int));
+  *context = fd;
+  
+  return aio_stage_start(depth, bufsize, headroom, aio_stage_read, context, free);
+}
+
+/* Private implementations */
+
+static void *aio_stage_run(void *arg) {
+  aio_stage *stage = (aio_stage *) arg;
+  
+  stage->producer(stage, stage->context);
+  if(stage->freecontext)
+    stage->freecontext(stage->context);
+  
+  return 0;
+}
+
+/* The read-ahead producer: keeps up to depth reads in flight ahead of the consumer. */
+static void aio_stage_read(aio_stage *stage, void *context) {
+  int fd = *(int *) context;
+  aio_slot *slot;
+  ssize_t bytesread;
+  
+  while((slot = aio_stage_reserve(stage))) {
+    while((bytesread = read(fd, slot->start, slot->capacity)) < 0 && errno == EINTR)
+      continue;
+    
+    if(bytesread > 0)
+      slot->length = bytesread;
+    else
+      slot->status = (bytesread == 0 ? AIO_ERROR_END_BUFFER : AIO_ERROR_IO_READ_ERROR);
+    
+    aio_stage_commit(stage, slot);
+    
+    if(slot->status != 0)
+      break;
+  }
+}
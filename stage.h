@@ -0,0 +1,94 @@
+/* A pipeline stage that produces input for an aio_buffer on its own thread, so that
+ * reading (and later decoding) overlaps with whatever the consumer does with the lines.
+ *
+ * Data is passed through a ring of fixed-size slots. The producer reserves slots in
+ * order, fills them (possibly out of order, from several threads) and commits them;
+ * the consumer takes them strictly in order. Every slot has some headroom in front of
+ * the payload so the consumer can prepend the partial line left over from the previous
+ * slot without copying the new data.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifndef AIO_STAGE
+#define AIO_STAGE
+
+#define AIO_STAGE_MIN_DEPTH 3 /* the consumer holds up to two slots at a time */
+
+typedef struct aio_slot {
+  char *data; /* start of the allocation */
+  char *start; /* start of the payload; .headroom bytes before it are free for the consumer */
+  size_t headroom;
+  size_t capacity; /* maximum payload */
+  size_t length; /* payload actually produced */
+  
+  int status; /* 0, AIO_ERROR_END_BUFFER or another AIO_ERROR_ code */
+  int ready; /* set by aio_stage_commit, cleared by aio_stage_release */
+  
+  unsigned long seq; /* position of the slot in the stream */
+} aio_slot;
+
+typedef struct aio_stage aio_stage;
+typedef void (*aio_stage_fn)(aio_stage *stage, void *context);
+typedef void (*aio_stage_freefn)(void *context);
+
+struct aio_stage {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  
+  aio_slot *slots;
+  int depth;
+  
+  unsigned long head; /* oldest slot not yet released by the consumer */
+  unsigned long taken; /* slots after .head already handed to the consumer */
+  unsigned long tail; /* next slot the producer reserves */
+  int stopping;
+  
+  aio_stage_fn producer;
+  aio_stage_freefn freecontext;
+  void *context;
+};
+
+/* Allocates a stage with depth slots of capacity bytes each (plus headroom) and starts
+ * producer(stage, context) on a new thread. The producer reserves, fills and commits slots
+ * until it commits one with a non-zero status or aio_stage_reserve returns 0. freecontext
+ * (if not 0) is called on the context once the thread has finished.
+ */
+aio_stage *aio_stage_start(int depth, size_t capacity, size_t headroom,
+  aio_stage_fn producer, void *context, aio_stage_freefn freecontext);
+
+/* Stops the producer, waits for its thread to exit and frees everything. */
+void aio_stage_free(aio_stage *stage);
+
+/* Producer side */
+
+/* Blocks until a slot is free and hands out the next one in sequence.
+ * Returns 0 if the consumer is shutting the stage down.
+ */
+aio_slot *aio_stage_reserve(aio_stage *stage);
+
+/* Publishes a reserved slot. Slots can be committed in any order. */
+void aio_stage_commit(aio_stage *stage, aio_slot *slot);
+
+/* Makes room for at least capacity bytes of payload, keeping the headroom and whatever
+ * has been produced so far. Only valid on a slot that has been reserved but not committed.
+ */
+void aio_slot_grow(aio_slot *slot, size_t capacity);
+
+/* Consumer side */
+
+/* Blocks until the slot after the ones already taken is ready and returns it.
+ * A slot with a non-zero status marks the end of the stream; it stays in place, so
+ * calling this again returns it again.
+ */
+aio_slot *aio_stage_next(aio_stage *stage);
+
+/* Hands the oldest taken slot back to the producer. */
+void aio_stage_release(aio_stage *stage);
+
+/* Starts a stage that read()s fd into slots of bufsize bytes. */
+aio_stage *aio_stage_reader(int fd, int depth, size_t bufsize, size_t headroom);
+
+#endif
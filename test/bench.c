@@ -0,0 +1,262 @@
+/* Micro-benchmarks for the pieces ipscan is built from, run by benchmark.pl on the logs
+ * and lists made by loggen.pl. Each one is run a number of times over data already in
+ * memory, so the disk never gets in the way, and the fastest run is reported.
+ *
+ * Usage: bench LIST LOG [REPEAT]
+ * Prints a JSON array with one object per benchmark to STDOUT.
+ */
+
+#include "../input.h"
+#include "../ip_tree.h"
+#include "../common.h"
+
+#define BENCH_ALIGN 64 /* the line splitter reads whole aligned blocks of this many bytes */
+#define BENCH_BATCH 16 /* addresses per findip_batch call, as many as a line is looked up with */
+
+typedef struct {
+  char *data;
+  size_t size;
+  size_t lines;
+} BenchFile;
+
+typedef struct {
+  ip_t *ips;
+  size_t count;
+  size_t size;
+} BenchIPs;
+
+typedef struct {
+  const char *name;
+  const char *unit; /* what items counts */
+  uint64_t items;
+  uint64_t bytes; /* 0 if throughput in bytes means nothing for it */
+  double seconds; /* fastest run */
+} BenchResult;
+
+static aio_buffer *lines;
+static int repeat = 3;
+static int first = 1;
+
+/* Reads a whole file into memory, padded so the line splitter may look past its end. */
+static void readfile(const char *path, BenchFile *file) {
+  FILE *in = fopen(path, "r");
+  if(!in) {
+    fprintf(stderr, "bench: could not open %s.\n", path);
+    exit(-1);
+  }
+  
+  fseek(in, 0, SEEK_END);
+  file->size = (size_t) ftell(in);
+  fseek(in, 0, SEEK_SET);
+  
+  file->data = xmemalign(BENCH_ALIGN, file->size + BENCH_ALIGN);
+  memset(file->data + file->size, 0, BENCH_ALIGN);
+  
+  if(fread(file->data, 1, file->size, in) != file->size) {
+    fprintf(stderr, "bench: could not read %s.\n", path);
+    exit(-1);
+  }
+  fclose(in);
+  
+  file->lines = 0;
+  aio_buffer_wrap(lines, file->data, file->data + file->size);
+  while(aio_buffer_loadline(lines) == 0)
+    ++file->lines;
+}
+
+static void report(BenchResult *result) {
+  printf("%s\n  {\"name\": \"%s\", \"unit\": \"%s\", \"items\": %llu, \"bytes\": %llu, \"seconds\": %.6f, "
+    "\"items_per_sec\": %.0f, \"mb_per_sec\": %.2f}",
+    (first ? "[" : ","), result->name, result->unit, (unsigned long long) result->items,
+    (unsigned long long) result->bytes, result->seconds,
+    result->items / result->seconds, result->bytes / result->seconds / 1e6);
+  
+  first = 0;
+  fflush(stdout);
+}
+
+/* Keeps the fastest of the runs so far. */
+static void timed(BenchResult *result, uint64_t start) {
+  double seconds = (nanotime() - start) / 1e9;
+  
+  if(result->seconds == 0 || seconds < result->seconds)
+    result->seconds = seconds;
+}
+
+static int countip(const IPFound *found, void *context) {
+  ++*(uint64_t *) context;
+  return 0;
+}
+
+static int collectip(const IPFound *found, void *context) {
+  BenchIPs *ips = (BenchIPs *) context;
+  
+  if(found->family == IP_FAMILY_4) {
+    if(ips->count == ips->size) {
+      ips->size *= 2;
+      ips->ips = xrealloc(ips->ips, sizeof(ip_t) * ips->size);
+    }
+    ips->ips[ips->count++] = found->ip;
+  }
+  
+  return 0;
+}
+
+/* aio_buffer_loadline over the log. */
+static void bench_split(BenchFile *log) {
+  BenchResult result = {"split", "lines", log->lines, log->size, 0};
+  int i;
+  
+  for(i = 0; i < repeat; ++i) {
+    uint64_t start = nanotime();
+    aio_buffer_wrap(lines, log->data, log->data + log->size);
+    while(aio_buffer_loadline(lines) == 0)
+      continue;
+    timed(&result, start);
+  }
+  
+  report(&result);
+}
+
+/* Every address on every line of the log, as detectip_str finds them. */
+static void bench_detect(BenchFile *log) {
+  BenchResult result = {"detect", "lines", log->lines, log->size, 0};
+  IPScannerRef scanner = makeipscanner();
+  uint64_t found = 0;
+  int i;
+  
+  for(i = 0; i < repeat; ++i) {
+    uint64_t start = nanotime();
+    aio_buffer_wrap(lines, log->data, log->data + log->size);
+    while(aio_buffer_loadline(lines) == 0)
+      eachip_str(scanner, lines->linestart, lines->linelimit, countip, &found);
+    timed(&result, start);
+  }
+  
+  freeipscanner(scanner);
+  report(&result);
+}
+
+/* The list added one entry at a time with addip_str, or in bulk with a loader. */
+static IPTreeRef bench_load(BenchFile *list, int bulk) {
+  BenchResult result = {(bulk ? "load_bulk" : "load_addip"), "entries", list->lines, list->size, 0};
+  IPTreeRef tree = 0;
+  int i;
+  
+  for(i = 0; i < repeat; ++i) {
+    if(tree)
+      iptree_free(tree);
+    
+    uint64_t start = nanotime();
+    tree = makeiptree();
+    IPLoaderRef loader = (bulk ? makeiploader() : 0);
+    
+    aio_buffer_wrap(lines, list->data, list->data + list->size);
+    while(aio_buffer_loadline(lines) == 0) {
+      if(bulk)
+        iploader_add_str(loader, lines->linestart, lines->linelimit);
+      else
+        addip_str(tree, lines->linestart, lines->linelimit);
+    }
+    
+    if(bulk) {
+      iptree_load(tree, loader);
+      freeiploader(loader);
+    }
+    timed(&result, start);
+  }
+  
+  report(&result);
+  return tree;
+}
+
+/* Lookups of the IPv4 addresses of the log, one at a time or BENCH_BATCH at a time. */
+static void bench_find(const char *name, IPTreeRef tree, BenchIPs *ips, int batch) {
+  BenchResult result = {name, "lookups", ips->count, 0, 0};
+  const ip_t *all = ips->ips;
+  uint8_t out[BENCH_BATCH];
+  volatile size_t found = 0; /* so the lookups aren't optimized away */
+  size_t n;
+  int i;
+  
+  for(i = 0; i < repeat; ++i) {
+    uint64_t start = nanotime();
+    if(batch) {
+      for(n = 0; n < ips->count; n += BENCH_BATCH)
+        found += findip_batch(tree, all + n, (ips->count - n < BENCH_BATCH ? ips->count - n : BENCH_BATCH), out);
+    } else {
+      for(n = 0; n < ips->count; ++n)
+        found += findip(tree, all[n]);
+    }
+    timed(&result, start);
+  }
+  
+  report(&result);
+}
+
+/* What ipscan does for every line with -p 0, without the output. */
+static void bench_match(IPTreeRef tree, BenchFile *log) {
+  BenchResult result = {"match", "lines", log->lines, log->size, 0};
+  IPScannerRef scanner = makeipscanner();
+  volatile size_t found = 0;
+  int i;
+  
+  for(i = 0; i < repeat; ++i) {
+    uint64_t start = nanotime();
+    aio_buffer_wrap(lines, log->data, log->data + log->size);
+    while(aio_buffer_loadline(lines) == 0)
+      found += (findip_str_r(tree, scanner, lines->linestart, lines->linelimit, 0) == 1);
+    timed(&result, start);
+  }
+  
+  freeipscanner(scanner);
+  report(&result);
+}
+
+int main(int argc, char **argv) {
+  BenchFile list, log;
+  BenchIPs ips;
+  
+  if(argc < 3) {
+    fprintf(stderr, "Usage: bench LIST LOG [REPEAT]\n");
+    return -1;
+  }
+  if(argc > 3 && (repeat = atoi(argv[3])) < 1)
+    repeat = 1;
+  
+  lines = aio_buffer_alloc();
+  readfile(argv[1], &list);
+  readfile(argv[2], &log);
+  
+  bench_split(&log);
+  bench_detect(&log);
+  
+  iptree_free(bench_load(&list, 0));
+  IPTreeRef tree = bench_load(&list, 1);
+  
+  /* the addresses are taken out of the log beforehand so only the lookups are timed */
+  IPScannerRef scanner = makeipscanner();
+  ips.size = log.lines + 1;
+  ips.ips = xmalloc(sizeof(ip_t) * ips.size);
+  ips.count = 0;
+  aio_buffer_wrap(lines, log.data, log.data + log.size);
+  while(aio_buffer_loadline(lines) == 0)
+    eachip_str(scanner, lines->linestart, lines->linelimit, collectip, &ips);
+  freeipscanner(scanner);
+  
+  bench_find("findip_tree", tree, &ips, 0);
+  iptree_compile(tree);
+  bench_find("findip_table", tree, &ips, 0);
+  bench_find("findip_batch", tree, &ips, 1);
+  bench_match(tree, &log);
+  
+  printf("\n]\n");
+  
+  iptree_free(tree);
+  free(ips.ips);
+  free(list.data);
+  free(log.data);
+  aio_buffer_free(lines);
+  
+  return 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env perl
+# Benchmarks ipscan and the pieces it is built from on logs and lists made by loggen.pl,
+# and prints the results as JSON. Run by make benchmark, from this directory.
+#
+# Usage: benchmark.pl IPSCAN [OPTION]...
+#   --lines N        lines per log (default: 500000)
+#   --cidrs N        blocks in the list (default: 20000)
+#   --repeat N       runs per benchmark, the fastest counts (default: 3)
+#   --bench PATH     the micro-benchmarks (default: ./bench)
+#   --output FILE    write the JSON to FILE instead of STDOUT
+#   --compare FILE   print how much faster or slower each benchmark is than in FILE, the
+#                    output of an earlier run, to STDERR
+#
+# e.g. make benchmark BENCHFLAGS="--output new.json --compare old.json"
+
+use strict;
+use warnings;
+use Getopt::Long;
+use File::Temp qw(tempdir);
+use JSON::PP;
+use POSIX qw(strftime);
+use Time::HiRes qw(time);
+
+my $ipscan = shift(@ARGV) or die "Usage: $0 IPSCAN [OPTION]...\n";
+my %opt = (lines => 500000, cidrs => 20000, repeat => 3, bench => './bench');
+
+GetOptions(\%opt, 'lines=i', 'cidrs=i', 'repeat=i', 'bench=s', 'output=s', 'compare=s')
+  or die "Invalid options, see the top of $0.\n";
+die "Could not run $ipscan.\n" unless -x $ipscan;
+
+my $dir = tempdir('ipscan-bench-XXXXXX', TMPDIR => 1, CLEANUP => 1);
+my $threads = `nproc 2>/dev/null` || 1;
+chomp($threads);
+
+# Each dataset has its own seed so it is the same on every run.
+my @datasets = (
+  {name => 'syslog', seed => 1, args => ['--format', 'syslog', '--ip-density', 1.5, '--match-ratio', 0.1]},
+  {name => 'firewall', seed => 2, args => ['--format', 'firewall', '--ip-density', 2, '--match-ratio', 0.05, '--ipv6', 0.1]},
+);
+
+# What ipscan is run with, on every dataset unless only is set.
+my @runs = (
+  {name => 'any', args => ['-p', 0]},
+  {name => 'first', args => ['-p', 1]},
+  {name => 'last', args => ['-p', -1]},
+  {name => 'after', args => ['--after', 'SRC=', '-p', 1], only => 'firewall'},
+  {name => 'count', args => ['--count-by', 'block', '--top', 10]},
+);
+push @runs, {name => "threads$threads", args => ['-j', $threads, '-p', 0]} if $threads > 1;
+
+my @results;
+
+for my $data (@datasets) {
+  my $log = "$dir/$data->{name}.log";
+  my $list = "$dir/$data->{name}.list";
+
+  system($^X, 'loggen.pl', '--seed', $data->{seed}, '--lines', $opt{lines}, '--cidrs', $opt{cidrs},
+    '--list', $list, @{$data->{args}}, '--output', $log) == 0 or die "loggen.pl failed.\n";
+
+  my $bytes = -s $log;
+  my $lines = $opt{lines};
+
+  open(my $bench, '-|', $opt{bench}, $list, $log, $opt{repeat}) or die "Could not run $opt{bench}: $!\n";
+  my $micro = decode_json(do { local $/; <$bench> });
+  close($bench) or die "$opt{bench} failed.\n";
+
+  push @results, map { {dataset => $data->{name}, %$_} } @$micro;
+
+  for my $run (@runs) {
+    next if $run->{only} && $run->{only} ne $data->{name};
+
+    my @command = ($ipscan, '--quiet', '-i', $list, @{$run->{args}}, $log);
+    my $best;
+
+    for (1 .. $opt{repeat}) {
+      my $start = time();
+      system(join(' ', map { quotemeta } @command) . ' > /dev/null') == 0 or die "@command failed.\n";
+      my $seconds = time() - $start;
+      $best = $seconds if !defined($best) || $seconds < $best;
+    }
+
+    push @results, {
+      dataset => $data->{name},
+      name => "ipscan_$run->{name}",
+      unit => 'lines',
+      items => $lines,
+      bytes => $bytes,
+      seconds => sprintf('%.6f', $best) + 0,
+      items_per_sec => int($lines / $best),
+      mb_per_sec => sprintf('%.2f', $bytes / $best / 1e6) + 0,
+      command => join(' ', 'ipscan', @{$run->{args}}),
+    };
+  }
+}
+
+my ($version) = split(/\n/, `$ipscan -V`);
+
+my $report = {
+  version => $version,
+  date => strftime('%Y-%m-%dT%H:%M:%SZ', gmtime()),
+  threads => $threads + 0,
+  params => {lines => $opt{lines}, cidrs => $opt{cidrs}, repeat => $opt{repeat}},
+  results => \@results,
+};
+
+my $json = JSON::PP->new->canonical->pretty->encode($report);
+if (defined $opt{output}) {
+  open(my $out, '>', $opt{output}) or die "Could not write $opt{output}: $!\n";
+  print $out $json;
+  close($out);
+} else {
+  print $json;
+}
+
+if (defined $opt{compare}) {
+  open(my $in, '<', $opt{compare}) or die "Could not read $opt{compare}: $!\n";
+  my $old = decode_json(do { local $/; <$in> });
+  my %before = map { ("$_->{dataset}/$_->{name}" => $_) } @{$old->{results}};
+
+  printf STDERR "%-30s %12s %12s %8s\n", 'benchmark', 'before/s', 'after/s', 'speedup';
+  for my $result (@results) {
+    my $key = "$result->{dataset}/$result->{name}";
+    next unless $before{$key};
+    printf STDERR "%-30s %12.0f %12.0f %7.2fx\n", $key, $before{$key}{items_per_sec},
+      $result->{items_per_sec}, $result->{items_per_sec} / $before{$key}{items_per_sec};
+  }
+}
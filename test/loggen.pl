@@ -0,0 +1,136 @@
+#!/usr/bin/env perl
+# Writes a synthetic log and the list of CIDR blocks to search it for. The same options
+# and seed always give the same files, on any machine, so runs of different builds can
+# be compared.
+#
+# Usage: loggen.pl [OPTION]... > LOG
+#   --lines N          lines of log (default: 100000)
+#   --format FORMAT    syslog (sshd-like, the address early on) or firewall (iptables-like
+#                      SRC=/DST= lines of about 300 bytes) (default: syslog)
+#   --line-length N    pad lines with text to about N bytes (default: as the format comes)
+#   --ip-density N     addresses per line on average, may be fractional (default: 2)
+#   --match-ratio R    fraction of lines whose first address is in the list (default: 0.1)
+#   --ipv6 R           fraction of addresses that are IPv6 (default: 0)
+#   --cidrs N          blocks in the list (default: 10000)
+#   --list FILE        write the list to FILE
+#   --output FILE      write the log to FILE instead of STDOUT
+#   --seed N           (default: 1)
+#
+# Addresses in the list are drawn from 1.0.0.0-126.255.255.255 and 2001:db8::/32, all
+# others from 128.0.0.0-223.255.255.255 and 2001:db9::/32, so only the lines picked by
+# --match-ratio ever match.
+
+use strict;
+use warnings;
+use Getopt::Long;
+
+my %opt = (
+  lines => 100000,
+  format => 'syslog',
+  'line-length' => 0,
+  'ip-density' => 2,
+  'match-ratio' => 0.1,
+  ipv6 => 0,
+  cidrs => 10000,
+  list => undef,
+  output => undef,
+  seed => 1,
+);
+
+GetOptions(\%opt, 'lines=i', 'format=s', 'line-length=i', 'ip-density=f', 'match-ratio=f',
+  'ipv6=f', 'cidrs=i', 'list=s', 'output=s', 'seed=i') or die "Invalid options, see the top of $0.\n";
+die "Unknown format $opt{format}.\n" unless $opt{format} =~ /^(syslog|firewall)$/;
+
+# xorshift32: Perl's own rand differs between platforms
+my $state = ($opt{seed} * 2654435761 + 1) & 0xffffffff || 1;
+
+sub next32 {
+  $state ^= ($state << 13) & 0xffffffff;
+  $state ^= $state >> 17;
+  $state ^= ($state << 5) & 0xffffffff;
+  return $state;
+}
+
+sub rnd { return next32() % $_[0]; }
+sub chance { return next32() / 4294967296 < $_[0]; }
+
+sub ip4 { my $ip = shift; return join('.', $ip >> 24, ($ip >> 16) & 255, ($ip >> 8) & 255, $ip & 255); }
+sub ip6 { return sprintf('2001:%x:%x:%x::%x', @_); }
+
+# The list: mostly /24s, as feeds usually are, with some larger and smaller blocks.
+my (@blocks4, @blocks6);
+for (1 .. $opt{cidrs}) {
+  if ($opt{ipv6} && chance($opt{ipv6})) {
+    push @blocks6, [rnd(65536), rnd(65536)];
+    next;
+  }
+
+  my $r = rnd(100);
+  my $len = ($r < 60 ? 24 : $r < 80 ? 16 + rnd(8) : 25 + rnd(8));
+  my $ip = ((1 + rnd(126)) << 24 | rnd(1 << 24)) & ~((1 << (32 - $len)) - 1) & 0xffffffff;
+  push @blocks4, [$ip, $len];
+}
+
+if (defined $opt{list}) {
+  open(my $list, '>', $opt{list}) or die "Could not write $opt{list}: $!\n";
+  print $list ip4($_->[0]), "/$_->[1]\n" for @blocks4;
+  printf $list "2001:db8:%x:%x::/64\n", @$_ for @blocks6;
+  close($list);
+}
+
+sub address {
+  my $match = shift;
+
+  if ($opt{ipv6} && chance($opt{ipv6})) {
+    return ip6(0xdb8, @{$blocks6[rnd(scalar @blocks6)]}, 1 + rnd(65535)) if $match && @blocks6;
+    return ip6(0xdb9, rnd(65536), rnd(65536), 1 + rnd(65535)) unless $match;
+  }
+
+  if ($match && @blocks4) {
+    my ($ip, $len) = @{$blocks4[rnd(scalar @blocks4)]};
+    return ip4($ip | ($len == 32 ? 0 : rnd(1 << (32 - $len))));
+  }
+
+  return ip4((128 + rnd(96)) << 24 | rnd(1 << 24));
+}
+
+if (defined $opt{output}) {
+  open(STDOUT, '>', $opt{output}) or die "Could not write $opt{output}: $!\n";
+}
+
+my @months = qw(Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec);
+my @words = qw(session opened closed for user root admin deploy www-data from port
+  connection reset by peer timeout accepted publickey password invalid preauth);
+
+sub stamp {
+  my $n = shift;
+  return sprintf('%s %2d %02d:%02d:%02d', $months[($n / 2678400) % 12], 1 + ($n / 86400) % 28,
+    ($n / 3600) % 24, ($n / 60) % 60, $n % 60);
+}
+
+for my $n (0 .. $opt{lines} - 1) {
+  my $count = int($opt{'ip-density'}) + (chance($opt{'ip-density'} - int($opt{'ip-density'})) ? 1 : 0);
+  my $match = chance($opt{'match-ratio'});
+  my @ips = map { address($match && $_ == 0) } 0 .. $count - 1;
+  my $line;
+
+  if ($opt{format} eq 'firewall') {
+    my $src = shift(@ips) // '-';
+    my $dst = shift(@ips) // '-';
+    $line = sprintf('%s fw%d kernel: [%d.%06d] [UFW BLOCK] IN=eth0 OUT= MAC=52:54:00:%02x:%02x:%02x:52:54:00:12:35:02:08:00 '
+      . 'SRC=%s DST=%s LEN=%d TOS=0x00 PREC=0x00 TTL=%d ID=%d DF PROTO=TCP SPT=%d DPT=%d WINDOW=%d RES=0x00 SYN URGP=0',
+      stamp($n), rnd(4), 100000 + $n, rnd(1000000), rnd(256), rnd(256), rnd(256), $src, $dst,
+      40 + rnd(1400), 32 + rnd(96), rnd(65536), 1024 + rnd(64000), (22, 80, 443, 3389)[rnd(4)], rnd(65536));
+    $line .= " ORIG=$_" for @ips;
+  } else {
+    $line = sprintf('%s host%d sshd[%d]: %s %s user%d from %s port %d ssh2', stamp($n), rnd(16), 1000 + rnd(30000),
+      $words[rnd(scalar @words)], $words[rnd(scalar @words)], rnd(500), (shift(@ips) // 'unknown'), 1024 + rnd(64000));
+    $line .= " via $_" for @ips;
+  }
+
+  while (length($line) < $opt{'line-length'}) {
+    $line .= ' ' . (chance(0.2) ? 'id=' . rnd(100000) : $words[rnd(scalar @words)]);
+  }
+
+  print $line, "\n";
+}
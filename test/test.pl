@@ -0,0 +1,199 @@
+#!/usr/bin/env perl
+# Checks ipscan's output: that --no-simd (the plain C line splitter and address scanner)
+# and the default SSE2/AVX2 code find exactly the same addresses on input made to trip
+# them up, and that threads, compressed input, saved sets and the other options give what
+# the plain way does. Run by make test, from this directory; prints TAP.
+#
+# Usage: test.pl IPSCAN [SEED]
+
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+use Compress::Zlib;
+
+my $ipscan = shift(@ARGV) or die "Usage: $0 IPSCAN [SEED]\n";
+my $seed = shift(@ARGV) // 1;
+die "Could not run $ipscan.\n" unless -x $ipscan;
+
+my $dir = tempdir('ipscan-test-XXXXXX', TMPDIR => 1, CLEANUP => 1);
+my ($tests, $failed) = (0, 0);
+
+sub ok {
+  my ($ok, $name, $detail) = @_;
+  ++$tests;
+  ++$failed unless $ok;
+  print(($ok ? 'ok' : 'not ok'), " $tests - $name\n");
+  print map { "#   $_\n" } split(/\n/, $detail) if !$ok && defined $detail;
+}
+
+sub ipscan {
+  my $command = join(' ', map { quotemeta } $ipscan, '--quiet', @_);
+  my $output = `$command 2>&1`;
+  return ($? == 0 ? $output : "exit status $?: $output");
+}
+
+sub writefile {
+  my ($name, @lines) = @_;
+  open(my $out, '>', "$dir/$name") or die "Could not write $dir/$name: $!\n";
+  print $out map { "$_\n" } @lines;
+  close($out);
+  return "$dir/$name";
+}
+
+sub readfile {
+  my ($path) = @_;
+  open(my $in, '<', $path) or die "Could not read $path: $!\n";
+  binmode($in);
+  return do { local $/; <$in> };
+}
+
+# BGZF, as bgzip writes it: gzip members of at most 64k, each saying how long it is.
+sub bgzf {
+  my ($data) = @_;
+  my $out = '';
+  
+  for (my $pos = 0; $pos < length($data); $pos += 65280) {
+    my $piece = substr($data, $pos, 65280);
+    my $deflate = deflateInit(-WindowBits => -MAX_WBITS());
+    my $body = $deflate->deflate($piece) . $deflate->flush();
+    $out .= pack('C4 V C2 v a2 v v', 0x1f, 0x8b, 8, 4, 0, 0, 255, 6, 'BC', 2, length($body) + 25)
+      . $body . pack('V V', crc32($piece), length($piece));
+  }
+  
+  return $out;
+}
+
+# xorshift32, so a seed gives the same input everywhere
+my $state = ($seed * 2654435761 + 1) & 0xffffffff || 1;
+
+sub rnd {
+  $state ^= ($state << 13) & 0xffffffff;
+  $state ^= $state >> 17;
+  $state ^= ($state << 5) & 0xffffffff;
+  return $state % $_[0];
+}
+
+# Lines that are mostly what addresses are made of, with addresses and near misses (too
+# many digits or groups, octets over 255, prefixes, :: in odd places) at every offset, and
+# runs of 32 bytes and more without any of them so whole vector blocks are skipped.
+my @pieces = ('1.2.3.4', '255.255.255.255', '256.1.1.1', '1.2.3.4.5', '01.2.3.4', '1.2.3', '10.0.0.1/8',
+  '::', '::1', '2001:db8::1', 'fe80::1:2:3:4', '1:2:3:4:5:6:7:8', '1:2:3:4:5:6:7:8:9', '::ffff:1.2.3.4',
+  'abcd::', ':::', '1::2::3', 'dead:beef::cafe', '999.0.0.1', '0.0.0.0', '1..2.3', '::1.2.3.4');
+my @chars = (0 .. 9, '.', ':', 'a' .. 'f', 'A' .. 'F', '/', ' ', ' ', 'x', '-', ',', '[', ']');
+
+my @lines;
+for (1 .. 3000) {
+  my $target = rnd(300);
+  my $line = '';
+
+  while (length($line) < $target) {
+    my $r = rnd(10);
+    if ($r < 4) {
+      $line .= $pieces[rnd(scalar @pieces)];
+    } elsif ($r < 8) {
+      $line .= $chars[rnd(scalar @chars)] for 1 .. 1 + rnd(6);
+    } else {
+      $line .= ('z' x (32 + rnd(70)));
+    }
+  }
+
+  push @lines, $line;
+}
+push @lines, '', '1.2.3.4', ('9' x 200) . ' 5.6.7.8', ' ' x 64 . '::1';
+
+my $fuzz = writefile('fuzz.log', @lines);
+
+my $list = writefile('fuzz.list', '1.2.3.4', '5.6.7.8/30', '::1', '2001:db8::/32', '255.0.0.0/8');
+
+for my $pos (0, 1, 2, 3, -1, -2) {
+  my @args = ('-i', $list, '-p', $pos, $fuzz);
+  my $simd = ipscan(@args);
+  my $plain = ipscan('--no-simd', @args);
+  ok($simd eq $plain && $simd ne '', "--no-simd matches the same lines with -p $pos");
+}
+
+{
+  my $simd = ipscan('-v', '-i', $list, $fuzz);
+  my $plain = ipscan('--no-simd', '-v', '-i', $list, $fuzz);
+  ok($simd eq $plain && $simd ne '', '--no-simd matches the same lines with -v');
+}
+
+ok(ipscan('--dump-ips', '-I', '10.0.0.0/24', '-I', '10.0.1.0/24') eq "10.0.0.0/23\n",
+  'adjacent blocks are merged');
+
+{
+  my $log = writefile('position.log', 'a 1.1.1.1 b 2.2.2.2', 'a 2.2.2.2 b 1.1.1.1', 'none', '3.3.3.3');
+  ok(ipscan('-I', '2.2.2.2', '-p', -1, $log) eq "a 1.1.1.1 b 2.2.2.2\n", '-p -1 checks the last address');
+  ok(ipscan('-I', '2.2.2.2', '-p', 1, $log) eq "a 2.2.2.2 b 1.1.1.1\n", '-p 1 checks the first address');
+  ok(ipscan('-I', '2.2.2.2', '-v', $log) eq "3.3.3.3\n", '-v prints the lines whose addresses are not in the list');
+}
+
+{
+  my $log = writefile('fields.log', '1.1.1.1,x,2.2.2.2 src=3.3.3.3', '2.2.2.2,x,1.1.1.1 src=4.4.4.4');
+  ok(ipscan('-I', '2.2.2.2', '-p', 1, '--field', 3, '--delimiter', ',', $log) eq "1.1.1.1,x,2.2.2.2 src=3.3.3.3\n",
+    '--field looks for addresses in the field only');
+  ok(ipscan('-I', '3.3.3.3', '-p', 1, '--after', 'src=', $log) eq "1.1.1.1,x,2.2.2.2 src=3.3.3.3\n",
+    '--after looks for addresses after the string only');
+}
+
+{
+  my $left = writefile('left.list', '10.0.0.0/23', '192.168.0.0/24');
+  my $right = writefile('right.list', '10.0.1.0/24', '192.168.0.128/25', '172.16.0.0/12');
+  ok(ipscan('--dump-ips', '-i', $left, '--intersect-list', $right) eq "10.0.1.0/24\n192.168.0.128/25\n",
+    '--intersect-list keeps the addresses in both lists');
+  ok(ipscan('--dump-ips', '-i', $left, '--exclude-list', $right) eq "10.0.0.0/24\n192.168.0.0/25\n",
+    '--exclude-list removes the addresses in the other list');
+}
+
+{
+  my $set = "$dir/fuzz.set";
+  ipscan('-i', $list, '--save-set', $set);
+  ok(-s $set && ipscan('--load-set', $set, '--dump-ips') eq ipscan('-i', $list, '--dump-ips')
+    && ipscan('--load-set', $set, $fuzz) eq ipscan('-i', $list, $fuzz), '--load-set reads back what --save-set saved');
+}
+
+{
+  my (%count, @log);
+  for (1 .. 2000) {
+    my $ip = join('.', 10, rnd(3), rnd(4), rnd(40));
+    ++$count{$ip};
+    push @log, 'user' . rnd(100) . " from $ip port " . rnd(65536);
+  }
+  
+  my $log = writefile('count.log', @log);
+  my $uniq = join('', sort map { sprintf("%7d %s\n", $count{$_}, $_) } keys %count);
+  my $counts = join('', sort split(/^/, ipscan('-I', '10.0.0.0/8', '--count-by', 'ip', $log)));
+  ok($counts eq $uniq, '--count-by ip counts the same as sort | uniq -c');
+}
+
+# Over two chunks (see chunks.h) of the fuzz lines, so -j really splits the file.
+{
+  my $big = writefile('big.log', (@lines) x 25);
+  my $one = ipscan('-j', 1, '-i', $list, $big);
+  ok($one ne '' && ipscan('-j', 4, '-i', $list, $big) eq $one, '-j 4 prints the same as -j 1');
+  ok(ipscan('-j', 4, '-v', '-i', $list, $big) eq ipscan('-j', 1, '-v', '-i', $list, $big), '-j 4 prints the same as -j 1 with -v');
+}
+
+# Only when ipscan was built with zlib (without it, compressed input is passed through).
+{
+  my $data = readfile($fuzz);
+  my $plain = ipscan('-i', $list, $fuzz);
+  my ($gz, $bgz) = ("$dir/fuzz.log.gz", "$dir/fuzz.log.bgz");
+  
+  open(my $out, '>', $gz) or die "Could not write $gz: $!\n";
+  print $out Compress::Zlib::memGzip($data);
+  close($out);
+  open($out, '>', $bgz) or die "Could not write $bgz: $!\n";
+  print $out bgzf($data);
+  close($out);
+  
+  if (ipscan('-I', '0.0.0.0/0', '-I', '::/0', $gz) eq ipscan('-I', '0.0.0.0/0', '-I', '::/0', '--no-decompress', $gz)) {
+    print "ok ", ++$tests, " # skip ipscan was built without zlib\n" for 1 .. 2;
+  } else {
+    ok(ipscan('-i', $list, $gz) eq $plain, 'gzip input reads the same as the plain file');
+    ok(ipscan('--decompress-threads', 4, '-i', $list, $bgz) eq $plain, 'BGZF input reads the same on several threads');
+  }
+}
+
+print "1..$tests\n";
+exit($failed ? 1 : 0);